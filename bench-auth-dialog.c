@@ -0,0 +1,176 @@
+/*
+ * bench-auth-dialog - Startup benchmark for the authentication handler
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+typedef struct {
+	const char *name;
+	const char *input;
+	const char *extra_args[3];
+} BenchCase;
+
+/* What NetworkManager feeds the auth dialog on stdin. */
+static const BenchCase cases[] = {
+	{
+		.name = "non-interactive",
+		.input = "DATA_KEY=gateway\nDATA_VAL=novpn.example.com\n\n"
+		         "SECRET_KEY=password\nSECRET_VAL=hunter2\n\n"
+		         "DONE\n\n",
+		.extra_args = { NULL },
+	},
+	{
+		.name = "interactive",
+		.input = "DATA_KEY=gateway\nDATA_VAL=novpn.example.com\n\n"
+		         "DONE\n\n",
+		.extra_args = { "--allow-interaction", "--external-ui-mode", NULL },
+	},
+};
+
+static gboolean
+run_once (const char *auth_dialog,
+          const BenchCase *bench_case,
+          gint64 *elapsed,
+          GError **error)
+{
+	g_autoptr(GPtrArray) argv = g_ptr_array_new ();
+	const char *p;
+	gint64 start;
+	GPid pid;
+	int stdin_fd;
+	int status;
+	gsize left;
+	gssize len;
+	int i;
+
+	g_ptr_array_add (argv, (gpointer) auth_dialog);
+	g_ptr_array_add (argv, "--uuid");
+	g_ptr_array_add (argv, "5d1e5e5c-2f5c-4b7a-9d47-0b9e3c1b8a11");
+	g_ptr_array_add (argv, "--name");
+	g_ptr_array_add (argv, "bench");
+	g_ptr_array_add (argv, "--service");
+	g_ptr_array_add (argv, "org.freedesktop.NetworkManager.Novpn");
+	for (i = 0; bench_case->extra_args[i]; i++)
+		g_ptr_array_add (argv, (gpointer) bench_case->extra_args[i]);
+	g_ptr_array_add (argv, NULL);
+
+	start = g_get_monotonic_time ();
+
+	if (!g_spawn_async_with_pipes (NULL, (char **) argv->pdata, NULL,
+	                               G_SPAWN_DO_NOT_REAP_CHILD |
+	                               G_SPAWN_STDOUT_TO_DEV_NULL |
+	                               G_SPAWN_STDERR_TO_DEV_NULL,
+	                               NULL, NULL, &pid,
+	                               &stdin_fd, NULL, NULL, error)) {
+		return FALSE;
+	}
+
+	p = bench_case->input;
+	left = strlen (p);
+	while (left) {
+		len = write (stdin_fd, p, left);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len == -1)
+			break;
+		p += len;
+		left -= len;
+	}
+	close (stdin_fd);
+
+	if (waitpid (pid, &status, 0) == -1) {
+		g_set_error_literal (error, -1, -1, g_strerror (errno));
+		return FALSE;
+	}
+
+	*elapsed = g_get_monotonic_time () - start;
+	g_spawn_close_pid (pid);
+
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+		g_set_error (error, -1, -1, "%s exited with status %d", auth_dialog, status);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static int
+compare_gint64 (gconstpointer a, gconstpointer b)
+{
+	gint64 val_a = *(const gint64 *) a;
+	gint64 val_b = *(const gint64 *) b;
+
+	return val_a < val_b ? -1 : val_a > val_b;
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	g_autoptr(GError) error = NULL;
+	gint iterations = 100;
+	g_autofree gint64 *samples = NULL;
+	gint64 total;
+	guint c;
+	int i;
+
+	GOptionEntry options[] = {
+		{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Number of runs per case", NULL },
+		{NULL}
+	};
+
+	opt_ctx = g_option_context_new ("<path to nm-novpn-auth-dialog>");
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	if (argc != 2 || iterations < 1) {
+		g_printerr ("Usage: %s [--iterations N] <path to nm-novpn-auth-dialog>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	samples = g_new (gint64, iterations);
+
+	for (c = 0; c < G_N_ELEMENTS (cases); c++) {
+		total = 0;
+		for (i = 0; i < iterations; i++) {
+			if (!run_once (argv[1], &cases[c], &samples[i], &error)) {
+				g_printerr ("%s: %s\n", cases[c].name, error->message);
+				return EXIT_FAILURE;
+			}
+			total += samples[i];
+		}
+
+		qsort (samples, iterations, sizeof (gint64), compare_gint64);
+		g_print ("%-16s runs %d  min %6" G_GINT64_FORMAT " us  median %6" G_GINT64_FORMAT
+		         " us  mean %6" G_GINT64_FORMAT " us  max %6" G_GINT64_FORMAT " us\n",
+		         cases[c].name, iterations, samples[0], samples[iterations / 2],
+		         total / iterations, samples[iterations - 1]);
+	}
+
+	return EXIT_SUCCESS;
+}
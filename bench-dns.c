@@ -0,0 +1,266 @@
+/*
+ * bench-dns - Benchmark for the DNS stub
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "nm-novpn-dns.h"
+
+#define DOMAIN "example.com"
+/* Served by a second stub that the first one forwards to, with --forward. */
+#define OTHER_DOMAIN "example.org"
+
+/* Give up on a query after this long without any answer. */
+#define STALL_TIMEOUT_MS 1000
+
+static gboolean
+write_zone (const char *path, guint names, GError **error)
+{
+	GString *zone = g_string_new ("$TTL 300\n");
+	gboolean ret;
+	guint i;
+
+	for (i = 0; i < names; i++)
+		g_string_append_printf (zone, "host%u A 192.0.2.%u\n", i, i % 254 + 1);
+
+	ret = g_file_set_contents (path, zone->str, zone->len, error);
+	g_string_free (zone, TRUE);
+	return ret;
+}
+
+/* A query for an A record, without EDNS. */
+static gsize
+make_query (guint8 *buf, guint16 id, const char *name)
+{
+	char **labels = g_strsplit (name, ".", -1);
+	gsize len = 12;
+	guint i;
+
+	memset (buf, 0, 12);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xff;
+	buf[2] = 0x01;  /* RD */
+	buf[5] = 1;     /* QDCOUNT */
+
+	for (i = 0; labels[i]; i++) {
+		gsize label_len = strlen (labels[i]);
+
+		buf[len++] = label_len;
+		memcpy (buf + len, labels[i], label_len);
+		len += label_len;
+	}
+	buf[len++] = 0;
+	g_strfreev (labels);
+
+	buf[len++] = 0; buf[len++] = 1;  /* A */
+	buf[len++] = 0; buf[len++] = 1;  /* IN */
+
+	return len;
+}
+
+/* Whether the answer is to the question that was asked. */
+static gboolean
+same_question (const guint8 *query, gsize query_len, const guint8 *answer, gsize answer_len)
+{
+	return answer_len >= query_len && memcmp (query + 12, answer + 12, query_len - 12) == 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+	g_autofree char *dir = NULL;
+	g_autofree char *zone_file = NULL;
+	NovpnDnsParams params = { 0, };
+	NovpnDnsStats stats;
+	NovpnDns *dns = NULL;
+	NovpnDns *upstream = NULL;
+	g_autofree char *forward_to = NULL;
+	/* The name each ID in flight asked for. */
+	g_autofree guint *asked = g_new0 (guint, 0x10000);
+	guint8 expected[512];
+	gsize expected_len;
+	guint n;
+	struct sockaddr_in address = { 0, };
+	struct pollfd pfd;
+	guint8 query[512];
+	guint8 answer[512];
+	gint names = 1000;
+	gint queries = 200000;
+	gint window = 64;
+	gboolean forward = FALSE;
+	gint sent = 0, answered = 0, missing = 0, bad = 0;
+	gint64 start, elapsed;
+	ssize_t len;
+	int fd = -1;
+
+	GOptionEntry options[] = {
+		{ "names", 'n', 0, G_OPTION_ARG_INT, &names, "Number of names in the zone", "N" },
+		{ "queries", 0, 0, G_OPTION_ARG_INT, &queries, "Number of queries", "N" },
+		{ "window", 0, 0, G_OPTION_ARG_INT, &window, "Queries in flight", "N" },
+		{ "forward", 0, 0, G_OPTION_ARG_NONE, &forward, "Ask for names of another domain, which are forwarded", NULL },
+		{NULL}
+	};
+
+	opt_ctx = g_option_context_new (NULL);
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	if (names < 1 || queries < 1 || window < 1 || window > 0x10000) {
+		g_printerr ("Usage: %s [--names N] [--queries N] [--window N] [--forward]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	dir = g_dir_make_tmp ("bench-dns-XXXXXX", &error);
+	if (!dir)
+		goto fail;
+	zone_file = g_build_filename (dir, "zone", NULL);
+	if (!write_zone (zone_file, names, &error))
+		goto fail;
+
+	params.address = "127.0.0.1";
+	params.port = 0;
+	params.zone_file = zone_file;
+
+	/* The same names, relative to the other domain. */
+	if (forward) {
+		params.domain = OTHER_DOMAIN;
+		upstream = novpn_dns_new (&params, &error);
+		if (!upstream)
+			goto fail;
+		forward_to = g_strdup_printf ("127.0.0.1:%u", novpn_dns_get_port (upstream));
+	}
+
+	params.domain = DOMAIN;
+	params.forward = forward_to;
+	dns = novpn_dns_new (&params, &error);
+	if (!dns)
+		goto fail;
+
+	fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	address.sin_family = AF_INET;
+	address.sin_port = htons (novpn_dns_get_port (dns));
+	address.sin_addr.s_addr = novpn_dns_get_address (dns);
+	if (fd == -1 || connect (fd, (struct sockaddr *) &address, sizeof (address)) == -1) {
+		g_printerr ("Error: %s\n", g_strerror (errno));
+		goto out;
+	}
+
+	/* Keeps a window of queries in flight; lost ones are given up on
+	 * when nothing comes back for a while. */
+	start = g_get_monotonic_time ();
+	while (answered + missing < queries) {
+		while (sent < queries && sent - answered - missing < window) {
+			g_autofree char *name = NULL;
+
+			/* Odd ones are in the other domain. */
+			n = g_rand_int_range (rand, 0, forward ? 2 * names : names);
+			name = g_strdup_printf ("host%u.%s", n / (forward ? 2 : 1),
+			                        n % 2 && forward ? OTHER_DOMAIN : DOMAIN);
+			asked[sent & 0xffff] = n;
+
+			len = make_query (query, sent & 0xffff, name);
+			if (send (fd, query, len, 0) == -1) {
+				if (errno == EAGAIN || errno == ENOBUFS)
+					break;
+				g_printerr ("Error sending: %s\n", g_strerror (errno));
+				goto out;
+			}
+			sent++;
+		}
+
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		if (poll (&pfd, 1, STALL_TIMEOUT_MS) == 0) {
+			missing += sent - answered - missing;
+			continue;
+		}
+
+		while ((len = recv (fd, answer, sizeof (answer), 0)) > 0) {
+			g_autofree char *name = NULL;
+
+			answered++;
+
+			/* QR set, NOERROR, one answer... */
+			if (   len < 12 || !(answer[2] & 0x80) || (answer[3] & 0x0f)
+			    || answer[6] != 0 || answer[7] != 1) {
+				bad++;
+				continue;
+			}
+
+			/* ...to the question asked with that ID. */
+			n = asked[(answer[0] << 8) | answer[1]];
+			name = g_strdup_printf ("host%u.%s", n / (forward ? 2 : 1),
+			                        n % 2 && forward ? OTHER_DOMAIN : DOMAIN);
+			expected_len = make_query (expected, 0, name);
+			if (!same_question (expected, expected_len, answer, len))
+				bad++;
+		}
+	}
+	elapsed = g_get_monotonic_time () - start;
+
+	novpn_dns_get_stats (dns, &stats);
+
+	g_print ("names      %d\n", names);
+	g_print ("queries    %d, %d in flight\n", queries, window);
+	g_print ("rate       %8.0f per second\n", (double) answered * G_USEC_PER_SEC / MAX (elapsed, 1));
+	g_print ("cache hits %8" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT "\n",
+	         stats.cache_hits, stats.queries);
+	if (forward)
+		g_print ("forwarded  %8" G_GUINT64_FORMAT "\n", stats.forwarded);
+	g_print ("lost       %8d\n", missing);
+	g_print ("bad        %8d\n", bad);
+
+	/* The other domain's answers must have come through the upstream. */
+	if (forward && !stats.forwarded)
+		bad++;
+
+out:
+	if (fd != -1)
+		close (fd);
+	novpn_dns_free (dns);
+	if (upstream)
+		novpn_dns_free (upstream);
+	g_unlink (zone_file);
+	g_rmdir (dir);
+	return bad == 0 && answered > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+fail:
+	g_printerr ("Error: %s\n", error->message);
+	if (upstream)
+		novpn_dns_free (upstream);
+	if (zone_file)
+		g_unlink (zone_file);
+	if (dir)
+		g_rmdir (dir);
+	return EXIT_FAILURE;
+}
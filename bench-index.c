@@ -0,0 +1,215 @@
+/*
+ * bench-index - Benchmark for the profile directory index
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "nm-novpn-index.h"
+
+static char *
+profile_uuid (guint n)
+{
+	return g_strdup_printf ("%08x-0000-4000-8000-%012x", n, n * 2654435761u);
+}
+
+/* What export_to_file() would write. */
+static gboolean
+write_profile (const char *dir, guint n, const char *id, GError **error)
+{
+	g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+	g_autofree char *path = g_strdup_printf ("%s/profile-%u.novpn", dir, n);
+	g_autofree char *uuid = profile_uuid (n);
+	g_autofree char *gateway = g_strdup_printf ("gw%u.example.com", n % 100);
+
+	g_key_file_set_string (keyfile, "connection", "id", id);
+	g_key_file_set_string (keyfile, "connection", "uuid", uuid);
+	g_key_file_set_string (keyfile, "vpn", "gateway", gateway);
+	g_key_file_set_string (keyfile, "vpn", "user", "bench");
+	g_key_file_set_string (keyfile, "vpn-secrets", "password", "hunter2");
+
+	if (!g_key_file_save_to_file (keyfile, path, error))
+		return FALSE;
+
+	return novpn_index_update (path, id, uuid, gateway, error);
+}
+
+/* What finding a profile takes without the index. */
+static guint
+scan (const char *dir, const char *id)
+{
+	GDir *gdir = g_dir_open (dir, 0, NULL);
+	const char *name;
+	guint found = 0;
+
+	while ((name = g_dir_read_name (gdir))) {
+		g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+		g_autofree char *path = g_build_filename (dir, name, NULL);
+		g_autofree char *str = NULL;
+
+		if (name[0] == '.')
+			continue;
+		if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL))
+			continue;
+		str = g_key_file_get_string (keyfile, "connection", "id", NULL);
+		if (g_strcmp0 (str, id) == 0)
+			found++;
+	}
+	g_dir_close (gdir);
+
+	return found;
+}
+
+static guint
+lookup_count (NovpnIndex *index, NovpnIndexKey key, const char *value)
+{
+	g_auto(GStrv) paths = novpn_index_lookup (index, key, value);
+
+	return g_strv_length (paths);
+}
+
+static void
+remove_dir (const char *dir)
+{
+	GDir *gdir = g_dir_open (dir, 0, NULL);
+	const char *name;
+
+	while ((name = g_dir_read_name (gdir))) {
+		g_autofree char *path = g_build_filename (dir, name, NULL);
+		unlink (path);
+	}
+	g_dir_close (gdir);
+	rmdir (dir);
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GRand) rand = g_rand_new_with_seed (42);
+	g_autofree char *dir = NULL;
+	NovpnIndex *index;
+	gint profiles = 10000;
+	gint lookups = 10000;
+	gint updates = 2000;
+	gint64 start;
+	gint64 scan_us, build_us, open_us, lookup_us, update_us;
+	gboolean ok = TRUE;
+	int i;
+
+	GOptionEntry options[] = {
+		{ "profiles", 'n', 0, G_OPTION_ARG_INT, &profiles, "Number of profiles", "N" },
+		{ "lookups", 0, 0, G_OPTION_ARG_INT, &lookups, "Number of lookups", "N" },
+		{ "updates", 0, 0, G_OPTION_ARG_INT, &updates, "Number of re-exports after building", "N" },
+		{NULL}
+	};
+
+	opt_ctx = g_option_context_new (NULL);
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	if (profiles < 1 || lookups < 1 || updates < 0 || updates > profiles) {
+		g_printerr ("Usage: %s [--profiles N] [--lookups N] [--updates N]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	dir = g_dir_make_tmp ("bench-index-XXXXXX", &error);
+	if (!dir) {
+		g_printerr ("Error: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < profiles; i++) {
+		g_autofree char *id = g_strdup_printf ("vpn-%d", i);
+
+		if (!write_profile (dir, i, id, &error))
+			goto fail;
+	}
+
+	start = g_get_monotonic_time ();
+	if (scan (dir, "vpn-0") != 1) {
+		g_printerr ("Scan found the wrong profiles\n");
+		ok = FALSE;
+	}
+	scan_us = g_get_monotonic_time () - start;
+
+	start = g_get_monotonic_time ();
+	if (!novpn_index_build (dir, &error))
+		goto fail;
+	build_us = g_get_monotonic_time () - start;
+
+	/* Renames go to the journal, and some get merged into the base. */
+	start = g_get_monotonic_time ();
+	for (i = 0; i < updates; i++) {
+		g_autofree char *id = g_strdup_printf ("renamed-%d", i);
+
+		if (!write_profile (dir, i, id, &error))
+			goto fail;
+	}
+	update_us = g_get_monotonic_time () - start;
+
+	start = g_get_monotonic_time ();
+	index = novpn_index_open (dir, &error);
+	if (!index)
+		goto fail;
+	open_us = g_get_monotonic_time () - start;
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < lookups; i++) {
+		guint n = g_rand_int_range (rand, 0, profiles);
+		g_autofree char *id = g_strdup_printf ("%s-%u", n < (guint) updates ? "renamed" : "vpn", n);
+		g_autofree char *uuid = profile_uuid (n);
+
+		if (   lookup_count (index, NOVPN_INDEX_ID, id) != 1
+		    || lookup_count (index, NOVPN_INDEX_UUID, uuid) != 1) {
+			g_printerr ("Lookup of profile %u found the wrong profiles\n", n);
+			ok = FALSE;
+			break;
+		}
+	}
+	lookup_us = g_get_monotonic_time () - start;
+
+	if (updates && lookup_count (index, NOVPN_INDEX_ID, "vpn-0") != 0) {
+		g_printerr ("Lookup found a stale profile\n");
+		ok = FALSE;
+	}
+
+	novpn_index_free (index);
+
+	g_print ("profiles %d\n", profiles);
+	g_print ("scan     %8" G_GINT64_FORMAT " us\n", scan_us);
+	g_print ("build    %8" G_GINT64_FORMAT " us\n", build_us);
+	g_print ("export   %8.1f us each, with the index\n", updates ? (double) update_us / updates : 0.0);
+	g_print ("open     %8" G_GINT64_FORMAT " us\n", open_us);
+	g_print ("lookup   %8.2f us each (id and uuid)\n", (double) lookup_us / lookups);
+
+	remove_dir (dir);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+
+fail:
+	g_printerr ("Error: %s\n", error->message);
+	remove_dir (dir);
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,674 @@
+/*
+ * bench-service - Footprint benchmark for the NetworkManager mock VPN
+ * service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Runs the service on a private message bus and plays NetworkManager:
+ * connects, waits for the IPv4 configuration, disconnects and waits
+ * for the service to stop, over and over. Memory use is sampled at
+ * idle, after the first connect and after all the cycles.
+ *
+ * With --storm, it also sends Connect and Disconnect back to back
+ * without waiting for either, the way a flapping client would, and
+ * checks that no configuration leaks out of the cancelled connects.
+ *
+ * With --drops, it connects and lets an injected drop disconnect it,
+ * over and over. The drops are minutes apart, so that's only worth it
+ * with --virtual-time, which is passed on to the service.
+ *
+ * With --peer, the service is talked to directly over a socket pair
+ * instead, see its --peer-fd, so that the cycle rate is the service's
+ * own rather than the message bus daemon's.
+ *
+ * With --gateways, each connection has that many gateways for the
+ * service to pick from: listeners on the loopback, and a port nobody
+ * listens on, so that one of the probes always fails.
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib-unix.h>
+#include <NetworkManager.h>
+
+#define BUS_NAME "org.freedesktop.NetworkManager.Novpn"
+#define STATS_INTERFACE "org.freedesktop.NetworkManager.Novpn.Stats"
+#define TIMEOUT_MS 10000
+#define DROP_AFTER "600"
+#define REFUSED_GATEWAY "127.0.0.1:1"
+
+#if !NM_CHECK_VERSION(1,13,0)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (NMConnection, g_object_unref)
+#endif
+
+typedef struct {
+	GDBusConnection *bus;
+	const char *bus_name;
+	char *gateways;
+	GPid pid;
+	gboolean got_ip4_config;
+	gboolean stopped;
+	guint calls_pending;
+	guint late_configs;
+	gboolean timed_out;
+} Bench;
+
+typedef struct {
+	glong rss;
+	glong pss;
+	guint64 heap;
+} Footprint;
+
+static void
+plugin_signal (GDBusConnection *connection,
+               const gchar *sender_name,
+               const gchar *object_path,
+               const gchar *interface_name,
+               const gchar *signal_name,
+               GVariant *parameters,
+               gpointer user_data)
+{
+	Bench *bench = user_data;
+	guint32 state;
+
+	if (strcmp (signal_name, "Ip4Config") == 0) {
+		bench->got_ip4_config = TRUE;
+		if (bench->stopped)
+			bench->late_configs++;
+	} else if (strcmp (signal_name, "StateChanged") == 0) {
+		g_variant_get (parameters, "(u)", &state);
+		if (state == NM_VPN_SERVICE_STATE_STOPPED)
+			bench->stopped = TRUE;
+	}
+}
+
+static gboolean
+timed_out (gpointer user_data)
+{
+	Bench *bench = user_data;
+
+	bench->timed_out = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+wait_for (Bench *bench, gboolean *flag, GError **error)
+{
+	guint timeout_id;
+
+	bench->timed_out = FALSE;
+	timeout_id = g_timeout_add (TIMEOUT_MS, timed_out, bench);
+	while (!*flag && !bench->timed_out)
+		g_main_context_iteration (NULL, TRUE);
+
+	if (bench->timed_out) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+		                     "The service did not respond in time");
+		return FALSE;
+	}
+
+	g_source_remove (timeout_id);
+	return TRUE;
+}
+
+/* The service tells us it's ready on a pipe, see its --ready-fd. */
+static gboolean
+wait_for_service (int ready_fd, GError **error)
+{
+	struct pollfd pfd = { .fd = ready_fd, .events = POLLIN, };
+	char buf[64];
+	ssize_t len;
+	int ret;
+
+	do
+		ret = poll (&pfd, 1, TIMEOUT_MS);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret == 0) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+		                     "The service did not show up on the bus");
+		return FALSE;
+	}
+
+	len = read (ready_fd, buf, sizeof (buf));
+	if (len <= 0) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		                     "The service failed to start");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Our end of the socket pair the service got as --peer-fd. */
+static GDBusConnection *
+connect_peer (int fd, GError **error)
+{
+	g_autoptr(GSocket) socket = NULL;
+	g_autoptr(GSocketConnection) stream = NULL;
+
+	socket = g_socket_new_from_fd (fd, error);
+	if (!socket) {
+		close (fd);
+		return NULL;
+	}
+
+	stream = g_socket_connection_factory_create_connection (socket);
+	return g_dbus_connection_new_sync (G_IO_STREAM (stream), NULL,
+	                                   G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+	                                   NULL, NULL, error);
+}
+
+static GVariant *
+new_connection (Bench *bench, gboolean drop)
+{
+	g_autoptr(NMConnection) connection = nm_simple_connection_new ();
+	g_autofree char *uuid = nm_utils_uuid_generate ();
+	NMSetting *setting;
+
+	setting = nm_setting_connection_new ();
+	g_object_set (setting,
+	              NM_SETTING_CONNECTION_ID, "bench",
+	              NM_SETTING_CONNECTION_UUID, uuid,
+	              NM_SETTING_CONNECTION_TYPE, NM_SETTING_VPN_SETTING_NAME,
+	              NULL);
+	nm_connection_add_setting (connection, setting);
+
+	setting = nm_setting_vpn_new ();
+	g_object_set (setting, NM_SETTING_VPN_SERVICE_TYPE, BUS_NAME, NULL);
+	nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "gateway",
+	                              bench->gateways ? bench->gateways : "novpn.example.com");
+	nm_setting_vpn_add_secret (NM_SETTING_VPN (setting), "password", "hunter2");
+	if (drop) {
+		nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "inject-drop", "1");
+		nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "inject-drop-after", DROP_AFTER);
+	}
+	nm_connection_add_setting (connection, setting);
+
+	return nm_connection_to_dbus (connection, NM_CONNECTION_SERIALIZE_ALL);
+}
+
+static gboolean
+call_plugin (Bench *bench, const char *method, GVariant *parameters, GError **error)
+{
+	g_autoptr(GVariant) ret = NULL;
+
+	ret = g_dbus_connection_call_sync (bench->bus, bench->bus_name,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                                   method, parameters, NULL,
+	                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+	return ret != NULL;
+}
+
+static gboolean
+connect_cycle (Bench *bench, gboolean disconnect, GError **error)
+{
+	bench->got_ip4_config = FALSE;
+	bench->stopped = FALSE;
+	if (!call_plugin (bench, "Connect", g_variant_new ("(@a{sa{sv}})", new_connection (bench, FALSE)), error))
+		return FALSE;
+	if (!wait_for (bench, &bench->got_ip4_config, error))
+		return FALSE;
+
+	if (!disconnect)
+		return TRUE;
+
+	if (!call_plugin (bench, "Disconnect", NULL, error))
+		return FALSE;
+	return wait_for (bench, &bench->stopped, error);
+}
+
+/* Connects and waits for the service to drop the connection itself. */
+static gboolean
+drop_cycle (Bench *bench, GError **error)
+{
+	bench->got_ip4_config = FALSE;
+	bench->stopped = FALSE;
+	if (!call_plugin (bench, "Connect", g_variant_new ("(@a{sa{sv}})", new_connection (bench, TRUE)), error))
+		return FALSE;
+	if (!wait_for (bench, &bench->got_ip4_config, error))
+		return FALSE;
+	return wait_for (bench, &bench->stopped, error);
+}
+
+static void
+storm_call_done (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+	Bench *bench = user_data;
+	g_autoptr(GVariant) ret = NULL;
+	g_autoptr(GError) error = NULL;
+
+	ret = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source), result, &error);
+	if (!ret)
+		g_printerr ("Warning: %s\n", error->message);
+	bench->calls_pending--;
+}
+
+static gboolean
+storm_cycle (Bench *bench, GError **error)
+{
+	bench->stopped = FALSE;
+	bench->calls_pending = 2;
+
+	g_dbus_connection_call (bench->bus, bench->bus_name,
+	                        NM_VPN_DBUS_PLUGIN_PATH,
+	                        NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                        "Connect",
+	                        g_variant_new ("(@a{sa{sv}})", new_connection (bench, FALSE)),
+	                        NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+	                        storm_call_done, bench);
+	g_dbus_connection_call (bench->bus, bench->bus_name,
+	                        NM_VPN_DBUS_PLUGIN_PATH,
+	                        NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                        "Disconnect", NULL,
+	                        NULL, G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+	                        storm_call_done, bench);
+
+	if (!wait_for (bench, &bench->stopped, error))
+		return FALSE;
+	while (bench->calls_pending)
+		g_main_context_iteration (NULL, TRUE);
+
+	return TRUE;
+}
+
+static GVariant *
+get_stats (Bench *bench, GError **error)
+{
+	g_autoptr(GVariant) ret = NULL;
+
+	ret = g_dbus_connection_call_sync (bench->bus, bench->bus_name,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   STATS_INTERFACE,
+	                                   "GetStats", NULL,
+	                                   G_VARIANT_TYPE ("(a{sv})"),
+	                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+	if (!ret)
+		return NULL;
+
+	return g_variant_get_child_value (ret, 0);
+}
+
+static guint32
+get_stat (Bench *bench, const char *name, GError **error)
+{
+	g_autoptr(GVariant) stats = get_stats (bench, error);
+	guint32 value = 0;
+
+	if (stats)
+		g_variant_lookup (stats, name, "u", &value);
+	return value;
+}
+
+static guint64
+get_stat64 (Bench *bench, const char *name, GError **error)
+{
+	g_autoptr(GVariant) stats = get_stats (bench, error);
+	guint64 value = 0;
+
+	if (stats)
+		g_variant_lookup (stats, name, "t", &value);
+	return value;
+}
+
+/*
+ * Listens on the loopback for the service to probe. The connections
+ * are accepted from the main loop and closed right away.
+ */
+static GSocketService *
+start_gateways (Bench *bench, int count, GError **error)
+{
+	g_autoptr(GSocketService) service = g_socket_service_new ();
+	GString *gateways = g_string_new (NULL);
+	g_autoptr(GInetAddress) loopback = g_inet_address_new_loopback (G_SOCKET_FAMILY_IPV4);
+	int i;
+
+	for (i = 0; i < count - 1; i++) {
+		g_autoptr(GSocketAddress) address = g_inet_socket_address_new (loopback, 0);
+		g_autoptr(GSocketAddress) effective = NULL;
+
+		if (!g_socket_listener_add_address (G_SOCKET_LISTENER (service), address,
+		                                    G_SOCKET_TYPE_STREAM, G_SOCKET_PROTOCOL_TCP,
+		                                    NULL, &effective, error)) {
+			g_string_free (gateways, TRUE);
+			return NULL;
+		}
+		g_string_append_printf (gateways, "127.0.0.1:%u, ",
+		                        g_inet_socket_address_get_port (G_INET_SOCKET_ADDRESS (effective)));
+	}
+	g_string_append (gateways, REFUSED_GATEWAY);
+
+	bench->gateways = g_string_free (gateways, FALSE);
+	g_socket_service_start (service);
+
+	return g_object_ref (service);
+}
+
+static gboolean
+print_startup (Bench *bench, GError **error)
+{
+	g_autoptr(GVariant) ret = NULL;
+	g_autoptr(GVariant) stats = NULL;
+	g_autoptr(GVariant) phases = NULL;
+	GVariantIter iter;
+	const char *phase;
+	guint64 usec;
+
+	ret = g_dbus_connection_call_sync (bench->bus, bench->bus_name,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   STATS_INTERFACE,
+	                                   "GetStats", NULL,
+	                                   G_VARIANT_TYPE ("(a{sv})"),
+	                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+	if (!ret)
+		return FALSE;
+
+	stats = g_variant_get_child_value (ret, 0);
+	phases = g_variant_lookup_value (stats, "startup", G_VARIANT_TYPE ("a{st}"));
+	if (!phases)
+		return TRUE;
+
+	g_variant_iter_init (&iter, phases);
+	while (g_variant_iter_next (&iter, "{&st}", &phase, &usec))
+		g_print ("startup        %-14s %8" G_GUINT64_FORMAT " us\n", phase, usec);
+
+	return TRUE;
+}
+
+static glong
+proc_field_kib (GPid pid, const char *file, const char *field)
+{
+	g_autofree char *path = g_strdup_printf ("/proc/%d/%s", (int) pid, file);
+	g_autofree char *contents = NULL;
+	const char *line;
+	glong value;
+
+	if (!g_file_get_contents (path, &contents, NULL, NULL))
+		return -1;
+
+	line = strstr (contents, field);
+	if (!line || sscanf (line + strlen (field), " %ld kB", &value) != 1)
+		return -1;
+
+	return value;
+}
+
+static gboolean
+measure (Bench *bench, const char *label, Footprint *footprint, GError **error)
+{
+	g_autoptr(GVariant) ret = NULL;
+	g_autoptr(GVariant) stats = NULL;
+
+	footprint->rss = proc_field_kib (bench->pid, "status", "VmRSS:");
+	footprint->pss = proc_field_kib (bench->pid, "smaps_rollup", "Pss:");
+	footprint->heap = 0;
+
+	ret = g_dbus_connection_call_sync (bench->bus, bench->bus_name,
+	                                   NM_VPN_DBUS_PLUGIN_PATH,
+	                                   STATS_INTERFACE,
+	                                   "GetStats", NULL,
+	                                   G_VARIANT_TYPE ("(a{sv})"),
+	                                   G_DBUS_CALL_FLAGS_NONE, -1, NULL, error);
+	if (!ret)
+		return FALSE;
+
+	stats = g_variant_get_child_value (ret, 0);
+	if (!g_variant_lookup (stats, "heap-in-use", "t", &footprint->heap))
+		footprint->heap = 0;
+
+	g_print ("%-14s rss %6ld KiB  pss %6ld KiB  heap in use %6" G_GUINT64_FORMAT " KiB\n",
+	         label, footprint->rss, footprint->pss, footprint->heap / 1024);
+
+	return TRUE;
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	g_autoptr(GTestDBus) test_bus = NULL;
+	g_autoptr(GError) error = NULL;
+	g_auto(GStrv) envp = NULL;
+	g_autoptr(GPtrArray) service_argv = g_ptr_array_new_with_free_func (g_free);
+	g_autoptr(GSocketService) gateway_service = NULL;
+	g_autoptr(GVariant) stats = NULL;
+	const char *gateway;
+	Bench bench = { 0, };
+	Footprint idle, connected, cycled;
+	gboolean peer = FALSE;
+	gboolean virtual_time = FALSE;
+	gint drops = 0;
+	gint gateways = 0;
+	guint64 uptime;
+	int peer_pair[2] = { -1, -1 };
+	gint cycles = 10000;
+	gint max_idle_rss = 0;
+	gint max_heap_growth = 0;
+	gint storm = 0;
+	int ready_pipe[2];
+	guint32 cancelled;
+	gint64 start;
+	gint64 elapsed;
+	gboolean success = FALSE;
+	int i;
+
+	GOptionEntry options[] = {
+		{ "cycles", 'n', 0, G_OPTION_ARG_INT, &cycles, "Number of connect/disconnect cycles", "N" },
+		{ "max-idle-rss", 0, 0, G_OPTION_ARG_INT, &max_idle_rss, "Fail if the idle RSS exceeds this", "KiB" },
+		{ "max-heap-growth", 0, 0, G_OPTION_ARG_INT, &max_heap_growth, "Fail if the heap grows more than this over the cycles", "KiB" },
+		{ "storm", 0, 0, G_OPTION_ARG_INT, &storm, "Number of back to back Connect and Disconnect pairs", "N" },
+		{ "drops", 0, 0, G_OPTION_ARG_INT, &drops, "Number of connections to let the service drop, " DROP_AFTER " s apart on average", "N" },
+		{ "virtual-time", 0, 0, G_OPTION_ARG_NONE, &virtual_time, "Run the service's timers in virtual time", NULL },
+		{ "peer", 0, 0, G_OPTION_ARG_NONE, &peer, "Talk to the service directly, not over a message bus", NULL },
+		{ "gateways", 0, 0, G_OPTION_ARG_INT, &gateways, "Number of gateways for the service to probe, one of them unreachable", "N" },
+		{NULL}
+	};
+
+	opt_ctx = g_option_context_new ("<path to nm-novpn-service>");
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	if (argc != 2 || cycles < 1 || storm < 0 || drops < 0 || gateways == 1 || gateways < 0) {
+		g_printerr ("Usage: %s [--cycles N] [--storm N] [--drops N] [--virtual-time] [--peer] [--gateways N] <path to nm-novpn-service>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (gateways) {
+		gateway_service = start_gateways (&bench, gateways, &error);
+		if (!gateway_service) {
+			g_printerr ("Error: %s\n", error->message);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!g_unix_open_pipe (ready_pipe, FD_CLOEXEC, &error)) {
+		g_printerr ("Error: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	/* Only the write end goes to the service. */
+	fcntl (ready_pipe[1], F_SETFD, 0);
+
+	g_ptr_array_add (service_argv, g_strdup (argv[1]));
+	g_ptr_array_add (service_argv, g_strdup ("--persist"));
+	g_ptr_array_add (service_argv, g_strdup ("--ready-fd"));
+	g_ptr_array_add (service_argv, g_strdup_printf ("%d", ready_pipe[1]));
+	if (virtual_time)
+		g_ptr_array_add (service_argv, g_strdup ("--virtual-time"));
+
+	if (peer) {
+		if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, peer_pair) == -1) {
+			g_printerr ("Error: %s\n", g_strerror (errno));
+			return EXIT_FAILURE;
+		}
+		fcntl (peer_pair[1], F_SETFD, 0);
+		g_ptr_array_add (service_argv, g_strdup ("--peer-fd"));
+		g_ptr_array_add (service_argv, g_strdup_printf ("%d", peer_pair[1]));
+		envp = g_get_environ ();
+	} else {
+		test_bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+		g_test_dbus_up (test_bus);
+
+		/* The service talks to the system bus. */
+		envp = g_environ_setenv (g_get_environ (), "DBUS_SYSTEM_BUS_ADDRESS",
+		                         g_test_dbus_get_bus_address (test_bus), TRUE);
+	}
+	g_ptr_array_add (service_argv, NULL);
+
+	if (!g_spawn_async (NULL, (char **) service_argv->pdata, envp,
+	                    G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_LEAVE_DESCRIPTORS_OPEN,
+	                    NULL, NULL, &bench.pid, &error)) {
+		g_printerr ("Error: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+	close (ready_pipe[1]);
+
+	if (peer) {
+		close (peer_pair[1]);
+		bench.bus = connect_peer (peer_pair[0], &error);
+	} else {
+		bench.bus_name = BUS_NAME;
+		bench.bus = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (test_bus),
+			G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+			G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+			NULL, NULL, &error);
+	}
+	if (!bench.bus)
+		goto out;
+
+	g_dbus_connection_signal_subscribe (bench.bus, bench.bus_name,
+	                                    NM_VPN_DBUS_PLUGIN_INTERFACE, NULL,
+	                                    NM_VPN_DBUS_PLUGIN_PATH, NULL,
+	                                    G_DBUS_SIGNAL_FLAGS_NONE,
+	                                    plugin_signal, &bench, NULL);
+
+	if (!wait_for_service (ready_pipe[0], &error))
+		goto out;
+	if (!print_startup (&bench, &error))
+		goto out;
+
+	if (!measure (&bench, "idle", &idle, &error))
+		goto out;
+
+	if (!connect_cycle (&bench, TRUE, &error))
+		goto out;
+	if (!measure (&bench, "one connect", &connected, &error))
+		goto out;
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < cycles; i++) {
+		if (!connect_cycle (&bench, TRUE, &error))
+			goto out;
+	}
+	elapsed = MAX (g_get_monotonic_time () - start, 1);
+	g_print ("cycles         %d in %" G_GINT64_FORMAT " ms, %.0f per second over %s\n",
+	         cycles, elapsed / 1000, cycles * (double) G_USEC_PER_SEC / elapsed,
+	         peer ? "a peer connection" : "the bus");
+	if (!measure (&bench, "cycled", &cycled, &error))
+		goto out;
+
+	if (gateways) {
+		stats = get_stats (&bench, &error);
+		if (!stats)
+			goto out;
+		if (!g_variant_lookup (stats, "gateway", "&s", &gateway))
+			gateway = "none";
+		g_print ("gateways       %d, last picked %s\n", gateways, gateway);
+	}
+
+	if (storm) {
+		cancelled = get_stat (&bench, "cancelled", &error);
+		if (error)
+			goto out;
+
+		start = g_get_monotonic_time ();
+		for (i = 0; i < storm; i++) {
+			if (!storm_cycle (&bench, &error))
+				goto out;
+		}
+		g_print ("storm          %d pairs in %" G_GINT64_FORMAT " ms, %u cancelled\n",
+		         storm, (g_get_monotonic_time () - start) / 1000,
+		         get_stat (&bench, "cancelled", NULL) - cancelled);
+	}
+
+	if (drops) {
+		uptime = get_stat64 (&bench, "uptime", &error);
+		if (error)
+			goto out;
+
+		start = g_get_monotonic_time ();
+		for (i = 0; i < drops; i++) {
+			if (!drop_cycle (&bench, &error))
+				goto out;
+		}
+		elapsed = MAX (g_get_monotonic_time () - start, 1);
+		uptime = get_stat64 (&bench, "uptime", NULL) - uptime;
+		g_print ("drops          %d in %" G_GINT64_FORMAT " ms, %.1f s of service time, %.0fx\n",
+		         drops, elapsed / 1000, uptime / (double) G_USEC_PER_SEC,
+		         uptime / (double) elapsed);
+	}
+
+	success = TRUE;
+
+	if (bench.late_configs) {
+		g_printerr ("Configuration was sent after Disconnect %u times\n", bench.late_configs);
+		success = FALSE;
+	}
+
+	if (max_idle_rss && idle.rss > max_idle_rss) {
+		g_printerr ("Idle RSS of %ld KiB is over the budget of %d KiB\n",
+		            idle.rss, max_idle_rss);
+		success = FALSE;
+	}
+
+	if (   max_heap_growth
+	    && cycled.heap > connected.heap
+	    && (cycled.heap - connected.heap) / 1024 > (guint64) max_heap_growth) {
+		g_printerr ("Heap grew by %" G_GUINT64_FORMAT " KiB over %d cycles, the budget is %d KiB\n",
+		            (cycled.heap - connected.heap) / 1024, cycles, max_heap_growth);
+		success = FALSE;
+	}
+
+out:
+	if (error)
+		g_printerr ("Error: %s\n", error->message);
+
+	close (ready_pipe[0]);
+	kill (bench.pid, SIGTERM);
+	waitpid (bench.pid, NULL, 0);
+	g_spawn_close_pid (bench.pid);
+	g_clear_object (&bench.bus);
+	g_free (bench.gateways);
+	if (test_bus)
+		g_test_dbus_down (test_bus);
+
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,181 @@
+/*
+ * bench-shaper - Benchmark for the tunnel's packet scheduler
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Pushes packets through a shaper on a clock of its own, a packet every
+ * so many nanoseconds of it, without any waiting. That measures what
+ * scheduling costs per packet and checks where the packets end up: a
+ * packet that skipped the delay must come out right away, and none may
+ * be later than the delay and jitter allow. Both give or take a tick of
+ * the wheel, which is 32 us (see nm-novpn-shaper.c).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "nm-novpn-shaper.h"
+
+#define TICK_US 32
+#define PACKET_LEN 64
+
+typedef struct {
+	gint64 now;
+	guint delay_us;
+	guint jitter_us;
+
+	guint64 delivered;
+	guint64 early;
+	guint64 late;
+	gint64 max_early_us;
+	gint64 min_delayed_us;
+	gint64 max_delayed_us;
+} Bench;
+
+static void
+deliver (const guint8 *data, gsize len, gpointer user_data)
+{
+	Bench *bench = user_data;
+	gint64 sent;
+	gint64 latency;
+
+	memcpy (&sent, data, sizeof (sent));
+	latency = bench->now - sent;
+	bench->delivered++;
+
+	/* Either it skipped the delay, or got the delay and some jitter. */
+	if (latency + (gint64) bench->jitter_us + 2 * TICK_US < bench->delay_us) {
+		bench->early++;
+		bench->max_early_us = MAX (bench->max_early_us, latency);
+	} else {
+		bench->min_delayed_us = MIN (bench->min_delayed_us, latency);
+		bench->max_delayed_us = MAX (bench->max_delayed_us, latency);
+		if (latency > (gint64) (bench->delay_us + bench->jitter_us) + 2 * TICK_US)
+			bench->late++;
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	g_autoptr(GError) error = NULL;
+	NovpnShaperParams params = { 0, };
+	NovpnShaperStats stats;
+	NovpnShaper *shaper;
+	Bench bench = { 0, };
+	guint8 packet[PACKET_LEN] = { 0, };
+	gint packets = 10000000;
+	gint interval_ns = 100;
+	gint delay_us = 40000;
+	gint jitter_us = 2000;
+	double reorder = 0.01;
+	gint64 start, elapsed;
+	gint64 next;
+	double expected;
+	gboolean ok = TRUE;
+	gint i;
+
+	GOptionEntry options[] = {
+		{ "packets", 'n', 0, G_OPTION_ARG_INT, &packets, "Number of packets", "N" },
+		{ "interval", 0, 0, G_OPTION_ARG_INT, &interval_ns, "Time between packets on the shaper's clock", "NS" },
+		{ "delay", 0, 0, G_OPTION_ARG_INT, &delay_us, "One way delay", "US" },
+		{ "jitter", 0, 0, G_OPTION_ARG_INT, &jitter_us, "Jitter, +/-", "US" },
+		{ "reorder", 0, 0, G_OPTION_ARG_DOUBLE, &reorder, "Probability of skipping the delay", "P" },
+		{NULL}
+	};
+
+	opt_ctx = g_option_context_new (NULL);
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	if (   packets < 1 || interval_ns < 1 || delay_us < 0 || jitter_us < 0
+	    || jitter_us > delay_us || reorder < 0 || reorder > 1) {
+		g_printerr ("Usage: %s [--packets N] [--interval NS] [--delay US] [--jitter US] [--reorder P]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	params.delay_us = delay_us;
+	params.jitter_us = jitter_us;
+	params.reorder = reorder;
+	bench.delay_us = delay_us;
+	bench.jitter_us = jitter_us;
+	bench.min_delayed_us = G_MAXINT64;
+	shaper = novpn_shaper_new (&params, 42, deliver, &bench);
+
+	start = g_get_monotonic_time ();
+	for (i = 0; i < packets; i++) {
+		bench.now = (gint64) i * interval_ns / 1000;
+		memcpy (packet, &bench.now, sizeof (bench.now));
+		novpn_shaper_enqueue (shaper, packet, sizeof (packet), bench.now);
+		novpn_shaper_run (shaper, bench.now);
+	}
+
+	/* Whatever is still in flight. */
+	while ((next = novpn_shaper_run (shaper, bench.now)) >= 0)
+		bench.now = MAX (next, bench.now + 1);
+	elapsed = g_get_monotonic_time () - start;
+
+	novpn_shaper_get_stats (shaper, &stats);
+	novpn_shaper_free (shaper);
+
+	g_print ("packets    %d, %.1f Mpps offered\n", packets, 1000.0 / interval_ns);
+	g_print ("rate       %8.2f Mpps\n", (double) packets / MAX (elapsed, 1));
+	g_print ("delivered  %8" G_GUINT64_FORMAT "\n", bench.delivered);
+	g_print ("reordered  %8" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " early, at most %" G_GINT64_FORMAT " us)\n",
+	         stats.reordered, bench.early, bench.max_early_us);
+	if (bench.min_delayed_us <= bench.max_delayed_us) {
+		g_print ("delayed    %8" G_GINT64_FORMAT " to %" G_GINT64_FORMAT " us\n",
+		         bench.min_delayed_us, bench.max_delayed_us);
+	}
+
+	if (bench.delivered != (guint64) packets) {
+		g_printerr ("%" G_GUINT64_FORMAT " packets of %d delivered\n", bench.delivered, packets);
+		ok = FALSE;
+	}
+
+	/* A packet that skipped the delay may only be held back by packets
+	 * in its own tick, not by the ones queued earlier. Only telling when
+	 * the delay is well apart from no delay. */
+	if (   delay_us > jitter_us + 4 * TICK_US
+	    && (bench.early != stats.reordered || bench.max_early_us > 2 * TICK_US)) {
+		g_printerr ("Reordered packets were held back\n");
+		ok = FALSE;
+	}
+
+	if (bench.late) {
+		g_printerr ("%" G_GUINT64_FORMAT " packets were later than the delay and jitter allow\n",
+		            bench.late);
+		ok = FALSE;
+	}
+
+	/* Loose enough to never be hit by chance. */
+	expected = packets * reorder;
+	if (expected >= 100 && stats.reordered < expected / 2) {
+		g_printerr ("Only %" G_GUINT64_FORMAT " packets reordered, expected about %.0f\n",
+		            stats.reordered, expected);
+		ok = FALSE;
+	}
+
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
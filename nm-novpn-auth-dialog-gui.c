@@ -20,16 +20,26 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <glib.h>
 #include <nma-vpn-password-dialog.h>
 
+#include "nm-novpn-secret.h"
+
+/*
+ * The secrets themselves (the Value keys) are kept in locked memory,
+ * in a table of group names to values, and never make it to GKeyFile.
+ */
+
 typedef void (*VpnDialogCallback) (GKeyFile *keyfile,
+                                   GHashTable *values,
                                    gpointer user_data);
 
 typedef struct {
 	GKeyFile *keyfile;
+	GHashTable *values;
 	VpnDialogCallback callback;
 	gpointer user_data;
 	int added_groups[3];
@@ -40,11 +50,12 @@ static gboolean
 add_password (NMAVpnPasswordDialog *dialog,
               int passwords,
               GKeyFile *keyfile,
+              GHashTable *values,
               const gchar *group,
               GError **error)
 {
 	g_autofree gchar *label = NULL;
-	g_autofree gchar *value = NULL;
+	const char *value;
 	gboolean is_secret;
 	gboolean should_ask;
 
@@ -57,7 +68,7 @@ add_password (NMAVpnPasswordDialog *dialog,
 	if (!label)
 		return FALSE;
 
-	value = g_key_file_get_string (keyfile, group, "Value", NULL);
+	value = g_hash_table_lookup (values, group);
 
 	switch (passwords) {
 	case 0:
@@ -110,6 +121,7 @@ free_vpn_dialog_data (gpointer data,
 	VpnDialogData *dialog_data = data;
 
 	g_key_file_unref (dialog_data->keyfile);
+	g_hash_table_unref (dialog_data->values);
 	g_slice_free (VpnDialogData, dialog_data);
 }
 
@@ -123,39 +135,80 @@ dialog_response (GtkDialog *dialog,
 	int i;
 
 	for (i = 0; i < dialog_data->passwords; i++) {
-		g_key_file_set_string (dialog_data->keyfile, groups[dialog_data->added_groups[i]],
-		                       "Value", get_password (NMA_VPN_PASSWORD_DIALOG (dialog), i));
+		g_hash_table_replace (dialog_data->values,
+		                      g_strdup (groups[dialog_data->added_groups[i]]),
+		                      novpn_secret_strdup (get_password (NMA_VPN_PASSWORD_DIALOG (dialog), i)));
 	}
 
-	dialog_data->callback (dialog_data->keyfile, user_data);
+	dialog_data->callback (dialog_data->keyfile, dialog_data->values, dialog_data->user_data);
 }
 
-static GtkWidget *
-dialog_from_io_channel (GIOChannel *input,
-                        VpnDialogCallback callback,
-                        gpointer user_data,
-                        GError **error)
+/*
+ * Moves the values out of the keyfile data into locked memory, leaving
+ * blanks behind, so that what's left can go through GKeyFile.
+ */
+static GHashTable *
+take_values (char *data, gsize len)
 {
-	GIOStatus status;
-	g_autofree gchar *data = NULL;
+	GHashTable *values = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	g_autofree gchar *group = NULL;
+	char *line;
+	char *end;
+	char *close;
+	char *p;
+
+	for (line = data; line < data + len; line = end + 1) {
+		end = memchr (line, '\n', data + len - line);
+		if (!end)
+			end = data + len;
+
+		p = line;
+		while (p < end && g_ascii_isspace (*p))
+			p++;
+
+		if (p < end && *p == '[') {
+			g_clear_pointer (&group, g_free);
+			close = memchr (p, ']', end - p);
+			if (close)
+				group = g_strndup (p + 1, close - p - 1);
+			continue;
+		}
+
+		if (!group || end - p < 5 || strncmp (p, "Value", 5) != 0)
+			continue;
+		p += 5;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == end || *p != '=')
+			continue;
+		p++;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+
+		g_hash_table_replace (values, g_strdup (group),
+		                      novpn_secret_keyfile_unescape (p, end - p));
+		memset (line, ' ', end - line);
+	}
+
+	return values;
+}
+
+static GKeyFile *
+keyfile_from_fd (int fd,
+                 GHashTable **values,
+                 GError **error)
+{
+	char *data;
 	gsize len;
+	g_autoptr(GHashTable) taken = NULL;
 	g_autoptr(GKeyFile) keyfile = NULL;
 	g_auto(GStrv) groups = NULL;
-	GtkWidget *dialog = NULL;
 	g_autofree gchar *version = NULL;
-	g_autofree gchar *title = NULL;
-	g_autofree gchar *message = NULL;
-	g_autofree gchar *value = NULL;
-	VpnDialogData *dialog_data;
-	int i;
-
-	input = g_io_channel_unix_new (STDIN_FILENO);
-	g_return_val_if_fail (input, NULL);
 
-	status = g_io_channel_read_to_end (input, &data, &len, error);
-	if (status == G_IO_STATUS_ERROR)
+	data = novpn_secret_read (fd, &len, error);
+	if (!data)
 		return NULL;
-	g_return_val_if_fail (status == G_IO_STATUS_NORMAL, NULL);
+	taken = take_values (data, len);
 
 	keyfile = g_key_file_new ();
 	g_return_val_if_fail (keyfile, NULL);
@@ -177,6 +230,39 @@ dialog_from_io_channel (GIOChannel *input,
 		return NULL;
 	}
 
+	*values = g_hash_table_ref (taken);
+	return g_key_file_ref (keyfile);
+}
+
+static gboolean
+keyfile_should_ask (GKeyFile *keyfile)
+{
+	g_auto(GStrv) groups = g_key_file_get_groups (keyfile, NULL);
+	int i;
+
+	for (i = 1; groups[i] != NULL; i++) {
+		if (   g_key_file_get_boolean (keyfile, groups[i], "IsSecret", NULL)
+		    && g_key_file_get_boolean (keyfile, groups[i], "ShouldAsk", NULL))
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static GtkWidget *
+dialog_from_keyfile (GKeyFile *keyfile,
+                     GHashTable *values,
+                     VpnDialogCallback callback,
+                     gpointer user_data,
+                     GError **error)
+{
+	g_auto(GStrv) groups = NULL;
+	GtkWidget *dialog = NULL;
+	g_autofree gchar *title = NULL;
+	g_autofree gchar *message = NULL;
+	VpnDialogData *dialog_data;
+	int i;
+
 	title = g_key_file_get_string (keyfile, "VPN Plugin UI", "Title", error);
 	if (!title)
 		return NULL;
@@ -185,11 +271,14 @@ dialog_from_io_channel (GIOChannel *input,
 	if (!message)
 		return NULL;
 
+	groups = g_key_file_get_groups (keyfile, NULL);
+
 	dialog_data = g_slice_alloc0 (sizeof (VpnDialogData));
 	g_return_val_if_fail (dialog_data, NULL);
 	dialog_data->callback = callback;
 	dialog_data->user_data = user_data;
 	dialog_data->keyfile = g_key_file_ref (keyfile);
+	dialog_data->values = g_hash_table_ref (values);
 
 	dialog = nma_vpn_password_dialog_new (title, message, NULL);
 	nma_vpn_password_dialog_set_show_password (NMA_VPN_PASSWORD_DIALOG (dialog), FALSE);
@@ -201,7 +290,8 @@ dialog_from_io_channel (GIOChannel *input,
 	for (i = 1; groups[i] != NULL; i++) {
 		g_autoptr(GError) local = NULL;
 
-		if (add_password (NMA_VPN_PASSWORD_DIALOG (dialog), dialog_data->passwords, keyfile, groups[i], &local)) {
+		if (add_password (NMA_VPN_PASSWORD_DIALOG (dialog), dialog_data->passwords,
+		                  keyfile, values, groups[i], &local)) {
 			dialog_data->added_groups[dialog_data->passwords] = i;
 			dialog_data->passwords++;
 		} else if (local) {
@@ -218,39 +308,60 @@ dialog_from_io_channel (GIOChannel *input,
 	return dialog;
 }
 
+/* Written out directly; stdio would keep a copy in its buffer. */
+static void
+print_unbuffered (const char *str)
+{
+	g_autoptr(GError) error = NULL;
+
+	if (!novpn_secret_write (STDOUT_FILENO, str, strlen (str), &error))
+		g_printerr ("Error: %s\n", error->message);
+}
+
 static void
-got_secrets (GKeyFile *keyfile, gpointer user_data)
+got_secrets (GKeyFile *keyfile, GHashTable *values, gpointer user_data)
 {
 	g_auto(GStrv) groups = g_key_file_get_groups (keyfile, NULL);
-	gchar *value = NULL;
+	const char *value;
 	int i;
 
 	for (i = 1; groups[i] != NULL; i++) {
-		value = g_key_file_get_string (keyfile, groups[i], "Value", NULL);
+		value = g_hash_table_lookup (values, groups[i]);
 		if (!value)
 			continue;
 
-		g_print ("%s\n", groups[i]);
-		g_print ("%s\n", value);
-		g_free (value);
+		print_unbuffered (groups[i]);
+		print_unbuffered ("\n");
+		print_unbuffered (value);
+		print_unbuffered ("\n");
 	}
 
-	g_print ("\n\n");
+	print_unbuffered ("\n\n");
 }
 
 int
 main (int argc, char *argv[])
 {
-	g_autoptr(GIOChannel) input = NULL;
+	g_autoptr(GKeyFile) keyfile = NULL;
+	g_autoptr(GHashTable) values = NULL;
 	g_autoptr(GError) error = NULL;
 	g_autoptr(GtkWidget) dialog = NULL;
 
-	input = g_io_channel_unix_new (STDIN_FILENO);
-	g_return_val_if_fail (input, EXIT_FAILURE);
+	novpn_secret_init ();
+
+	keyfile = keyfile_from_fd (STDIN_FILENO, &values, &error);
+	if (!keyfile) {
+		g_printerr ("Error: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	/* Nothing to ask for. Don't bother bringing up the toolkit. */
+	if (!keyfile_should_ask (keyfile))
+		return EXIT_SUCCESS;
 
 	gtk_init (&argc, &argv);
 
-	dialog = dialog_from_io_channel (input, got_secrets, NULL, &error);
+	dialog = dialog_from_keyfile (keyfile, values, got_secrets, NULL, &error);
 	if (error) {
 		g_printerr ("Error: %s\n", error->message);
 		return EXIT_FAILURE;
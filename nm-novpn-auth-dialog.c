@@ -23,33 +23,44 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <glib.h>
 #include <glib-unix.h>
 #include <NetworkManager.h>
 
+#include "nm-novpn-perf.h"
+#include "nm-novpn-probes.h"
+#include "nm-novpn-secret.h"
+
 static gboolean
 spawn_gui_helper (const char *progname,
+                  const char *vpn_uuid,
                   const char *keyfile_data,
-                  gssize length,
+                  gsize length,
                   char * const argv[],
                   GError **error)
 {
 	g_autofree gchar *gui_helper = g_strdup_printf ("%s-gui", progname);
-	GIOChannel *output = NULL;
-	GIOStatus status;
+	gboolean written;
 	pid_t child_pid;
-	gsize written;
 	int child_status;
 	int fds[2];
+	gint64 start;
+	NovpnPerfSample spawn;
 
 	if (pipe (fds) == -1) {
 		g_set_error_literal (error, G_UNIX_ERROR, 0, g_strerror (errno));
 		return FALSE;
 	}
 
+	/* Up to the helper having the secrets; not the user's typing. */
+	novpn_perf_begin (&spawn, NOVPN_PERF_HELPER_SPAWN);
+
+	start = g_get_monotonic_time ();
 	child_pid = fork ();
 	if (child_pid == -1) {
+		novpn_perf_end (&spawn);
 		close (fds[0]);
 		close (fds[1]);
 		g_set_error_literal (error, G_UNIX_ERROR, 0, g_strerror (errno));
@@ -63,6 +74,9 @@ spawn_gui_helper (const char *progname,
 			g_printerr ("Error: %s", g_strerror (errno));
 			exit (EXIT_FAILURE);
 		}
+		/* The parent's start time, as the parent may not have fired
+		 * helper_fork yet. */
+		NOVPN_PROBE3 (helper_exec, vpn_uuid, gui_helper, start);
 		if (execv (gui_helper, argv) == -1) {
 			g_printerr ("%s: %s", gui_helper, g_strerror (errno));
 			exit (EXIT_FAILURE);
@@ -70,21 +84,22 @@ spawn_gui_helper (const char *progname,
 		g_assert_not_reached ();
 	}
 
-	close (fds[0]);
-	output = g_io_channel_unix_new (fds[1]);
+	NOVPN_PROBE2 (helper_fork, vpn_uuid, child_pid);
 
-	status = g_io_channel_write_chars (output, keyfile_data, length, &written, error);
-	g_io_channel_unref (output);
+	close (fds[0]);
+	written = novpn_secret_write (fds[1], keyfile_data, length, error);
 	close (fds[1]);
-	if (status == G_IO_STATUS_ERROR)
+	novpn_perf_end (&spawn);
+	if (!written)
 		return FALSE;
-	g_return_val_if_fail (status == G_IO_STATUS_NORMAL, FALSE);
 
 	if (waitpid (child_pid, &child_status, 0) == -1) {
 		g_set_error_literal (error, G_UNIX_ERROR, 0, g_strerror (errno));
 		return FALSE;
 	}
 
+	NOVPN_PROBE3 (helper_wait, vpn_uuid, child_status, g_get_monotonic_time () - start);
+
 	if (child_status != 0) {
 		g_set_error (error, -1, -1, "%s exited with status %d", gui_helper, child_status);
 		return FALSE;
@@ -93,6 +108,43 @@ spawn_gui_helper (const char *progname,
 	return TRUE;
 }
 
+static void
+_wipe_secret (gpointer key,
+              gpointer value,
+              gpointer user_data)
+{
+	novpn_secret_wipe (value, strlen (value));
+}
+
+/*
+ * The keyfile carries the secret as the Value of the last group. That
+ * one line is put together in locked memory instead of going through
+ * GKeyFile, which would leave copies of it on the heap.
+ */
+static char *
+keyfile_data_with_value (const char *keyfile_data, gsize *length, const char *value)
+{
+	const char *escaped = novpn_secret_keyfile_escape (value);
+	gsize len = *length;
+	char *data;
+	char *p;
+
+	data = novpn_secret_alloc (len + strlen ("\nValue=\n") + strlen (escaped) + 1);
+	p = data;
+
+	memcpy (p, keyfile_data, len);
+	p += len;
+	while (p > data && p[-1] == '\n')
+		p--;
+	*p++ = '\n';
+	p = g_stpcpy (p, "Value=");
+	p = g_stpcpy (p, escaped);
+	*p++ = '\n';
+
+	*length = p - data;
+	return data;
+}
+
 static void
 _vpn_setting_add_data (gpointer key,
                        gpointer value,
@@ -129,6 +181,7 @@ main (int argc, char *argv[])
 	g_autofree gchar *vpn_service = NULL;
 	g_autofree gchar *setting_str = NULL;
 	g_autofree gchar *keyfile_data = NULL;
+	const char *ui_data;
 	gsize length;
 	g_autoptr(GOptionContext) context = NULL;
 	g_autoptr(GHashTable) data = NULL;
@@ -148,6 +201,8 @@ main (int argc, char *argv[])
 		{ NULL }
 	};
 
+	novpn_secret_init ();
+
 	context = g_option_context_new ("- novpn auth dialog");
 	g_option_context_add_main_entries (context, entries, "Novpn");
 	if (!g_option_context_parse (context, &argc, &argv, &error)) {
@@ -165,17 +220,24 @@ main (int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	setting_vpn = g_object_new (NM_TYPE_SETTING_VPN, "service-type", vpn_service, NULL);
-	g_hash_table_foreach (data, _vpn_setting_add_data, setting_vpn);
-	g_hash_table_foreach (secrets, _vpn_setting_add_secret, setting_vpn);
+	/* Building a setting pulls in the whole libnm type system. Only do
+	 * that if someone is going to look at the dump. */
+	if (g_getenv ("NM_NOVPN_AUTH_DIALOG_DEBUG")) {
+		setting_vpn = g_object_new (NM_TYPE_SETTING_VPN, "service-type", vpn_service, NULL);
+		g_hash_table_foreach (data, _vpn_setting_add_data, setting_vpn);
+		g_hash_table_foreach (secrets, _vpn_setting_add_secret, setting_vpn);
 
-	setting_str = nm_setting_to_string (NM_SETTING (setting_vpn));
-	g_printerr ("%s", setting_str);
+		setting_str = nm_setting_to_string (NM_SETTING (setting_vpn));
+		g_printerr ("%s", setting_str);
+	}
 
 	if (!allow_interaction)
 		should_ask = FALSE;
 
-	password = nm_setting_vpn_get_secret (setting_vpn, "password");
+	/* From now on, the secrets only exist in locked memory. What libnm
+	 * read them into is out of reach, but the tables at least aren't. */
+	password = novpn_secret_strdup (g_hash_table_lookup (secrets, "password"));
+	g_hash_table_foreach (secrets, _wipe_secret, NULL);
 	if (password)
 		should_ask = FALSE;
 
@@ -185,24 +247,35 @@ main (int argc, char *argv[])
 	if (!allow_interaction)
 		should_ask = FALSE;
 
+	/* The GUI helper would not show anything and just exit. Save ourselves
+	 * the fork and exec. */
+	if (!should_ask && !external_ui_mode)
+		return EXIT_SUCCESS;
+
 	keyfile = g_key_file_new ();
 
 	g_key_file_set_integer (keyfile, "VPN Plugin UI", "Version", 2);
 	g_key_file_set_string (keyfile, "VPN Plugin UI", "Description", "Tell me all your secrets");
 	g_key_file_set_string (keyfile, "VPN Plugin UI", "Title", "Authenticate VPN");
 
+	/* Needs to stay the last group, see keyfile_data_with_value(). */
 	g_key_file_set_string (keyfile, "password", "Label", "Password");
-	if (password)
-		g_key_file_set_string (keyfile, "password", "Value", password);
 	g_key_file_set_boolean (keyfile, "password", "IsSecret", TRUE);
 	g_key_file_set_boolean (keyfile, "password", "ShouldAsk", should_ask);
 
 	keyfile_data = g_key_file_to_data (keyfile, &length, NULL);
+	if (password)
+		ui_data = keyfile_data_with_value (keyfile_data, &length, password);
+	else
+		ui_data = keyfile_data;
 
 	if (external_ui_mode) {
-		g_print ("%s", keyfile_data);
+		if (!novpn_secret_write (STDOUT_FILENO, ui_data, length, &error)) {
+			g_printerr ("Error: %s\n", error->message);
+			return EXIT_FAILURE;
+		}
 	} else {
-		if (!spawn_gui_helper (argv[0], keyfile_data, length, argv, &error)) {
+		if (!spawn_gui_helper (argv[0], vpn_uuid, ui_data, length, argv, &error)) {
 			g_printerr ("Error: %s\n", error->message);
 			return EXIT_FAILURE;
 		}
@@ -0,0 +1,218 @@
+/*
+ * nm-novpn-clock - Real or virtual time for the NetworkManager mock VPN
+ * service's timers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Time as the service's timers see it, in microseconds like
+ * g_get_monotonic_time(). Normally it's just that.
+ *
+ * Virtual time runs along with the real one, but whenever the main loop
+ * has nothing else to do and a timer is pending, it jumps ahead to that
+ * timer's deadline. Timers still fire in the order they would in real
+ * time, only without the waiting, so scenarios spanning hours finish in
+ * seconds.
+ *
+ * Only the timers added here are affected. Those of the parent class
+ * and GDBus, and the tunnel thread's shaping, stay in real time. Note
+ * that anything coming from outside, D-Bus calls in particular, takes
+ * no virtual time at all: time may jump past a peer that's slow to
+ * respond.
+ */
+
+#include "nm-novpn-clock.h"
+
+/* Below anything else, so that it only runs when nothing else would. */
+#define WARP_PRIORITY (G_PRIORITY_LOW + 1000)
+
+typedef struct {
+	GSource source;
+	gint64 deadline;
+	guint interval;
+} ClockTimer;
+
+static struct {
+	gboolean virtual;
+	gint64 offset;
+	gint64 started;
+	guint warps;
+
+	/* Of ClockTimer, not owned. */
+	GPtrArray *timers;
+} vclock;
+
+gint64
+novpn_clock_get_time (void)
+{
+	return g_get_monotonic_time () + vclock.offset;
+}
+
+gboolean
+novpn_clock_is_virtual (void)
+{
+	return vclock.virtual;
+}
+
+static gint64
+next_deadline (void)
+{
+	ClockTimer *timer;
+	gint64 deadline = G_MAXINT64;
+	guint i;
+
+	for (i = 0; i < vclock.timers->len; i++) {
+		timer = vclock.timers->pdata[i];
+		if (!g_source_is_destroyed (&timer->source))
+			deadline = MIN (deadline, timer->deadline);
+	}
+
+	return deadline;
+}
+
+static gboolean
+timer_prepare (GSource *source, gint *timeout)
+{
+	ClockTimer *timer = (ClockTimer *) source;
+	gint64 remaining = timer->deadline - novpn_clock_get_time ();
+
+	if (remaining <= 0) {
+		*timeout = 0;
+		return TRUE;
+	}
+
+	*timeout = MIN ((remaining + 999) / 1000, G_MAXINT);
+	return FALSE;
+}
+
+static gboolean
+timer_check (GSource *source)
+{
+	ClockTimer *timer = (ClockTimer *) source;
+
+	return timer->deadline <= novpn_clock_get_time ();
+}
+
+static gboolean
+timer_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	ClockTimer *timer = (ClockTimer *) source;
+
+	if (!callback (user_data))
+		return G_SOURCE_REMOVE;
+
+	timer->deadline += (gint64) timer->interval * 1000;
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+timer_finalize (GSource *source)
+{
+	g_ptr_array_remove_fast (vclock.timers, source);
+}
+
+static GSourceFuncs timer_funcs = {
+	.prepare = timer_prepare,
+	.check = timer_check,
+	.dispatch = timer_dispatch,
+	.finalize = timer_finalize,
+};
+
+static gboolean
+warp_prepare (GSource *source, gint *timeout)
+{
+	*timeout = -1;
+	return next_deadline () != G_MAXINT64;
+}
+
+static gboolean
+warp_check (GSource *source)
+{
+	return next_deadline () != G_MAXINT64;
+}
+
+static gboolean
+warp_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	gint64 ahead = next_deadline () - novpn_clock_get_time ();
+
+	if (ahead > 0) {
+		vclock.offset += ahead;
+		vclock.warps++;
+	}
+
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs warp_funcs = {
+	.prepare = warp_prepare,
+	.check = warp_check,
+	.dispatch = warp_dispatch,
+};
+
+/* Needs to be called before any timers are added or the time is taken. */
+void
+novpn_clock_set_virtual (void)
+{
+	GSource *warp;
+
+	g_return_if_fail (!vclock.virtual);
+
+	vclock.virtual = TRUE;
+	vclock.started = g_get_monotonic_time ();
+	vclock.timers = g_ptr_array_new ();
+
+	warp = g_source_new (&warp_funcs, sizeof (GSource));
+	g_source_set_priority (warp, WARP_PRIORITY);
+	g_source_set_name (warp, "novpn-clock-warp");
+	g_source_attach (warp, NULL);
+	g_source_unref (warp);
+}
+
+/* Same as g_timeout_add(), the result can be given to g_source_remove(). */
+guint
+novpn_clock_timeout_add (guint interval, GSourceFunc function, gpointer data)
+{
+	ClockTimer *timer;
+	guint id;
+
+	if (!vclock.virtual)
+		return g_timeout_add (interval, function, data);
+
+	timer = (ClockTimer *) g_source_new (&timer_funcs, sizeof (ClockTimer));
+	timer->interval = interval;
+	timer->deadline = novpn_clock_get_time () + (gint64) interval * 1000;
+	g_source_set_callback (&timer->source, function, data, NULL);
+	g_ptr_array_add (vclock.timers, timer);
+
+	id = g_source_attach (&timer->source, NULL);
+	g_source_unref (&timer->source);
+
+	return id;
+}
+
+/* Since novpn_clock_set_virtual(); all zero in real time. */
+void
+novpn_clock_get_elapsed (gint64 *elapsed, gint64 *real_elapsed, guint *warps)
+{
+	gint64 real = vclock.virtual ? g_get_monotonic_time () - vclock.started : 0;
+
+	*elapsed = vclock.virtual ? real + vclock.offset : 0;
+	*real_elapsed = real;
+	*warps = vclock.warps;
+}
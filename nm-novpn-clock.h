@@ -0,0 +1,35 @@
+/*
+ * nm-novpn-clock - Real or virtual time for the NetworkManager mock VPN
+ * service's timers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_CLOCK_H__
+#define __NM_NOVPN_CLOCK_H__
+
+#include <glib.h>
+
+void novpn_clock_set_virtual (void);
+gboolean novpn_clock_is_virtual (void);
+
+gint64 novpn_clock_get_time (void);
+guint novpn_clock_timeout_add (guint interval, GSourceFunc function, gpointer data);
+
+void novpn_clock_get_elapsed (gint64 *elapsed, gint64 *real_elapsed, guint *warps);
+
+#endif /* __NM_NOVPN_CLOCK_H__ */
@@ -0,0 +1,1123 @@
+/*
+ * nm-novpn-dns - DNS stub for the NetworkManager mock VPN service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Answers for the pushed domain, over UDP and TCP, from a zone file
+ * with lines like these:
+ *
+ *   $TTL 300
+ *   @          IN A     192.0.2.1
+ *   intranet   60 A     192.0.2.10
+ *   intranet   AAAA     2001:db8::10
+ *   wiki       TXT      "hello there" "world"
+ *
+ * Names are relative to the domain unless they end with a dot, and the
+ * optional TTL defaults to $TTL, or 300 seconds. Only A, AAAA and TXT
+ * records are understood. Comments start with '#'.
+ *
+ * Names outside the domain are forwarded to another server if there is
+ * one and answered with NXDOMAIN otherwise. EDNS is ignored, so UDP
+ * answers are at most 512 bytes and get truncated beyond that.
+ *
+ * Answers are cached as whole messages, keyed by the question, until
+ * the shortest TTL in them runs out; answers from the zone stay for
+ * good. The TTLs are not counted down in cached answers. Everything is
+ * done by a thread of its own, which owns the zone, the cache and the
+ * queries waiting for the other server, so none of that needs locking.
+ * The counters are updated atomically.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+
+#include "nm-novpn-dns.h"
+
+/* Datagrams read at once, and answered at once. */
+#define BATCH 64
+
+#define UDP_MAX 512
+#define QUERY_MAX 4096
+#define TCP_MAX 65535
+#define TCP_CONNS_MAX 64
+
+#define CACHE_MAX 65536
+#define CACHE_TTL_MAX 3600
+#define NEGATIVE_TTL 60
+#define DEFAULT_TTL 300
+#define FORWARD_TIMEOUT_US (5 * G_USEC_PER_SEC)
+/* Well short of the IDs there are, so that a free one is quick to find. */
+#define FORWARD_MAX 16384
+
+#define TYPE_A 1
+#define TYPE_TXT 16
+#define TYPE_AAAA 28
+#define TYPE_OPT 41
+#define TYPE_ANY 255
+#define CLASS_IN 1
+#define CLASS_ANY 255
+
+#define FLAG_QR 0x8000
+#define FLAG_AA 0x0400
+#define FLAG_TC 0x0200
+#define FLAG_RD 0x0100
+#define OPCODE(flags) (((flags) >> 11) & 0xf)
+#define RCODE(flags) ((flags) & 0xf)
+
+#define RCODE_NOERROR 0
+#define RCODE_FORMERR 1
+#define RCODE_SERVFAIL 2
+#define RCODE_NXDOMAIN 3
+#define RCODE_NOTIMP 4
+
+typedef struct {
+	guint16 type;
+	guint32 ttl;
+	guint16 len;
+	guint8 data[];
+} Record;
+
+typedef struct {
+	gint64 expires;
+	gsize qend;
+	gsize len;
+	guint8 data[];
+} CacheEntry;
+
+typedef struct {
+	int fd;
+	guint serial;
+	gsize len;
+	guint8 buf[2 + QUERY_MAX];
+} Conn;
+
+/* Where an answer goes: a datagram's sender or a TCP connection. */
+typedef struct {
+	struct sockaddr_storage addr;
+	socklen_t addrlen;
+	int tcp_fd;
+	guint tcp_serial;
+
+	/* Only once forwarded. */
+	guint16 client_id;
+	char *key;
+	gint64 sent;
+} Origin;
+
+struct _NovpnDns {
+	int udp_fd;
+	int tcp_fd;
+	int upstream_fd;
+	int wakeup[2];
+	struct sockaddr_in address;
+	char *domain;
+	GThread *thread;
+
+	/* Owned by the thread. */
+	GHashTable *zone;
+	GHashTable *cache;
+	GHashTable *pending;
+	GPtrArray *conns;
+	guint conn_serial;
+	GRand *rand;
+	gint64 now;
+	guint8 udp_in[BATCH][QUERY_MAX];
+	guint8 udp_out[BATCH][UDP_MAX];
+	guint8 scratch[TCP_MAX];
+	guint8 tcp_out[TCP_MAX];
+
+	volatile gsize queries;
+	volatile gsize cache_hits;
+	volatile gsize forwarded;
+	volatile gsize nxdomain;
+};
+
+static inline guint16
+get16 (const guint8 *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline void
+put16 (guint8 *p, guint16 v)
+{
+	p[0] = v >> 8;
+	p[1] = v & 0xff;
+}
+
+static inline void
+put32 (guint8 *p, guint32 v)
+{
+	put16 (p, v >> 16);
+	put16 (p + 2, v & 0xffff);
+}
+
+static gboolean
+in_domain (const char *domain, const char *name)
+{
+	gsize dlen = strlen (domain);
+	gsize nlen = strlen (name);
+
+	if (nlen == dlen)
+		return strcmp (name, domain) == 0;
+
+	return    nlen > dlen
+	       && name[nlen - dlen - 1] == '.'
+	       && strcmp (name + nlen - dlen, domain) == 0;
+}
+
+/*
+ * Zone file parsing. Done before the thread starts, which only ever
+ * reads the result.
+ */
+
+static char *
+zone_name (const char *domain, const char *name)
+{
+	g_autofree char *lower = g_ascii_strdown (name, -1);
+	gsize len = strlen (lower);
+
+	if (strcmp (lower, "@") == 0)
+		return g_strdup (domain);
+
+	if (len && lower[len - 1] == '.') {
+		lower[len - 1] = '\0';
+		return in_domain (domain, lower) ? g_strdup (lower) : NULL;
+	}
+
+	return g_strdup_printf ("%s.%s", lower, domain);
+}
+
+static gboolean
+parse_ttl (const char *str, guint32 *ttl)
+{
+	guint64 value;
+	char *end;
+
+	if (!g_ascii_isdigit (str[0]))
+		return FALSE;
+
+	value = g_ascii_strtoull (str, &end, 10);
+	if (*end != '\0' || value > G_MAXINT32)
+		return FALSE;
+
+	*ttl = value;
+	return TRUE;
+}
+
+static Record *
+record_new (guint16 type, guint32 ttl, char **data, GError **error)
+{
+	guint8 rdata[UDP_MAX];
+	gsize len = 0;
+	gsize slen;
+	Record *record;
+	int i;
+
+	if (!data[0]) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "No data");
+		return NULL;
+	}
+
+	switch (type) {
+	case TYPE_A:
+		if (data[1] || inet_pton (AF_INET, data[0], rdata) != 1)
+			goto bad;
+		len = 4;
+		break;
+	case TYPE_AAAA:
+		if (data[1] || inet_pton (AF_INET6, data[0], rdata) != 1)
+			goto bad;
+		len = 16;
+		break;
+	case TYPE_TXT:
+		for (i = 0; data[i]; i++) {
+			slen = strlen (data[i]);
+			if (slen > 255 || len + 1 + slen > UDP_MAX)
+				goto bad;
+			rdata[len++] = slen;
+			memcpy (rdata + len, data[i], slen);
+			len += slen;
+		}
+		break;
+	default:
+		g_return_val_if_reached (NULL);
+	}
+
+	record = g_malloc (sizeof (Record) + len);
+	record->type = type;
+	record->ttl = ttl;
+	record->len = len;
+	memcpy (record->data, rdata, len);
+	return record;
+
+bad:
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Bad data: %s", data[0]);
+	return NULL;
+}
+
+static gboolean
+zone_load (NovpnDns *dns, const char *file_name, GError **error)
+{
+	g_autofree char *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	guint32 default_ttl = DEFAULT_TTL;
+	guint32 ttl;
+	guint16 type;
+	GPtrArray *records;
+	Record *record;
+	char *name;
+	int i, t;
+
+	if (!g_file_get_contents (file_name, &contents, NULL, error))
+		return FALSE;
+
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i]; i++) {
+		g_auto(GStrv) tokens = NULL;
+		g_autoptr(GError) local = NULL;
+
+		if (!g_shell_parse_argv (lines[i], NULL, &tokens, &local)) {
+			if (g_error_matches (local, G_SHELL_ERROR, G_SHELL_ERROR_EMPTY_STRING))
+				continue;
+			goto bad;
+		}
+
+		if (strcmp (tokens[0], "$TTL") == 0) {
+			if (!tokens[1] || tokens[2] || !parse_ttl (tokens[1], &default_ttl))
+				goto bad;
+			continue;
+		}
+
+		t = 1;
+		ttl = default_ttl;
+		if (tokens[t] && parse_ttl (tokens[t], &ttl))
+			t++;
+		if (tokens[t] && g_ascii_strcasecmp (tokens[t], "IN") == 0)
+			t++;
+		if (!tokens[t])
+			goto bad;
+
+		if (g_ascii_strcasecmp (tokens[t], "A") == 0)
+			type = TYPE_A;
+		else if (g_ascii_strcasecmp (tokens[t], "AAAA") == 0)
+			type = TYPE_AAAA;
+		else if (g_ascii_strcasecmp (tokens[t], "TXT") == 0)
+			type = TYPE_TXT;
+		else
+			goto bad;
+
+		record = record_new (type, ttl, tokens + t + 1, &local);
+		if (!record)
+			goto bad;
+
+		name = zone_name (dns->domain, tokens[0]);
+		if (!name) {
+			g_free (record);
+			g_set_error (&local, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+			             "%s is not in %s", tokens[0], dns->domain);
+			goto bad;
+		}
+
+		records = g_hash_table_lookup (dns->zone, name);
+		if (!records) {
+			records = g_ptr_array_new_with_free_func (g_free);
+			g_hash_table_insert (dns->zone, name, records);
+		} else {
+			g_free (name);
+		}
+		g_ptr_array_add (records, record);
+		continue;
+
+bad:
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s:%d: %s", file_name, i + 1,
+		             local ? local->message : "Can't parse the record");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Messages.
+ */
+
+/* Reads a name from a question, which is never compressed, in lower
+ * case and without the trailing dot. Returns the offset past it. */
+static gsize
+parse_qname (const guint8 *msg, gsize len, gsize off, char name[256])
+{
+	gsize n = 0;
+	guint8 label;
+
+	while (off < len) {
+		label = msg[off++];
+		if (label == 0) {
+			name[n] = '\0';
+			return off;
+		}
+		if (label > 63 || off + label > len || n + label + 1 > 254)
+			return 0;
+		if (n)
+			name[n++] = '.';
+		while (label--)
+			name[n++] = g_ascii_tolower (msg[off++]);
+	}
+
+	return 0;
+}
+
+static gsize
+skip_name (const guint8 *msg, gsize len, gsize off)
+{
+	while (off < len) {
+		if (msg[off] == 0)
+			return off + 1;
+		if ((msg[off] & 0xc0) == 0xc0)
+			return off + 2 <= len ? off + 2 : 0;
+		if (msg[off] & 0xc0)
+			return 0;
+		off += 1 + msg[off];
+	}
+
+	return 0;
+}
+
+/*
+ * How long an answer from the other server may be cached: for as long
+ * as its shortest lived record. Also finds where the question ends.
+ */
+static gint64
+response_ttl (const guint8 *msg, gsize len, gsize *qend)
+{
+	guint32 ttl = CACHE_TTL_MAX;
+	guint records;
+	gsize off;
+
+	if (len < 12 || get16 (msg + 4) != 1)
+		return -1;
+
+	off = skip_name (msg, len, 12);
+	if (!off || off + 4 > len)
+		return -1;
+	*qend = off + 4;
+
+	records = get16 (msg + 6) + get16 (msg + 8) + get16 (msg + 10);
+	if (!records)
+		return NEGATIVE_TTL;
+
+	off = *qend;
+	while (records--) {
+		off = skip_name (msg, len, off);
+		if (!off || off + 10 > len)
+			return -1;
+		if (get16 (msg + off) != TYPE_OPT)
+			ttl = MIN (ttl, (guint32) get16 (msg + off + 4) << 16 | get16 (msg + off + 6));
+		off += 10 + get16 (msg + off + 8);
+	}
+
+	return off <= len ? ttl : -1;
+}
+
+/* Just the header, for queries we can't make sense of. */
+static gsize
+error_reply (const guint8 *query, guint8 *out, guint rcode)
+{
+	memcpy (out, query, 12);
+	put16 (out + 2, FLAG_QR | (get16 (query + 2) & FLAG_RD) | rcode);
+	memset (out + 4, 0, 8);
+	return 12;
+}
+
+static void
+cache_insert (NovpnDns *dns, const char *key, const guint8 *msg, gsize len, gsize qend, gint64 expires)
+{
+	CacheEntry *entry;
+
+	/* Crude, but the working set of a test hardly ever gets there. */
+	if (g_hash_table_size (dns->cache) >= CACHE_MAX)
+		g_hash_table_remove_all (dns->cache);
+
+	entry = g_malloc (sizeof (CacheEntry) + len);
+	entry->expires = expires;
+	entry->qend = qend;
+	entry->len = len;
+	memcpy (entry->data, msg, len);
+	g_hash_table_replace (dns->cache, g_strdup (key), entry);
+}
+
+/*
+ * A cached answer with the query's ID, RD bit and question, truncated if
+ * need be. The entry's question is that of whoever asked first; a resolver
+ * that randomizes the letter case of its queries (0x20) would reject that
+ * unless it gets its own back.
+ */
+static gsize
+cache_reply (const CacheEntry *entry, const guint8 *query, gsize qend, guint8 *out, gsize max)
+{
+	guint16 flags = get16 (entry->data + 2);
+	gsize len = entry->len;
+
+	if (len > max) {
+		len = entry->qend;
+		flags |= FLAG_TC;
+	}
+
+	memcpy (out, entry->data, len);
+	if (len != entry->len)
+		memset (out + 6, 0, 6);
+
+	memcpy (out, query, 2);
+	put16 (out + 2, (flags & ~FLAG_RD) | (get16 (query + 2) & FLAG_RD));
+	if (qend == entry->qend)
+		memcpy (out + 12, query + 12, qend - 12);
+	return len;
+}
+
+/* Builds the answer from the zone into dns->scratch. */
+static gsize
+zone_answer (NovpnDns *dns, const guint8 *query, gsize qend, const char *name,
+             guint16 qtype, guint16 qclass)
+{
+	guint8 *out = dns->scratch;
+	GPtrArray *records = g_hash_table_lookup (dns->zone, name);
+	Record *record;
+	guint answers = 0;
+	gsize len = qend;
+	guint i;
+
+	memcpy (out, query, qend);
+	memset (out + 4, 0, 8);
+	put16 (out + 4, 1);
+
+	if (!records) {
+		put16 (out + 2, FLAG_QR | FLAG_AA | RCODE_NXDOMAIN);
+		return len;
+	}
+
+	for (i = 0; i < records->len && (qclass == CLASS_IN || qclass == CLASS_ANY); i++) {
+		record = records->pdata[i];
+		if (qtype != record->type && qtype != TYPE_ANY)
+			continue;
+		if (len + 12 + record->len > sizeof (dns->scratch))
+			break;
+
+		/* Pointing back at the name in the question. */
+		put16 (out + len, 0xc00c);
+		put16 (out + len + 2, record->type);
+		put16 (out + len + 4, CLASS_IN);
+		put32 (out + len + 6, record->ttl);
+		put16 (out + len + 10, record->len);
+		memcpy (out + len + 12, record->data, record->len);
+		len += 12 + record->len;
+		answers++;
+	}
+
+	put16 (out + 2, FLAG_QR | FLAG_AA | RCODE_NOERROR);
+	put16 (out + 6, answers);
+	return len;
+}
+
+/*
+ * The queries go out with random IDs that aren't in use already; a
+ * sequential ID would wrap around within the timeout at a high enough
+ * rate, and is easy to guess for anyone who'd like to answer in place of
+ * the other server. Returns FALSE if there are too many in flight.
+ */
+static gboolean
+forward (NovpnDns *dns, const guint8 *query, gsize len, const char *key, const Origin *origin)
+{
+	guint8 buf[QUERY_MAX];
+	Origin *pending;
+	guint16 id;
+
+	if (g_hash_table_size (dns->pending) >= FORWARD_MAX)
+		return FALSE;
+
+	do
+		id = g_rand_int_range (dns->rand, 0, 0x10000);
+	while (g_hash_table_contains (dns->pending, GUINT_TO_POINTER (id)));
+
+	memcpy (buf, query, len);
+	put16 (buf, id);
+	if (send (dns->upstream_fd, buf, len, MSG_DONTWAIT) < 0)
+		return FALSE;
+
+	pending = g_slice_dup (Origin, origin);
+	pending->client_id = get16 (query);
+	pending->key = g_strdup (key);
+	pending->sent = dns->now;
+	g_hash_table_insert (dns->pending, GUINT_TO_POINTER (id), pending);
+	g_atomic_pointer_add (&dns->forwarded, 1);
+
+	return TRUE;
+}
+
+/*
+ * Answers a query into out, returning the length. Nothing is returned
+ * for what doesn't deserve an answer and for forwarded queries; those
+ * are answered once the other server does.
+ */
+static gsize
+handle_query (NovpnDns *dns, const guint8 *query, gsize len, guint8 *out, gsize max,
+              const Origin *origin)
+{
+	char name[256];
+	char key[sizeof (name) + 8];
+	guint16 flags, qtype, qclass;
+	const CacheEntry *entry;
+	gsize qend;
+
+	if (len < 12)
+		return 0;
+
+	flags = get16 (query + 2);
+	if (flags & FLAG_QR)
+		return 0;
+
+	g_atomic_pointer_add (&dns->queries, 1);
+
+	if (OPCODE (flags) != 0)
+		return error_reply (query, out, RCODE_NOTIMP);
+
+	if (get16 (query + 4) != 1)
+		return error_reply (query, out, RCODE_FORMERR);
+	qend = parse_qname (query, len, 12, name);
+	if (!qend || qend + 4 > len)
+		return error_reply (query, out, RCODE_FORMERR);
+	qtype = get16 (query + qend);
+	qclass = get16 (query + qend + 2);
+	qend += 4;
+
+	g_snprintf (key, sizeof (key), "%04x%04x%s", qtype, qclass, name);
+	entry = g_hash_table_lookup (dns->cache, key);
+	if (entry && entry->expires > dns->now) {
+		g_atomic_pointer_add (&dns->cache_hits, 1);
+		if (RCODE (get16 (entry->data + 2)) == RCODE_NXDOMAIN)
+			g_atomic_pointer_add (&dns->nxdomain, 1);
+		return cache_reply (entry, query, qend, out, max);
+	}
+
+	if (in_domain (dns->domain, name)) {
+		len = zone_answer (dns, query, qend, name, qtype, qclass);
+		cache_insert (dns, key, dns->scratch, len, qend, G_MAXINT64);
+		entry = g_hash_table_lookup (dns->cache, key);
+		if (RCODE (get16 (entry->data + 2)) == RCODE_NXDOMAIN)
+			g_atomic_pointer_add (&dns->nxdomain, 1);
+		return cache_reply (entry, query, qend, out, max);
+	}
+
+	if (dns->upstream_fd != -1 && len <= QUERY_MAX) {
+		if (forward (dns, query, len, key, origin))
+			return 0;
+		return error_reply (query, out, RCODE_SERVFAIL);
+	}
+
+	g_atomic_pointer_add (&dns->nxdomain, 1);
+	memcpy (out, query, qend);
+	put16 (out + 2, FLAG_QR | (flags & FLAG_RD) | RCODE_NXDOMAIN);
+	memset (out + 6, 0, 6);
+	return qend;
+}
+
+/*
+ * Transports.
+ */
+
+static void
+conn_close (NovpnDns *dns, guint i)
+{
+	Conn *conn = dns->conns->pdata[i];
+
+	close (conn->fd);
+	g_free (conn);
+	g_ptr_array_remove_index_fast (dns->conns, i);
+}
+
+static gboolean
+tcp_send (Conn *conn, const guint8 *msg, gsize len)
+{
+	guint8 prefix[2];
+	struct iovec iov[2] = {
+		{ .iov_base = prefix, .iov_len = 2 },
+		{ .iov_base = (void *) msg, .iov_len = len },
+	};
+
+	/* A client that doesn't keep up with its answers is not worth
+	 * waiting for. */
+	put16 (prefix, len);
+	return writev (conn->fd, iov, 2) == (ssize_t) (len + 2);
+}
+
+static void
+reply_to (NovpnDns *dns, const Origin *origin, const guint8 *msg, gsize len)
+{
+	Conn *conn;
+	guint i;
+
+	if (origin->tcp_fd == -1) {
+		sendto (dns->udp_fd, msg, len, MSG_DONTWAIT,
+		        (const struct sockaddr *) &origin->addr, origin->addrlen);
+		return;
+	}
+
+	for (i = 0; i < dns->conns->len; i++) {
+		conn = dns->conns->pdata[i];
+		if (conn->fd != origin->tcp_fd || conn->serial != origin->tcp_serial)
+			continue;
+		if (!tcp_send (conn, msg, len))
+			conn_close (dns, i);
+		return;
+	}
+}
+
+static void
+udp_receive (NovpnDns *dns)
+{
+	struct sockaddr_storage addrs[BATCH];
+	struct mmsghdr in[BATCH];
+	struct mmsghdr out[BATCH];
+	struct iovec in_iov[BATCH];
+	struct iovec out_iov[BATCH];
+	Origin origin = { .tcp_fd = -1 };
+	int replies = 0;
+	gsize len;
+	int n, i;
+
+	memset (in, 0, sizeof (in));
+	for (i = 0; i < BATCH; i++) {
+		in_iov[i].iov_base = dns->udp_in[i];
+		in_iov[i].iov_len = QUERY_MAX;
+		in[i].msg_hdr.msg_name = &addrs[i];
+		in[i].msg_hdr.msg_namelen = sizeof (addrs[i]);
+		in[i].msg_hdr.msg_iov = &in_iov[i];
+		in[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	n = recvmmsg (dns->udp_fd, in, BATCH, MSG_DONTWAIT, NULL);
+	if (n <= 0)
+		return;
+
+	memset (out, 0, sizeof (out));
+	for (i = 0; i < n; i++) {
+		memcpy (&origin.addr, &addrs[i], in[i].msg_hdr.msg_namelen);
+		origin.addrlen = in[i].msg_hdr.msg_namelen;
+
+		len = handle_query (dns, dns->udp_in[i], in[i].msg_len,
+		                    dns->udp_out[replies], UDP_MAX, &origin);
+		if (!len)
+			continue;
+
+		out_iov[replies].iov_base = dns->udp_out[replies];
+		out_iov[replies].iov_len = len;
+		out[replies].msg_hdr.msg_name = &addrs[i];
+		out[replies].msg_hdr.msg_namelen = in[i].msg_hdr.msg_namelen;
+		out[replies].msg_hdr.msg_iov = &out_iov[replies];
+		out[replies].msg_hdr.msg_iovlen = 1;
+		replies++;
+	}
+
+	/* If the socket buffer is full, the clients will ask again. */
+	if (replies)
+		sendmmsg (dns->udp_fd, out, replies, MSG_DONTWAIT);
+}
+
+static void
+upstream_receive (NovpnDns *dns)
+{
+	guint8 buf[QUERY_MAX];
+	char name[256];
+	char key[sizeof (name) + 8];
+	Origin *pending;
+	gint64 ttl;
+	gsize qend;
+	ssize_t len;
+	guint16 id;
+	int i;
+
+	for (i = 0; i < BATCH; i++) {
+		len = recv (dns->upstream_fd, buf, sizeof (buf), MSG_DONTWAIT);
+		if (len < 0)
+			return;
+		if (len < 12)
+			continue;
+
+		id = get16 (buf);
+		pending = g_hash_table_lookup (dns->pending, GUINT_TO_POINTER (id));
+		if (!pending)
+			continue;
+
+		/* An answer to some other question with a matching ID is not
+		 * to be passed on, let alone cached. The query stays pending
+		 * for the right answer to come. */
+		ttl = response_ttl (buf, len, &qend);
+		if (ttl < 0 || !parse_qname (buf, len, 12, name))
+			continue;
+		g_snprintf (key, sizeof (key), "%04x%04x%s",
+		            get16 (buf + qend - 4), get16 (buf + qend - 2), name);
+		if (strcmp (key, pending->key) != 0)
+			continue;
+
+		switch (RCODE (get16 (buf + 2))) {
+		case RCODE_NXDOMAIN:
+			g_atomic_pointer_add (&dns->nxdomain, 1);
+			/* fall through */
+		case RCODE_NOERROR:
+			cache_insert (dns, pending->key, buf, len, qend,
+			              dns->now + ttl * G_USEC_PER_SEC);
+			break;
+		}
+
+		put16 (buf, pending->client_id);
+		reply_to (dns, pending, buf, len);
+		g_hash_table_remove (dns->pending, GUINT_TO_POINTER (id));
+	}
+}
+
+static void
+tcp_accept (NovpnDns *dns)
+{
+	Conn *conn;
+	int fd;
+
+	fd = accept4 (dns->tcp_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+		return;
+
+	if (dns->conns->len >= TCP_CONNS_MAX) {
+		close (fd);
+		return;
+	}
+
+	conn = g_new (Conn, 1);
+	conn->fd = fd;
+	conn->serial = ++dns->conn_serial;
+	conn->len = 0;
+	g_ptr_array_add (dns->conns, conn);
+}
+
+/* Each message is preceded by its length. */
+static gboolean
+tcp_receive (NovpnDns *dns, Conn *conn)
+{
+	Origin origin = { .tcp_fd = conn->fd, .tcp_serial = conn->serial };
+	gsize msglen;
+	gsize len;
+	ssize_t n;
+
+	n = recv (conn->fd, conn->buf + conn->len, sizeof (conn->buf) - conn->len, MSG_DONTWAIT);
+	if (n <= 0)
+		return n == -1 && errno == EAGAIN;
+	conn->len += n;
+
+	while (conn->len >= 2) {
+		msglen = get16 (conn->buf);
+		if (msglen > QUERY_MAX)
+			return FALSE;
+		if (conn->len < 2 + msglen)
+			break;
+
+		len = handle_query (dns, conn->buf + 2, msglen, dns->tcp_out, TCP_MAX, &origin);
+		if (len && !tcp_send (conn, dns->tcp_out, len))
+			return FALSE;
+
+		conn->len -= 2 + msglen;
+		memmove (conn->buf, conn->buf + 2 + msglen, conn->len);
+	}
+
+	return TRUE;
+}
+
+static gboolean
+pending_expired (gpointer key, gpointer value, gpointer user_data)
+{
+	NovpnDns *dns = user_data;
+	Origin *pending = value;
+
+	return pending->sent + FORWARD_TIMEOUT_US < dns->now;
+}
+
+static gpointer
+dns_thread (gpointer user_data)
+{
+	NovpnDns *dns = user_data;
+	struct pollfd fds[4 + TCP_CONNS_MAX];
+	guint n_conns;
+	int i;
+
+	fds[0].fd = dns->wakeup[0];
+	fds[1].fd = dns->udp_fd;
+	fds[2].fd = dns->tcp_fd;
+	fds[3].fd = dns->upstream_fd;
+	for (i = 0; i < 4; i++)
+		fds[i].events = POLLIN;
+
+	while (TRUE) {
+		n_conns = dns->conns->len;
+		for (i = 0; i < (int) n_conns; i++) {
+			fds[4 + i].fd = ((Conn *) dns->conns->pdata[i])->fd;
+			fds[4 + i].events = POLLIN;
+			fds[4 + i].revents = 0;
+		}
+
+		/* Wake up now and then to give up on the other server. */
+		if (poll (fds, 4 + n_conns, g_hash_table_size (dns->pending) ? 1000 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			g_warning ("DNS poll failed: %s", g_strerror (errno));
+			break;
+		}
+
+		if (fds[0].revents)
+			break;
+
+		dns->now = g_get_monotonic_time ();
+
+		if (fds[1].revents & POLLIN)
+			udp_receive (dns);
+
+		/* Backwards, as closing one moves the last one in its place. */
+		for (i = (int) n_conns - 1; i >= 0; i--) {
+			if (   fds[4 + i].revents
+			    && !tcp_receive (dns, dns->conns->pdata[i]))
+				conn_close (dns, i);
+		}
+
+		if (fds[2].revents & POLLIN)
+			tcp_accept (dns);
+
+		if (fds[3].revents & POLLIN)
+			upstream_receive (dns);
+
+		g_hash_table_foreach_remove (dns->pending, pending_expired, dns);
+	}
+
+	return NULL;
+}
+
+/*
+ * Setup.
+ */
+
+static int
+open_socket (int type, struct sockaddr_in *address, GError **error)
+{
+	socklen_t len = sizeof (*address);
+	int one = 1;
+	int fd;
+
+	fd = socket (AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		goto fail;
+
+	/* The tunnel's address may not be configured yet. */
+	setsockopt (fd, IPPROTO_IP, IP_FREEBIND, &one, sizeof (one));
+	if (type == SOCK_STREAM)
+		setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+	if (bind (fd, (struct sockaddr *) address, sizeof (*address)) == -1)
+		goto fail;
+	if (type == SOCK_STREAM && listen (fd, TCP_CONNS_MAX) == -1)
+		goto fail;
+
+	/* With port 0, the second socket gets the port the first one got. */
+	if (getsockname (fd, (struct sockaddr *) address, &len) == -1)
+		goto fail;
+
+	return fd;
+
+fail:
+	g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+	             "Can't listen for DNS on port %u: %s",
+	             ntohs (address->sin_port), g_strerror (errno));
+	if (fd != -1)
+		close (fd);
+	return -1;
+}
+
+static int
+open_upstream (const char *forward, GError **error)
+{
+	g_autofree char *host = g_strdup (forward);
+	struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons (53) };
+	char *port;
+	char *end;
+	int fd;
+
+	port = strchr (host, ':');
+	if (port) {
+		*port++ = '\0';
+		address.sin_port = htons (strtoul (port, &end, 10));
+		if (*end != '\0' || end == port)
+			goto bad;
+	}
+	if (inet_pton (AF_INET, host, &address.sin_addr) != 1)
+		goto bad;
+
+	fd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1 || connect (fd, (struct sockaddr *) &address, sizeof (address)) == -1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't forward DNS to %s: %s", forward, g_strerror (errno));
+		if (fd != -1)
+			close (fd);
+		return -1;
+	}
+
+	return fd;
+
+bad:
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+	             "Bad DNS server to forward to: %s", forward);
+	return -1;
+}
+
+static void
+origin_free (gpointer data)
+{
+	Origin *origin = data;
+
+	g_free (origin->key);
+	g_slice_free (Origin, origin);
+}
+
+NovpnDns *
+novpn_dns_new (const NovpnDnsParams *params, GError **error)
+{
+	NovpnDns *dns;
+	char *domain;
+
+	dns = g_new0 (NovpnDns, 1);
+	dns->udp_fd = dns->tcp_fd = dns->upstream_fd = -1;
+	dns->wakeup[0] = dns->wakeup[1] = -1;
+	domain = g_ascii_strdown (params->domain, -1);
+	if (g_str_has_suffix (domain, "."))
+		domain[strlen (domain) - 1] = '\0';
+	dns->domain = domain;
+	dns->zone = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+	                                   (GDestroyNotify) g_ptr_array_unref);
+	dns->cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+	dns->pending = g_hash_table_new_full (NULL, NULL, NULL, origin_free);
+	dns->conns = g_ptr_array_new ();
+	dns->rand = g_rand_new ();
+
+	if (params->zone_file && !zone_load (dns, params->zone_file, error))
+		goto fail;
+
+	dns->address.sin_family = AF_INET;
+	dns->address.sin_port = htons (params->port);
+	if (inet_pton (AF_INET, params->address, &dns->address.sin_addr) != 1) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+		             "Bad address to listen for DNS on: %s", params->address);
+		goto fail;
+	}
+
+	dns->udp_fd = open_socket (SOCK_DGRAM, &dns->address, error);
+	if (dns->udp_fd == -1)
+		goto fail;
+	dns->tcp_fd = open_socket (SOCK_STREAM, &dns->address, error);
+	if (dns->tcp_fd == -1)
+		goto fail;
+
+	if (params->forward) {
+		dns->upstream_fd = open_upstream (params->forward, error);
+		if (dns->upstream_fd == -1)
+			goto fail;
+	}
+
+	if (!g_unix_open_pipe (dns->wakeup, FD_CLOEXEC, error))
+		goto fail;
+
+	dns->thread = g_thread_try_new ("novpn-dns", dns_thread, dns, error);
+	if (!dns->thread)
+		goto fail;
+
+	return dns;
+
+fail:
+	novpn_dns_free (dns);
+	return NULL;
+}
+
+/* In network byte order, like in the IPv4 config. */
+guint32
+novpn_dns_get_address (NovpnDns *dns)
+{
+	return dns->address.sin_addr.s_addr;
+}
+
+guint16
+novpn_dns_get_port (NovpnDns *dns)
+{
+	return ntohs (dns->address.sin_port);
+}
+
+void
+novpn_dns_get_stats (NovpnDns *dns, NovpnDnsStats *stats)
+{
+	stats->queries = (gsize) g_atomic_pointer_get (&dns->queries);
+	stats->cache_hits = (gsize) g_atomic_pointer_get (&dns->cache_hits);
+	stats->forwarded = (gsize) g_atomic_pointer_get (&dns->forwarded);
+	stats->nxdomain = (gsize) g_atomic_pointer_get (&dns->nxdomain);
+}
+
+void
+novpn_dns_free (NovpnDns *dns)
+{
+	guint i;
+
+	if (dns->thread) {
+		if (write (dns->wakeup[1], "", 1) < 0)
+			g_warning ("Can't stop the DNS thread: %s", g_strerror (errno));
+		g_thread_join (dns->thread);
+	}
+
+	for (i = 0; i < 2; i++) {
+		if (dns->wakeup[i] != -1)
+			close (dns->wakeup[i]);
+	}
+	if (dns->udp_fd != -1)
+		close (dns->udp_fd);
+	if (dns->tcp_fd != -1)
+		close (dns->tcp_fd);
+	if (dns->upstream_fd != -1)
+		close (dns->upstream_fd);
+
+	while (dns->conns->len)
+		conn_close (dns, dns->conns->len - 1);
+	g_ptr_array_unref (dns->conns);
+	g_hash_table_unref (dns->pending);
+	g_hash_table_unref (dns->cache);
+	g_hash_table_unref (dns->zone);
+	g_rand_free (dns->rand);
+	g_free (dns->domain);
+	g_free (dns);
+}
@@ -0,0 +1,51 @@
+/*
+ * nm-novpn-dns - DNS stub for the NetworkManager mock VPN service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_DNS_H__
+#define __NM_NOVPN_DNS_H__
+
+#include <glib.h>
+
+typedef struct {
+	/* IPv4, in dotted quad notation */
+	const char *address;
+	guint16 port;
+	const char *domain;
+	const char *zone_file;
+	/* address[:port], or NULL */
+	const char *forward;
+} NovpnDnsParams;
+
+typedef struct {
+	guint64 queries;
+	guint64 cache_hits;
+	guint64 forwarded;
+	guint64 nxdomain;
+} NovpnDnsStats;
+
+typedef struct _NovpnDns NovpnDns;
+
+NovpnDns *novpn_dns_new (const NovpnDnsParams *params, GError **error);
+guint32 novpn_dns_get_address (NovpnDns *dns);
+guint16 novpn_dns_get_port (NovpnDns *dns);
+void novpn_dns_get_stats (NovpnDns *dns, NovpnDnsStats *stats);
+void novpn_dns_free (NovpnDns *dns);
+
+#endif /* __NM_NOVPN_DNS_H__ */
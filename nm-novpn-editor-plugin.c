@@ -25,6 +25,10 @@
 #include <glib/gi18n.h>
 #include <NetworkManager.h>
 
+#include "nm-novpn-index.h"
+#include "nm-novpn-perf.h"
+#include "nm-novpn-probes.h"
+
 struct _NovpnEditorPlugin {
 	GObject parent;
 };
@@ -130,6 +134,19 @@ novpn_editor_plugin_init (NovpnEditorPlugin *plugin)
 {
 }
 
+/* Keeps the directory's index, if any, in sync with the file. */
+static void
+index_update (const char *file_name, GKeyFile *keyfile)
+{
+	g_autoptr(GError) error = NULL;
+	g_autofree char *id = g_key_file_get_string (keyfile, "connection", "id", NULL);
+	g_autofree char *uuid = g_key_file_get_string (keyfile, "connection", "uuid", NULL);
+	g_autofree char *gateway = g_key_file_get_string (keyfile, "vpn", "gateway", NULL);
+
+	if (!novpn_index_update (file_name, id, uuid, gateway, &error))
+		g_message ("Can't update the index: %s", error->message);
+}
+
 static NMConnection *
 import_from_file (NMVpnEditorPlugin *plugin, const char *file_name,
                   GError **error)
@@ -142,6 +159,10 @@ import_from_file (NMVpnEditorPlugin *plugin, const char *file_name,
 	char *str;
 	gsize len;
 	gsize i;
+	gint64 start = g_get_monotonic_time ();
+	NOVPN_PERF_SCOPE (NOVPN_PERF_PROFILE_PARSE);
+
+	NOVPN_PROBE1 (import_start, file_name);
 
 	if (!g_key_file_load_from_file (keyfile, file_name, G_KEY_FILE_NONE, error))
 		return NULL;
@@ -182,6 +203,12 @@ import_from_file (NMVpnEditorPlugin *plugin, const char *file_name,
 		g_free (str);
 	}
 
+	index_update (file_name, keyfile);
+
+	/* Imported connections don't have an UUID yet. Use the id. */
+	NOVPN_PROBE3 (import_done, file_name, nm_connection_get_id (connection),
+	              g_get_monotonic_time () - start);
+
 	return g_object_ref (connection);
 }
 
@@ -207,12 +234,25 @@ export_to_file (NMVpnEditorPlugin *plugin, const char *file_name,
 {
 	g_autoptr(GKeyFile) keyfile = g_key_file_new ();
 	NMSettingVpn *setting_vpn = nm_connection_get_setting_vpn (connection);
+	gint64 start = g_get_monotonic_time ();
+	gboolean success;
+
+	NOVPN_PROBE2 (export_start, file_name, nm_connection_get_uuid (connection));
 
 	g_key_file_set_string (keyfile, "connection", "id", nm_connection_get_id (connection));
+	if (nm_connection_get_uuid (connection))
+		g_key_file_set_string (keyfile, "connection", "uuid", nm_connection_get_uuid (connection));
 	nm_setting_vpn_foreach_data_item (setting_vpn, _add_data_item, keyfile);
 	nm_setting_vpn_foreach_secret (setting_vpn, _add_secret, keyfile);
 
-	return g_key_file_save_to_file (keyfile, file_name, error);
+	success = g_key_file_save_to_file (keyfile, file_name, error);
+	if (success)
+		index_update (file_name, keyfile);
+
+	NOVPN_PROBE3 (export_done, file_name, nm_connection_get_uuid (connection),
+	              g_get_monotonic_time () - start);
+
+	return success;
 }
 
 static void
@@ -24,19 +24,42 @@
 #include <libnma/nma-ui-utils.h>
 #include <gtk/gtk.h>
 
+#include "nm-novpn-probes.h"
+
 #if !GTK_CHECK_VERSION(3,96,0)
 #define gtk_editable_set_text(editable,text)	gtk_entry_set_text(GTK_ENTRY(editable), (text))
 #define gtk_editable_get_text(editable)		gtk_entry_get_text(GTK_ENTRY(editable))
 #endif
 
+/* Coalesce bursts of edits (typing) into a single "changed" emission. */
+#define CHANGED_DEBOUNCE_MS 150
+
+typedef enum {
+	DIRTY_GATEWAY  = 1 << 0,
+	DIRTY_USERNAME = 1 << 1,
+	DIRTY_PASSWORD = 1 << 2,
+	DIRTY_CA_CERT  = 1 << 3,
+	DIRTY_ALL      = DIRTY_GATEWAY | DIRTY_USERNAME | DIRTY_PASSWORD | DIRTY_CA_CERT,
+} DirtyFlags;
+
 struct _NMNovpnEditor {
 	GtkBox parent;
 
 	GtkEditable *password_entry;
 	GtkEditable *username_entry;
 	GtkEditable *gateway_entry;
+	GtkExpander *ca_cert_expander;
+	GtkBox *ca_cert_box;
 	NMACertChooser *ca_cert_chooser;
+	GtkLabel *ca_cert_status;
 	GtkSizeGroup *labels;
+
+	GCancellable *ca_cert_cancellable;
+
+	/* The setting we last synced to and what changed since then. */
+	NMSettingVpn *setting;
+	DirtyFlags dirty;
+	guint changed_id;
 };
 
 struct _NMNovpnEditorClass {
@@ -57,41 +80,315 @@ get_widget (NMVpnEditor *iface)
 	return G_OBJECT (iface);
 }
 
+/*
+ * CA bundles can be big and live on slow network file systems. They're
+ * read and parsed in a worker thread and the outcome is remembered for
+ * as long as the file (device, inode, mtime) stays the same. The cache
+ * is shared by all editor instances in the process.
+ */
+
+typedef struct {
+	guint32 device;
+	guint64 inode;
+	guint64 mtime;
+	guint32 mtime_usec;
+	gint n_certs;
+	GError *error;
+} CertCacheEntry;
+
+static GHashTable *cert_cache;
+G_LOCK_DEFINE_STATIC (cert_cache);
+
+static void
+cert_cache_entry_free (gpointer data)
+{
+	CertCacheEntry *entry = data;
+
+	g_clear_error (&entry->error);
+	g_slice_free (CertCacheEntry, entry);
+}
+
+static void
+load_ca_cert_thread (GTask *task,
+                     gpointer source_object,
+                     gpointer task_data,
+                     GCancellable *cancellable)
+{
+	const char *uri = task_data;
+	g_autoptr(GFile) file = g_file_new_for_uri (uri);
+	g_autoptr(GFileInfo) info = NULL;
+	g_autofree char *path = NULL;
+	CertCacheEntry key = { 0, };
+	CertCacheEntry *entry;
+	GList *certs;
+	GError *error = NULL;
+	gint n_certs = -1;
+
+	info = g_file_query_info (file,
+	                          G_FILE_ATTRIBUTE_UNIX_DEVICE ","
+	                          G_FILE_ATTRIBUTE_UNIX_INODE ","
+	                          G_FILE_ATTRIBUTE_TIME_MODIFIED ","
+	                          G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC,
+	                          G_FILE_QUERY_INFO_NONE, cancellable, &error);
+	if (!info) {
+		g_task_return_error (task, error);
+		return;
+	}
+
+	key.device = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+	key.inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+	key.mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	key.mtime_usec = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+
+	G_LOCK (cert_cache);
+	entry = cert_cache ? g_hash_table_lookup (cert_cache, uri) : NULL;
+	if (   entry
+	    && entry->device == key.device
+	    && entry->inode == key.inode
+	    && entry->mtime == key.mtime
+	    && entry->mtime_usec == key.mtime_usec) {
+		n_certs = entry->n_certs;
+		if (entry->error)
+			error = g_error_copy (entry->error);
+	}
+	G_UNLOCK (cert_cache);
+
+	if (n_certs == -1 && !error) {
+		path = g_file_get_path (file);
+		certs = g_tls_certificate_list_new_from_file (path, &error);
+		n_certs = g_list_length (certs);
+		g_list_free_full (certs, g_object_unref);
+		if (!error && n_certs == 0)
+			error = g_error_new_literal (G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "No certificates found");
+
+		entry = g_slice_dup (CertCacheEntry, &key);
+		entry->n_certs = n_certs;
+		entry->error = error ? g_error_copy (error) : NULL;
+
+		G_LOCK (cert_cache);
+		if (!cert_cache) {
+			cert_cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+			                                    g_free, cert_cache_entry_free);
+		}
+		g_hash_table_replace (cert_cache, g_strdup (uri), entry);
+		G_UNLOCK (cert_cache);
+	}
+
+	if (error)
+		g_task_return_error (task, error);
+	else
+		g_task_return_int (task, n_certs);
+}
+
+static void
+set_ca_cert_status (NMNovpnEditor *self, const char *status)
+{
+	gtk_label_set_text (self->ca_cert_status, status ? status : "");
+	gtk_widget_set_visible (GTK_WIDGET (self->ca_cert_status), status != NULL);
+}
+
+static void
+load_ca_cert_done (GObject *source_object,
+                   GAsyncResult *result,
+                   gpointer user_data)
+{
+	NMNovpnEditor *self = NM_NOVPN_EDITOR (source_object);
+	g_autoptr(GError) error = NULL;
+	g_autofree char *status = NULL;
+	gssize n_certs;
+
+	n_certs = g_task_propagate_int (G_TASK (result), &error);
+	if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+		return;
+
+	g_clear_object (&self->ca_cert_cancellable);
+
+	if (error) {
+		status = g_strdup_printf ("Could not load the CA certificate: %s", error->message);
+	} else {
+		status = g_strdup_printf (n_certs == 1 ? "%" G_GSSIZE_FORMAT " certificate"
+		                                       : "%" G_GSSIZE_FORMAT " certificates",
+		                          n_certs);
+	}
+	set_ca_cert_status (self, status);
+}
+
+static void
+load_ca_cert (NMNovpnEditor *self)
+{
+	g_autofree gchar *uri = nma_cert_chooser_get_cert_uri (self->ca_cert_chooser);
+	g_autoptr(GTask) task = NULL;
+
+	if (self->ca_cert_cancellable) {
+		g_cancellable_cancel (self->ca_cert_cancellable);
+		g_clear_object (&self->ca_cert_cancellable);
+	}
+
+	/* PKCS#11 URIs and the like are not ours to look into. */
+	if (!uri || !g_str_has_prefix (uri, "file://")) {
+		set_ca_cert_status (self, NULL);
+		return;
+	}
+
+	set_ca_cert_status (self, "Loading certificate…");
+
+	self->ca_cert_cancellable = g_cancellable_new ();
+	task = g_task_new (self, self->ca_cert_cancellable, load_ca_cert_done, NULL);
+	g_task_set_task_data (task, g_strdup (uri), g_free);
+	g_task_run_in_thread (task, load_ca_cert_thread);
+}
+
+static gboolean
+emit_changed (gpointer user_data)
+{
+	NMNovpnEditor *self = NM_NOVPN_EDITOR (user_data);
+
+	self->changed_id = 0;
+	g_signal_emit_by_name (self, "changed");
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+mark_dirty (NMNovpnEditor *self, DirtyFlags flags)
+{
+	self->dirty |= flags;
+
+	if (self->changed_id)
+		g_source_remove (self->changed_id);
+	self->changed_id = g_timeout_add (CHANGED_DEBOUNCE_MS, emit_changed, self);
+}
+
+static void
+gateway_changed (GtkEditable *editable, gpointer user_data)
+{
+	mark_dirty (NM_NOVPN_EDITOR (user_data), DIRTY_GATEWAY);
+}
+
+static void
+username_changed (GtkEditable *editable, gpointer user_data)
+{
+	mark_dirty (NM_NOVPN_EDITOR (user_data), DIRTY_USERNAME);
+}
+
+/* Also emitted by libnma when the secret flags menu is used. */
+static void
+password_changed (GtkEditable *editable, gpointer user_data)
+{
+	mark_dirty (NM_NOVPN_EDITOR (user_data), DIRTY_PASSWORD);
+}
+
+static void
+ca_cert_changed (NMACertChooser *cert_chooser, gpointer user_data)
+{
+	NMNovpnEditor *self = NM_NOVPN_EDITOR (user_data);
+
+	mark_dirty (self, DIRTY_CA_CERT);
+	load_ca_cert (self);
+}
+
+/* The certificate chooser drags in the file chooser machinery and most
+ * users never touch it. It's only built once the expander is opened or
+ * when there's a certificate to show. */
+static void
+create_ca_cert_chooser (NMNovpnEditor *self)
+{
+	GtkWidget *chooser;
+
+	chooser = nma_cert_chooser_new ("CA", NMA_CERT_CHOOSER_FLAG_CERT | NMA_CERT_CHOOSER_FLAG_PEM);
+	self->ca_cert_chooser = NMA_CERT_CHOOSER (chooser);
+	nma_cert_chooser_add_to_size_group (self->ca_cert_chooser, self->labels);
+
+#if GTK_CHECK_VERSION(3,96,0)
+	gtk_box_prepend (self->ca_cert_box, chooser);
+#else
+	gtk_box_pack_start (self->ca_cert_box, chooser, FALSE, TRUE, 0);
+	gtk_box_reorder_child (self->ca_cert_box, chooser, 0);
+	gtk_widget_show (chooser);
+#endif
+}
+
+static void
+ca_cert_expanded (GObject *object, GParamSpec *pspec, gpointer user_data)
+{
+	NMNovpnEditor *self = NM_NOVPN_EDITOR (user_data);
+
+	if (self->ca_cert_chooser || !gtk_expander_get_expanded (self->ca_cert_expander))
+		return;
+
+	create_ca_cert_chooser (self);
+	g_signal_connect (self->ca_cert_chooser, "changed", G_CALLBACK (ca_cert_changed), self);
+}
+
+static void
+patch_data_item (NMSettingVpn *setting, const char *key, const char *value)
+{
+	if (value && value[0] != '\0')
+		nm_setting_vpn_add_data_item (setting, key, value);
+	else
+		nm_setting_vpn_remove_data_item (setting, key);
+}
+
 static gboolean
 update_connection (NMVpnEditor *editor,
                    NMConnection *connection,
                    GError **error)
 {
 	NMNovpnEditor *self = NM_NOVPN_EDITOR (editor);
-	NMSetting *setting;
-	const gchar *gateway;
-	const gchar *username;
-	const gchar *password;
-	g_autofree gchar *ca_cert_chooser = NULL;
-	NMSettingSecretFlags password_flags = NM_SETTING_SECRET_FLAG_NONE;
+	NMSettingVpn *setting;
+	DirtyFlags dirty = self->dirty;
+	gint64 start = g_get_monotonic_time ();
 
-	gateway = gtk_editable_get_text (self->gateway_entry);
-	username = gtk_editable_get_text (self->username_entry);
-	password = gtk_editable_get_text (self->password_entry);
-	password_flags = nma_utils_menu_to_secret_flags (GTK_WIDGET (self->password_entry));
-	ca_cert_chooser = nma_cert_chooser_get_cert_uri (self->ca_cert_chooser);
+	setting = nm_connection_get_setting_vpn (connection);
+	if (!setting) {
+		setting = NM_SETTING_VPN (g_object_new (NM_TYPE_SETTING_VPN,
+		                                        "service-type", "org.freedesktop.NetworkManager.Novpn",
+		                                        NULL));
+		nm_connection_add_setting (connection, NM_SETTING (setting));
+	}
 
-	setting = g_object_new (NM_TYPE_SETTING_VPN,
-                                "service-type", "org.freedesktop.NetworkManager.Novpn",
-                                NULL);
+	/* Only what was edited since the last sync needs to be written,
+	 * unless we're looking at a setting we haven't written before. */
+	if (setting != self->setting)
+		dirty = DIRTY_ALL;
 
-	if (gateway && gateway[0] != '\0')
-		nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "gateway", gateway);
-	if (username && username[0] != '\0')
-		nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "username", username);
-	if (password && password[0] != '\0')
-		nm_setting_vpn_add_secret (NM_SETTING_VPN (setting), "password", password);
-	if (!nm_setting_set_secret_flags (setting, "password", password_flags, error))
-		return FALSE;
-	if (ca_cert_chooser && ca_cert_chooser[0] != '\0')
-		nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "ca-cert", ca_cert_chooser);
+	if (dirty & DIRTY_GATEWAY)
+		patch_data_item (setting, "gateway", gtk_editable_get_text (self->gateway_entry));
+
+	if (dirty & DIRTY_USERNAME)
+		patch_data_item (setting, "username", gtk_editable_get_text (self->username_entry));
+
+	if (dirty & DIRTY_PASSWORD) {
+		const gchar *password = gtk_editable_get_text (self->password_entry);
+		NMSettingSecretFlags password_flags;
+
+		password_flags = nma_utils_menu_to_secret_flags (GTK_WIDGET (self->password_entry));
+		if (password && password[0] != '\0')
+			nm_setting_vpn_add_secret (setting, "password", password);
+		else
+			nm_setting_vpn_remove_secret (setting, "password");
+		if (!nm_setting_set_secret_flags (NM_SETTING (setting), "password", password_flags, error))
+			return FALSE;
+	}
+
+	if (dirty & DIRTY_CA_CERT) {
+		g_autofree gchar *ca_cert = NULL;
+
+		if (self->ca_cert_chooser)
+			ca_cert = nma_cert_chooser_get_cert_uri (self->ca_cert_chooser);
+
+		patch_data_item (setting, "ca-cert", ca_cert);
+	}
+
+	if (self->setting != setting) {
+		g_clear_object (&self->setting);
+		self->setting = g_object_ref (setting);
+	}
+	self->dirty = 0;
+
+	NOVPN_PROBE3 (update_connection, nm_connection_get_uuid (connection),
+	              dirty, g_get_monotonic_time () - start);
 
-        nm_connection_add_setting (connection, setting);
 	return TRUE;
 }
 
@@ -99,23 +396,47 @@ static void
 nm_novpn_editor_init (NMNovpnEditor *self)
 {
 	gtk_widget_init_template (GTK_WIDGET (self));
-	nma_cert_chooser_add_to_size_group (self->ca_cert_chooser, self->labels);
+}
+
+static void
+dispose (GObject *object)
+{
+	NMNovpnEditor *self = NM_NOVPN_EDITOR (object);
+
+	if (self->changed_id) {
+		g_source_remove (self->changed_id);
+		self->changed_id = 0;
+	}
+	if (self->ca_cert_cancellable) {
+		g_cancellable_cancel (self->ca_cert_cancellable);
+		g_clear_object (&self->ca_cert_cancellable);
+	}
+	g_clear_object (&self->setting);
+
+	G_OBJECT_CLASS (nm_novpn_editor_parent_class)->dispose (object);
 }
 
 static void
 nm_novpn_editor_class_init (NMNovpnEditorClass *klass)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
 	GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (klass);
 
-	g_type_ensure (NMA_TYPE_CERT_CHOOSER);
+	object_class->dispose = dispose;
 
+	/* The resource is stored uncompressed, so this maps the (stripped)
+	 * XML right out of the library without copying it. GTK 3 parses it
+	 * for each instance; GTK 4 precompiles it once, here, on its own,
+	 * which isn't something we could do for it. */
 	gtk_widget_class_set_template_from_resource (widget_class,
 		"/org/freedesktop/NetworkManager/Novpn/nm-novpn.ui");
 
 	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, password_entry);
 	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, username_entry);
 	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, gateway_entry);
-	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, ca_cert_chooser);
+	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, ca_cert_expander);
+	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, ca_cert_box);
+	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, ca_cert_status);
 	gtk_widget_class_bind_template_child (widget_class, NMNovpnEditor, labels);
 }
 
@@ -143,7 +464,6 @@ nm_vpn_editor_factory_novpn (NMVpnEditorPlugin *editor_plugin,
 
 	self = g_object_new (NM_TYPE_NOVPN_EDITOR, NULL);
 	gtk_editable_set_text (self->gateway_entry, "novpn.example.com");
-	nm_connection_dump (connection);
 
 	setting_vpn = nm_connection_get_setting_vpn (connection);
 	if (!setting_vpn) {
@@ -167,8 +487,23 @@ nm_vpn_editor_factory_novpn (NMVpnEditorPlugin *editor_plugin,
 	nma_utils_setup_password_storage (GTK_WIDGET (self->password_entry),
 	                                  password_flags,
 	                                  NULL, NULL, TRUE, FALSE);
-	if (ca_cert && ca_cert[0] != '\0')
+	if (ca_cert && ca_cert[0] != '\0') {
+		create_ca_cert_chooser (self);
 		nma_cert_chooser_set_cert_uri (self->ca_cert_chooser, ca_cert);
+		gtk_expander_set_expanded (self->ca_cert_expander, TRUE);
+		load_ca_cert (self);
+	}
+
+	/* Nothing has been synced yet: the first update_connection() writes
+	 * everything, so that the defaults above make it in. */
+	self->dirty = DIRTY_ALL;
+
+	g_signal_connect (self->gateway_entry, "changed", G_CALLBACK (gateway_changed), self);
+	g_signal_connect (self->username_entry, "changed", G_CALLBACK (username_changed), self);
+	g_signal_connect (self->password_entry, "changed", G_CALLBACK (password_changed), self);
+	g_signal_connect (self->ca_cert_expander, "notify::expanded", G_CALLBACK (ca_cert_expanded), self);
+	if (self->ca_cert_chooser)
+		g_signal_connect (self->ca_cert_chooser, "changed", G_CALLBACK (ca_cert_changed), self);
 
 	return NM_VPN_EDITOR (g_object_ref_sink (self));
 }
@@ -0,0 +1,452 @@
+/*
+ * nm-novpn-gateway - Gateway selection for the NetworkManager mock VPN
+ * service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Picks the fastest of several gateways, each given as host[:port],
+ * optionally prefixed with "udp:". TCP and port 443 are the default. A
+ * TCP gateway is up once the handshake completes, an UDP one once it
+ * answers a datagram with anything at all.
+ *
+ * The gateways are tried in the order given, each a while after the
+ * previous one or as soon as the previous one fails, much like Happy
+ * Eyeballs (RFC 8305) does with addresses. Unlike there, the first one
+ * up doesn't necessarily win: the rest are all started right away then,
+ * and each gets as long as the best round trip so far to beat it. Those
+ * that can't are abandoned. The round trips are taken from the start of
+ * each attempt, name resolution included.
+ */
+
+#include <string.h>
+
+#include "nm-novpn-gateway.h"
+
+#define DEFAULT_PORT 443
+#define UDP_PROBE "NOVPN-PROBE\n"
+
+typedef struct {
+	NovpnGatewayProbe *probe;
+	NovpnGateway gateway;
+	gboolean udp;
+	GSocketConnectable *address;
+	GCancellable *cancellable;
+	GSocketConnection *connection;
+	GSource *reply_source;
+	gint64 started;
+} Attempt;
+
+struct _NovpnGatewayProbe {
+	GSocketClient *tcp_client;
+	GSocketClient *udp_client;
+	Attempt *attempts;
+	guint count;
+	guint next;
+	guint probing;
+	Attempt *best;
+
+	guint stagger_ms;
+	guint stagger_id;
+	guint decide_id;
+	guint timeout_id;
+
+	NovpnGatewayProbeFunc func;
+	gpointer user_data;
+};
+
+static void attempt_done (Attempt *attempt, gboolean up);
+
+/* Splits a "gateway" data item into the gateways. */
+char **
+novpn_gateway_split (const char *gateways)
+{
+	g_auto(GStrv) tokens = g_strsplit_set (gateways ? gateways : "", ", \t", -1);
+	GPtrArray *result = g_ptr_array_new ();
+	int i;
+
+	for (i = 0; tokens[i]; i++) {
+		if (tokens[i][0])
+			g_ptr_array_add (result, g_strdup (tokens[i]));
+	}
+
+	g_ptr_array_add (result, NULL);
+	return (char **) g_ptr_array_free (result, FALSE);
+}
+
+const char *
+novpn_gateway_status_to_string (NovpnGatewayStatus status)
+{
+	switch (status) {
+	case NOVPN_GATEWAY_WAITING:
+		return "waiting";
+	case NOVPN_GATEWAY_PROBING:
+		return "probing";
+	case NOVPN_GATEWAY_UP:
+		return "up";
+	case NOVPN_GATEWAY_FAILED:
+		return "failed";
+	case NOVPN_GATEWAY_SLOWER:
+		return "slower";
+	}
+	g_return_val_if_reached (NULL);
+}
+
+static void
+attempt_cancel (Attempt *attempt, NovpnGatewayStatus status)
+{
+	if (attempt->cancellable) {
+		g_cancellable_cancel (attempt->cancellable);
+		g_clear_object (&attempt->cancellable);
+	}
+
+	if (attempt->reply_source) {
+		g_source_destroy (attempt->reply_source);
+		g_clear_pointer (&attempt->reply_source, g_source_unref);
+	}
+
+	g_clear_object (&attempt->connection);
+
+	if (attempt->gateway.status == NOVPN_GATEWAY_PROBING) {
+		attempt->gateway.status = status;
+		attempt->probe->probing--;
+	}
+}
+
+static void
+clear_timers (NovpnGatewayProbe *probe)
+{
+	if (probe->stagger_id) {
+		g_source_remove (probe->stagger_id);
+		probe->stagger_id = 0;
+	}
+	if (probe->decide_id) {
+		g_source_remove (probe->decide_id);
+		probe->decide_id = 0;
+	}
+	if (probe->timeout_id) {
+		g_source_remove (probe->timeout_id);
+		probe->timeout_id = 0;
+	}
+}
+
+static void
+finish (NovpnGatewayProbe *probe)
+{
+	guint i;
+
+	clear_timers (probe);
+	for (i = 0; i < probe->count; i++) {
+		attempt_cancel (&probe->attempts[i],
+		                probe->best ? NOVPN_GATEWAY_SLOWER : NOVPN_GATEWAY_FAILED);
+	}
+
+	/* May free the probe. */
+	probe->func (probe, probe->user_data);
+}
+
+static gboolean
+udp_reply (GSocket *socket, GIOCondition condition, gpointer user_data)
+{
+	Attempt *attempt = user_data;
+	char buf[64];
+
+	g_clear_pointer (&attempt->reply_source, g_source_unref);
+
+	/* A refused port shows up as an error here. */
+	attempt_done (attempt, g_socket_receive (socket, buf, sizeof (buf), NULL, NULL) >= 0);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+connect_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	Attempt *attempt = user_data;
+	GSocketConnection *connection;
+	GSocket *socket;
+	g_autoptr(GError) error = NULL;
+
+	connection = g_socket_client_connect_finish (G_SOCKET_CLIENT (source_object), result, &error);
+	if (!connection) {
+		/* Then the attempt may well be gone. */
+		if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+			return;
+
+		g_message ("Gateway %s: %s", attempt->gateway.name, error->message);
+		attempt_done (attempt, FALSE);
+		return;
+	}
+
+	if (!attempt->udp) {
+		g_object_unref (connection);
+		attempt_done (attempt, TRUE);
+		return;
+	}
+
+	attempt->connection = connection;
+	socket = g_socket_connection_get_socket (connection);
+	if (g_socket_send (socket, UDP_PROBE, strlen (UDP_PROBE), NULL, &error) < 0) {
+		g_message ("Gateway %s: %s", attempt->gateway.name, error->message);
+		attempt_done (attempt, FALSE);
+		return;
+	}
+
+	attempt->reply_source = g_socket_create_source (socket, G_IO_IN, NULL);
+	g_source_set_callback (attempt->reply_source, (GSourceFunc) udp_reply, attempt, NULL);
+	g_source_attach (attempt->reply_source, NULL);
+}
+
+static void
+start_attempt (NovpnGatewayProbe *probe)
+{
+	Attempt *attempt = &probe->attempts[probe->next++];
+
+	attempt->gateway.status = NOVPN_GATEWAY_PROBING;
+	attempt->started = g_get_monotonic_time ();
+	attempt->cancellable = g_cancellable_new ();
+	probe->probing++;
+
+	g_socket_client_connect_async (attempt->udp ? probe->udp_client : probe->tcp_client,
+	                               attempt->address, attempt->cancellable,
+	                               connect_done, attempt);
+}
+
+static gboolean
+stagger_timeout (gpointer user_data);
+
+/* Starts the next gateway now and the one after that in a while. */
+static void
+start_next (NovpnGatewayProbe *probe)
+{
+	if (probe->stagger_id) {
+		g_source_remove (probe->stagger_id);
+		probe->stagger_id = 0;
+	}
+
+	if (probe->next == probe->count)
+		return;
+
+	start_attempt (probe);
+	if (probe->next < probe->count)
+		probe->stagger_id = g_timeout_add (probe->stagger_ms, stagger_timeout, probe);
+}
+
+static gboolean
+stagger_timeout (gpointer user_data)
+{
+	NovpnGatewayProbe *probe = user_data;
+
+	probe->stagger_id = 0;
+	start_next (probe);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+decide_timeout (gpointer user_data);
+
+/* Done once none of those still being probed can beat the best. */
+static void
+decide (NovpnGatewayProbe *probe)
+{
+	gint64 deadline = 0;
+	gint64 now;
+	guint i;
+
+	if (probe->decide_id) {
+		g_source_remove (probe->decide_id);
+		probe->decide_id = 0;
+	}
+
+	if (!probe->best) {
+		if (probe->probing == 0 && probe->next == probe->count)
+			finish (probe);
+		return;
+	}
+
+	for (i = 0; i < probe->count; i++) {
+		if (probe->attempts[i].gateway.status == NOVPN_GATEWAY_PROBING) {
+			deadline = MAX (deadline, probe->attempts[i].started
+			                          + probe->best->gateway.rtt);
+		}
+	}
+
+	now = g_get_monotonic_time ();
+	if (deadline <= now) {
+		finish (probe);
+		return;
+	}
+
+	probe->decide_id = g_timeout_add ((deadline - now + 999) / 1000, decide_timeout, probe);
+}
+
+static gboolean
+decide_timeout (gpointer user_data)
+{
+	NovpnGatewayProbe *probe = user_data;
+
+	probe->decide_id = 0;
+	decide (probe);
+
+	return G_SOURCE_REMOVE;
+}
+
+static void
+attempt_done (Attempt *attempt, gboolean up)
+{
+	NovpnGatewayProbe *probe = attempt->probe;
+
+	g_clear_object (&attempt->cancellable);
+	g_clear_object (&attempt->connection);
+	probe->probing--;
+
+	if (up) {
+		attempt->gateway.status = NOVPN_GATEWAY_UP;
+		attempt->gateway.rtt = g_get_monotonic_time () - attempt->started;
+		if (!probe->best || attempt->gateway.rtt < probe->best->gateway.rtt)
+			probe->best = attempt;
+
+		/* The rest may still beat it; no point in holding them back. */
+		if (probe->stagger_id) {
+			g_source_remove (probe->stagger_id);
+			probe->stagger_id = 0;
+		}
+		while (probe->next < probe->count)
+			start_attempt (probe);
+	} else {
+		attempt->gateway.status = NOVPN_GATEWAY_FAILED;
+		if (!probe->best)
+			start_next (probe);
+	}
+
+	decide (probe);
+}
+
+static gboolean
+probe_timeout (gpointer user_data)
+{
+	NovpnGatewayProbe *probe = user_data;
+
+	probe->timeout_id = 0;
+	finish (probe);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * Starts probing the gateways. The function is called from the main
+ * loop once there's a winner or there can't be one, and may free the
+ * probe. Freeing it sooner cancels the probing.
+ */
+NovpnGatewayProbe *
+novpn_gateway_probe_new (char **gateways,
+                         guint stagger_ms,
+                         guint timeout_ms,
+                         NovpnGatewayProbeFunc func,
+                         gpointer user_data,
+                         GError **error)
+{
+	NovpnGatewayProbe *probe;
+	Attempt *attempt;
+	const char *host;
+	guint i;
+
+	g_return_val_if_fail (gateways && gateways[0], NULL);
+
+	probe = g_slice_new0 (NovpnGatewayProbe);
+	probe->count = g_strv_length (gateways);
+	probe->attempts = g_new0 (Attempt, probe->count);
+	probe->stagger_ms = stagger_ms;
+	probe->func = func;
+	probe->user_data = user_data;
+
+	for (i = 0; i < probe->count; i++) {
+		attempt = &probe->attempts[i];
+		attempt->probe = probe;
+		attempt->gateway.name = g_strdup (gateways[i]);
+		attempt->gateway.status = NOVPN_GATEWAY_WAITING;
+		attempt->gateway.rtt = -1;
+
+		host = gateways[i];
+		if (g_str_has_prefix (host, "udp:")) {
+			attempt->udp = TRUE;
+			host += strlen ("udp:");
+		} else if (g_str_has_prefix (host, "tcp:")) {
+			host += strlen ("tcp:");
+		}
+
+		attempt->address = g_network_address_parse (host, DEFAULT_PORT, error);
+		if (!attempt->address) {
+			novpn_gateway_probe_free (probe);
+			return NULL;
+		}
+	}
+
+	probe->tcp_client = g_socket_client_new ();
+	probe->udp_client = g_socket_client_new ();
+	g_socket_client_set_socket_type (probe->udp_client, G_SOCKET_TYPE_DATAGRAM);
+	g_socket_client_set_protocol (probe->udp_client, G_SOCKET_PROTOCOL_UDP);
+
+	probe->timeout_id = g_timeout_add (timeout_ms, probe_timeout, probe);
+	start_next (probe);
+
+	return probe;
+}
+
+guint
+novpn_gateway_probe_get_count (NovpnGatewayProbe *probe)
+{
+	return probe->count;
+}
+
+const NovpnGateway *
+novpn_gateway_probe_get (NovpnGatewayProbe *probe, guint i)
+{
+	g_return_val_if_fail (i < probe->count, NULL);
+
+	return &probe->attempts[i].gateway;
+}
+
+/* The one with the shortest round trip, if any is up. */
+const NovpnGateway *
+novpn_gateway_probe_get_best (NovpnGatewayProbe *probe)
+{
+	return probe->best ? &probe->best->gateway : NULL;
+}
+
+void
+novpn_gateway_probe_free (NovpnGatewayProbe *probe)
+{
+	Attempt *attempt;
+	guint i;
+
+	clear_timers (probe);
+
+	for (i = 0; i < probe->count; i++) {
+		attempt = &probe->attempts[i];
+		attempt_cancel (attempt, NOVPN_GATEWAY_FAILED);
+		g_clear_object (&attempt->address);
+		g_free ((char *) attempt->gateway.name);
+	}
+
+	g_clear_object (&probe->tcp_client);
+	g_clear_object (&probe->udp_client);
+	g_free (probe->attempts);
+	g_slice_free (NovpnGatewayProbe, probe);
+}
@@ -0,0 +1,59 @@
+/*
+ * nm-novpn-gateway - Gateway selection for the NetworkManager mock VPN
+ * service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_GATEWAY_H__
+#define __NM_NOVPN_GATEWAY_H__
+
+#include <gio/gio.h>
+
+typedef enum {
+	NOVPN_GATEWAY_WAITING,
+	NOVPN_GATEWAY_PROBING,
+	NOVPN_GATEWAY_UP,
+	NOVPN_GATEWAY_FAILED,
+	NOVPN_GATEWAY_SLOWER,
+} NovpnGatewayStatus;
+
+typedef struct {
+	const char *name;
+	NovpnGatewayStatus status;
+	gint64 rtt;
+} NovpnGateway;
+
+typedef struct _NovpnGatewayProbe NovpnGatewayProbe;
+
+typedef void (*NovpnGatewayProbeFunc) (NovpnGatewayProbe *probe, gpointer user_data);
+
+char **novpn_gateway_split (const char *gateways);
+
+NovpnGatewayProbe *novpn_gateway_probe_new (char **gateways,
+                                            guint stagger_ms,
+                                            guint timeout_ms,
+                                            NovpnGatewayProbeFunc func,
+                                            gpointer user_data,
+                                            GError **error);
+guint novpn_gateway_probe_get_count (NovpnGatewayProbe *probe);
+const NovpnGateway *novpn_gateway_probe_get (NovpnGatewayProbe *probe, guint i);
+const NovpnGateway *novpn_gateway_probe_get_best (NovpnGatewayProbe *probe);
+const char *novpn_gateway_status_to_string (NovpnGatewayStatus status);
+void novpn_gateway_probe_free (NovpnGatewayProbe *probe);
+
+#endif /* __NM_NOVPN_GATEWAY_H__ */
@@ -0,0 +1,559 @@
+/*
+ * nm-novpn-index - Lookup index for directories of exported NetworkManager
+ * mock VPN profiles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Finds profiles in a directory by connection id, UUID or gateway without
+ * opening any of them. A directory is indexed once it has a .novpn-index
+ * file, see novpn_index_build(); from then on, imports and exports of
+ * files in it keep the index up to date.
+ *
+ * The index is in two parts. The base, .novpn-index, is meant to be
+ * mapped and searched in place; all numbers are little endian u32:
+ *
+ *   header    "NMNOVPNI", version, count, string pool offset and length
+ *   tables    for each key: count entries of (key, file name), sorted
+ *             by key, both as offsets into the string pool
+ *   strings   NUL terminated, offset 0 is the empty string
+ *
+ * Changes are appended to the journal, .novpn-index.log, one line of
+ * tab separated, escaped fields each: file name, id, UUID, gateway.
+ * Lines further down replace whatever is known about the file. Once the
+ * journal gets long compared to the base, the two are merged into a new
+ * base. A lookup is a binary search of the base plus a scan of the short
+ * journal.
+ *
+ * Profiles removed from the directory are not noticed; callers should
+ * expect a file name to be gone.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+
+#include "nm-novpn-index.h"
+
+#define INDEX_NAME ".novpn-index"
+#define JOURNAL_NAME ".novpn-index.log"
+#define INDEX_MAGIC "NMNOVPNI"
+#define INDEX_VERSION 1
+
+/* Journal lines tolerated before merging, at least. */
+#define JOURNAL_MIN 1024
+
+typedef struct {
+	char magic[8];
+	guint32 version;
+	guint32 count;
+	guint32 strings;
+	guint32 strings_len;
+} IndexHeader;
+
+typedef struct {
+	guint32 key;
+	guint32 path;
+} IndexEntry;
+
+typedef struct {
+	char *path;
+	char *keys[NOVPN_INDEX_N_KEYS];
+} Record;
+
+struct _NovpnIndex {
+	char *dir;
+	GMappedFile *mapped;
+	const char *strings;
+	gsize strings_len;
+	const IndexEntry *tables[NOVPN_INDEX_N_KEYS];
+	guint count;
+
+	/* Of Record, oldest first. */
+	GPtrArray *journal;
+};
+
+static void
+record_free (gpointer data)
+{
+	Record *record = data;
+	int i;
+
+	g_free (record->path);
+	for (i = 0; i < NOVPN_INDEX_N_KEYS; i++)
+		g_free (record->keys[i]);
+	g_slice_free (Record, record);
+}
+
+static gboolean
+load_journal (GPtrArray *journal, const char *dir, GError **error)
+{
+	g_autofree char *path = g_build_filename (dir, JOURNAL_NAME, NULL);
+	g_autofree char *contents = NULL;
+	g_auto(GStrv) lines = NULL;
+	GError *local = NULL;
+	Record *record;
+	char **fields;
+	int i, j;
+
+	if (!g_file_get_contents (path, &contents, NULL, &local)) {
+		if (g_error_matches (local, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+			g_error_free (local);
+			return TRUE;
+		}
+		g_propagate_error (error, local);
+		return FALSE;
+	}
+
+	lines = g_strsplit (contents, "\n", -1);
+	for (i = 0; lines[i]; i++) {
+		fields = g_strsplit (lines[i], "\t", -1);
+		if (g_strv_length (fields) == NOVPN_INDEX_N_KEYS + 1) {
+			record = g_slice_new (Record);
+			record->path = g_strcompress (fields[0]);
+			for (j = 0; j < NOVPN_INDEX_N_KEYS; j++)
+				record->keys[j] = g_strcompress (fields[j + 1]);
+			g_ptr_array_add (journal, record);
+		}
+		g_strfreev (fields);
+	}
+
+	return TRUE;
+}
+
+static const char *
+index_string (NovpnIndex *index, guint32 offset)
+{
+	offset = GUINT32_FROM_LE (offset);
+	return offset < index->strings_len ? index->strings + offset : "";
+}
+
+/* Opens an indexed directory; fails if it is not indexed. */
+NovpnIndex *
+novpn_index_open (const char *dir, GError **error)
+{
+	g_autofree char *path = g_build_filename (dir, INDEX_NAME, NULL);
+	NovpnIndex *index;
+	const IndexHeader *header;
+	const char *contents;
+	gsize len;
+	gsize tables_len;
+	int i;
+
+	index = g_slice_new0 (NovpnIndex);
+	index->dir = g_strdup (dir);
+	index->journal = g_ptr_array_new_with_free_func (record_free);
+
+	index->mapped = g_mapped_file_new (path, FALSE, error);
+	if (!index->mapped)
+		goto fail;
+
+	contents = g_mapped_file_get_contents (index->mapped);
+	len = g_mapped_file_get_length (index->mapped);
+	header = (const IndexHeader *) contents;
+
+	if (   len < sizeof (IndexHeader)
+	    || memcmp (header->magic, INDEX_MAGIC, sizeof (header->magic)) != 0
+	    || GUINT32_FROM_LE (header->version) != INDEX_VERSION) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s: Not an index", path);
+		goto fail;
+	}
+
+	index->count = GUINT32_FROM_LE (header->count);
+	index->strings_len = GUINT32_FROM_LE (header->strings_len);
+	tables_len = (gsize) index->count * NOVPN_INDEX_N_KEYS * sizeof (IndexEntry);
+	if (   sizeof (IndexHeader) + tables_len > GUINT32_FROM_LE (header->strings)
+	    || GUINT32_FROM_LE (header->strings) + index->strings_len > len
+	    || index->strings_len == 0) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s: Truncated index", path);
+		goto fail;
+	}
+
+	index->strings = contents + GUINT32_FROM_LE (header->strings);
+	if (index->strings[index->strings_len - 1] != '\0') {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s: Corrupt index", path);
+		goto fail;
+	}
+
+	for (i = 0; i < NOVPN_INDEX_N_KEYS; i++) {
+		index->tables[i] = (const IndexEntry *) (contents + sizeof (IndexHeader))
+		                   + (gsize) i * index->count;
+	}
+
+	if (!load_journal (index->journal, dir, error))
+		goto fail;
+
+	return index;
+
+fail:
+	novpn_index_free (index);
+	return NULL;
+}
+
+/*
+ * Returns the paths of all the profiles with the key set to the value,
+ * as far as the index knows, newest changes first.
+ */
+char **
+novpn_index_lookup (NovpnIndex *index, NovpnIndexKey key, const char *value)
+{
+	g_autoptr(GHashTable) superseded = NULL;
+	const IndexEntry *table;
+	GPtrArray *paths;
+	Record *record;
+	const char *path;
+	guint lo, hi, mid;
+	guint i;
+
+	g_return_val_if_fail (key < NOVPN_INDEX_N_KEYS, NULL);
+	g_return_val_if_fail (value && *value, NULL);
+
+	paths = g_ptr_array_new ();
+	superseded = g_hash_table_new (g_str_hash, g_str_equal);
+
+	for (i = index->journal->len; i-- > 0; ) {
+		record = index->journal->pdata[i];
+		if (g_hash_table_contains (superseded, record->path))
+			continue;
+		g_hash_table_add (superseded, record->path);
+
+		if (g_strcmp0 (record->keys[key], value) == 0)
+			g_ptr_array_add (paths, g_build_filename (index->dir, record->path, NULL));
+	}
+
+	/* The first entry not less than the value. */
+	table = index->tables[key];
+	lo = 0;
+	hi = index->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp (index_string (index, table[mid].key), value) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < index->count; i++) {
+		if (strcmp (index_string (index, table[i].key), value) != 0)
+			break;
+
+		path = index_string (index, table[i].path);
+		if (!g_hash_table_contains (superseded, path))
+			g_ptr_array_add (paths, g_build_filename (index->dir, path, NULL));
+	}
+
+	g_ptr_array_add (paths, NULL);
+	return (char **) g_ptr_array_free (paths, FALSE);
+}
+
+guint
+novpn_index_get_count (NovpnIndex *index)
+{
+	return index->count;
+}
+
+void
+novpn_index_free (NovpnIndex *index)
+{
+	g_clear_pointer (&index->mapped, g_mapped_file_unref);
+	g_ptr_array_unref (index->journal);
+	g_free (index->dir);
+	g_slice_free (NovpnIndex, index);
+}
+
+static guint32
+intern (GString *strings, GHashTable *offsets, const char *str)
+{
+	gpointer offset;
+
+	if (!str || !*str)
+		return 0;
+
+	if (g_hash_table_lookup_extended (offsets, str, NULL, &offset))
+		return GPOINTER_TO_UINT (offset);
+
+	offset = GUINT_TO_POINTER (strings->len);
+	g_string_append_len (strings, str, strlen (str) + 1);
+	g_hash_table_insert (offsets, g_strdup (str), offset);
+
+	return GPOINTER_TO_UINT (offset);
+}
+
+static gint
+compare_entries (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+	const IndexEntry *entry_a = a;
+	const IndexEntry *entry_b = b;
+	const char *strings = user_data;
+	int ret;
+
+	ret = strcmp (strings + entry_a->key, strings + entry_b->key);
+	if (ret == 0)
+		ret = strcmp (strings + entry_a->path, strings + entry_b->path);
+
+	return ret;
+}
+
+/* Replaces the base with the records, atomically. */
+static gboolean
+write_base (const char *dir, GPtrArray *records, GError **error)
+{
+	g_autofree char *path = g_build_filename (dir, INDEX_NAME, NULL);
+	g_autoptr(GHashTable) offsets = NULL;
+	g_autoptr(GByteArray) contents = NULL;
+	GString *strings;
+	IndexEntry *tables[NOVPN_INDEX_N_KEYS];
+	IndexHeader header;
+	Record *record;
+	guint i;
+	int k;
+
+	offsets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+	strings = g_string_new (NULL);
+	g_string_append_c (strings, '\0');
+
+	for (k = 0; k < NOVPN_INDEX_N_KEYS; k++) {
+		tables[k] = g_new (IndexEntry, records->len);
+		for (i = 0; i < records->len; i++) {
+			record = records->pdata[i];
+			tables[k][i].key = intern (strings, offsets, record->keys[k]);
+			tables[k][i].path = intern (strings, offsets, record->path);
+		}
+	}
+
+	memcpy (header.magic, INDEX_MAGIC, sizeof (header.magic));
+	header.version = GUINT32_TO_LE (INDEX_VERSION);
+	header.count = GUINT32_TO_LE (records->len);
+	header.strings = GUINT32_TO_LE (sizeof (header) + NOVPN_INDEX_N_KEYS * records->len * sizeof (IndexEntry));
+	header.strings_len = GUINT32_TO_LE (strings->len);
+
+	contents = g_byte_array_new ();
+	g_byte_array_append (contents, (guint8 *) &header, sizeof (header));
+	for (k = 0; k < NOVPN_INDEX_N_KEYS; k++) {
+		g_qsort_with_data (tables[k], records->len, sizeof (IndexEntry), compare_entries, strings->str);
+		for (i = 0; i < records->len; i++) {
+			tables[k][i].key = GUINT32_TO_LE (tables[k][i].key);
+			tables[k][i].path = GUINT32_TO_LE (tables[k][i].path);
+		}
+		g_byte_array_append (contents, (guint8 *) tables[k], records->len * sizeof (IndexEntry));
+		g_free (tables[k]);
+	}
+	g_byte_array_append (contents, (guint8 *) strings->str, strings->len);
+	g_string_free (strings, TRUE);
+
+	return g_file_set_contents (path, (char *) contents->data, contents->len, error);
+}
+
+static Record *
+record_new (const char *path, const char *id, const char *uuid, const char *gateway)
+{
+	Record *record = g_slice_new (Record);
+
+	record->path = g_strdup (path);
+	record->keys[NOVPN_INDEX_ID] = g_strdup (id);
+	record->keys[NOVPN_INDEX_UUID] = g_strdup (uuid);
+	record->keys[NOVPN_INDEX_GATEWAY] = g_strdup (gateway);
+
+	return record;
+}
+
+/* Indexes the profiles in the directory from scratch. */
+gboolean
+novpn_index_build (const char *dir, GError **error)
+{
+	g_autoptr(GPtrArray) records = NULL;
+	g_autofree char *journal_path = g_build_filename (dir, JOURNAL_NAME, NULL);
+	GDir *gdir;
+	const char *name;
+
+	gdir = g_dir_open (dir, 0, error);
+	if (!gdir)
+		return FALSE;
+
+	records = g_ptr_array_new_with_free_func (record_free);
+	while ((name = g_dir_read_name (gdir))) {
+		g_autoptr(GKeyFile) keyfile = g_key_file_new ();
+		g_autofree char *path = g_build_filename (dir, name, NULL);
+		g_autofree char *id = NULL;
+		g_autofree char *uuid = NULL;
+		g_autofree char *gateway = NULL;
+
+		if (name[0] == '.' || !g_file_test (path, G_FILE_TEST_IS_REGULAR))
+			continue;
+		if (!g_key_file_load_from_file (keyfile, path, G_KEY_FILE_NONE, NULL))
+			continue;
+
+		id = g_key_file_get_string (keyfile, "connection", "id", NULL);
+		if (!id)
+			continue;
+		uuid = g_key_file_get_string (keyfile, "connection", "uuid", NULL);
+		gateway = g_key_file_get_string (keyfile, "vpn", "gateway", NULL);
+
+		g_ptr_array_add (records, record_new (name, id, uuid, gateway));
+	}
+	g_dir_close (gdir);
+
+	if (!write_base (dir, records, error))
+		return FALSE;
+
+	if (unlink (journal_path) == -1 && errno != ENOENT) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "%s: %s", journal_path, g_strerror (errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Folds the journal into a new base. Called with the journal locked. */
+static gboolean
+merge_journal (const char *dir, int journal_fd, GError **error)
+{
+	NovpnIndex *index;
+	g_autoptr(GHashTable) by_path = NULL;
+	g_autoptr(GPtrArray) records = NULL;
+	Record *record;
+	const char *path;
+	guint i;
+	int k;
+
+	index = novpn_index_open (dir, error);
+	if (!index)
+		return FALSE;
+
+	by_path = g_hash_table_new (g_str_hash, g_str_equal);
+	records = g_ptr_array_new_with_free_func (record_free);
+
+	for (k = 0; k < NOVPN_INDEX_N_KEYS; k++) {
+		for (i = 0; i < index->count; i++) {
+			path = index_string (index, index->tables[k][i].path);
+			record = g_hash_table_lookup (by_path, path);
+			if (!record) {
+				record = record_new (path, NULL, NULL, NULL);
+				g_ptr_array_add (records, record);
+				g_hash_table_insert (by_path, record->path, record);
+			}
+			g_free (record->keys[k]);
+			record->keys[k] = g_strdup (index_string (index, index->tables[k][i].key));
+		}
+	}
+
+	for (i = 0; i < index->journal->len; i++) {
+		Record *change = index->journal->pdata[i];
+
+		record = g_hash_table_lookup (by_path, change->path);
+		if (!record) {
+			record = record_new (change->path, NULL, NULL, NULL);
+			g_ptr_array_add (records, record);
+			g_hash_table_insert (by_path, record->path, record);
+		}
+		for (k = 0; k < NOVPN_INDEX_N_KEYS; k++) {
+			g_free (record->keys[k]);
+			record->keys[k] = g_strdup (change->keys[k]);
+		}
+	}
+
+	novpn_index_free (index);
+
+	if (!write_base (dir, records, error))
+		return FALSE;
+
+	if (ftruncate (journal_fd, 0) == -1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't truncate the journal: %s", g_strerror (errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Records what the profile file now contains, if its directory is
+ * indexed. Otherwise does nothing.
+ */
+gboolean
+novpn_index_update (const char *file_name,
+                    const char *id,
+                    const char *uuid,
+                    const char *gateway,
+                    GError **error)
+{
+	g_autofree char *dir = g_path_get_dirname (file_name);
+	g_autofree char *name = g_path_get_basename (file_name);
+	g_autofree char *index_path = g_build_filename (dir, INDEX_NAME, NULL);
+	g_autofree char *journal_path = g_build_filename (dir, JOURNAL_NAME, NULL);
+	g_autofree char *escaped_name = g_strescape (name, NULL);
+	g_autofree char *escaped_id = g_strescape (id ? id : "", NULL);
+	g_autofree char *escaped_uuid = g_strescape (uuid ? uuid : "", NULL);
+	g_autofree char *escaped_gateway = g_strescape (gateway ? gateway : "", NULL);
+	g_autofree char *line = NULL;
+	g_autoptr(GMappedFile) base = NULL;
+	struct stat st;
+	guint count = 0;
+	gboolean success = FALSE;
+	int fd;
+
+	if (!g_file_test (index_path, G_FILE_TEST_EXISTS))
+		return TRUE;
+
+	fd = open (journal_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "%s: %s", journal_path, g_strerror (errno));
+		return FALSE;
+	}
+
+	/* Serializes the writers; readers don't care. */
+	if (flock (fd, LOCK_EX) == -1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "%s: %s", journal_path, g_strerror (errno));
+		goto out;
+	}
+
+	line = g_strdup_printf ("%s\t%s\t%s\t%s\n",
+	                        escaped_name, escaped_id, escaped_uuid, escaped_gateway);
+	if (write (fd, line, strlen (line)) != (ssize_t) strlen (line)) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "%s: %s", journal_path, g_strerror (errno));
+		goto out;
+	}
+
+	/* Merge once the journal has about an eighth as many lines as the
+	 * base has profiles, guessing the line count from this one. */
+	base = g_mapped_file_new (index_path, FALSE, NULL);
+	if (base && g_mapped_file_get_length (base) >= sizeof (IndexHeader))
+		count = GUINT32_FROM_LE (((const IndexHeader *) g_mapped_file_get_contents (base))->count);
+
+	if (fstat (fd, &st) == 0 && st.st_size / strlen (line) > MAX (JOURNAL_MIN, count / 8)) {
+		g_clear_pointer (&base, g_mapped_file_unref);
+		if (!merge_journal (dir, fd, error))
+			goto out;
+	}
+
+	success = TRUE;
+out:
+	close (fd);
+	return success;
+}
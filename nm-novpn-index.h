@@ -0,0 +1,48 @@
+/*
+ * nm-novpn-index - Lookup index for directories of exported NetworkManager
+ * mock VPN profiles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_INDEX_H__
+#define __NM_NOVPN_INDEX_H__
+
+#include <glib.h>
+
+typedef enum {
+	NOVPN_INDEX_ID,
+	NOVPN_INDEX_UUID,
+	NOVPN_INDEX_GATEWAY,
+	NOVPN_INDEX_N_KEYS
+} NovpnIndexKey;
+
+typedef struct _NovpnIndex NovpnIndex;
+
+NovpnIndex *novpn_index_open (const char *dir, GError **error);
+char **novpn_index_lookup (NovpnIndex *index, NovpnIndexKey key, const char *value);
+guint novpn_index_get_count (NovpnIndex *index);
+void novpn_index_free (NovpnIndex *index);
+
+gboolean novpn_index_build (const char *dir, GError **error);
+gboolean novpn_index_update (const char *file_name,
+                             const char *id,
+                             const char *uuid,
+                             const char *gateway,
+                             GError **error);
+
+#endif /* __NM_NOVPN_INDEX_H__ */
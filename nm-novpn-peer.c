@@ -0,0 +1,390 @@
+/*
+ * nm-novpn-peer - Peer-to-peer D-Bus transport for the NetworkManager
+ * mock VPN service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * The parent class only ever exports the VPN plugin interface on the
+ * system bus, after requesting the well-known name there. This serves
+ * the same interface on a peer-to-peer connection instead, for load
+ * tests that don't want a message bus daemon in the way: method calls
+ * go to the plugin's class methods and public API, the way the parent
+ * class dispatches them, and the plugin's signals go back out to the
+ * peer.
+ *
+ * The parent class is not initialized in this mode, so it doesn't watch
+ * the peer or time out a connect on its own.
+ */
+
+#include <string.h>
+#include <NetworkManager.h>
+
+#include "nm-novpn-peer.h"
+
+#if !NM_CHECK_VERSION(1,13,0)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (NMConnection, g_object_unref)
+#endif
+
+struct _NovpnPeer {
+	NMVpnServicePlugin *plugin;
+	GDBusConnection *connection;
+	guint registration_id;
+	gulong signal_ids[7];
+};
+
+static const char plugin_introspection_xml[] =
+	"<node>"
+	"  <interface name='" NM_VPN_DBUS_PLUGIN_INTERFACE "'>"
+	"    <method name='Connect'>"
+	"      <arg type='a{sa{sv}}' name='connection' direction='in'/>"
+	"    </method>"
+	"    <method name='ConnectInteractive'>"
+	"      <arg type='a{sa{sv}}' name='connection' direction='in'/>"
+	"      <arg type='a{sv}' name='details' direction='in'/>"
+	"    </method>"
+	"    <method name='NeedSecrets'>"
+	"      <arg type='a{sa{sv}}' name='settings' direction='in'/>"
+	"      <arg type='s' name='setting_name' direction='out'/>"
+	"    </method>"
+	"    <method name='Disconnect'/>"
+	"    <method name='SetConfig'>"
+	"      <arg type='a{sv}' name='config' direction='in'/>"
+	"    </method>"
+	"    <method name='SetIp4Config'>"
+	"      <arg type='a{sv}' name='config' direction='in'/>"
+	"    </method>"
+	"    <method name='SetIp6Config'>"
+	"      <arg type='a{sv}' name='config' direction='in'/>"
+	"    </method>"
+	"    <method name='SetFailure'>"
+	"      <arg type='s' name='reason' direction='in'/>"
+	"    </method>"
+	"    <method name='NewSecrets'>"
+	"      <arg type='a{sa{sv}}' name='connection' direction='in'/>"
+	"    </method>"
+	"    <signal name='StateChanged'>"
+	"      <arg type='u' name='state'/>"
+	"    </signal>"
+	"    <signal name='SecretsRequired'>"
+	"      <arg type='s' name='message'/>"
+	"      <arg type='as' name='secrets'/>"
+	"    </signal>"
+	"    <signal name='Config'>"
+	"      <arg type='a{sv}' name='config'/>"
+	"    </signal>"
+	"    <signal name='Ip4Config'>"
+	"      <arg type='a{sv}' name='ip4config'/>"
+	"    </signal>"
+	"    <signal name='Ip6Config'>"
+	"      <arg type='a{sv}' name='ip6config'/>"
+	"    </signal>"
+	"    <signal name='LoginBanner'>"
+	"      <arg type='s' name='banner'/>"
+	"    </signal>"
+	"    <signal name='Failure'>"
+	"      <arg type='u' name='reason'/>"
+	"    </signal>"
+	"    <property name='State' type='u' access='read'/>"
+	"  </interface>"
+	"</node>";
+
+static NMVpnServiceState
+get_state (NovpnPeer *peer)
+{
+	NMVpnServiceState state;
+
+	g_object_get (peer->plugin, NM_VPN_SERVICE_PLUGIN_STATE, &state, NULL);
+	return state;
+}
+
+static void
+set_state (NovpnPeer *peer, NMVpnServiceState state)
+{
+	g_object_set (peer->plugin, NM_VPN_SERVICE_PLUGIN_STATE, state, NULL);
+}
+
+/* Details are only there for ConnectInteractive, which the parent class
+ * refuses unless the plugin implements it. */
+static gboolean
+plugin_connect (NovpnPeer *peer, GVariant *settings, GVariant *details, GError **error)
+{
+	NMVpnServicePluginClass *klass = NM_VPN_SERVICE_PLUGIN_GET_CLASS (peer->plugin);
+	g_autoptr(NMConnection) connection = NULL;
+	NMVpnServiceState state = get_state (peer);
+	gboolean success;
+
+	if (details && !klass->connect_interactive) {
+		g_set_error_literal (error, NM_VPN_PLUGIN_ERROR, NM_VPN_PLUGIN_ERROR_INTERACTIVE_NOT_SUPPORTED,
+		                     "Plugin does not implement ConnectInteractive()");
+		return FALSE;
+	}
+
+	if (state != NM_VPN_SERVICE_STATE_INIT && state != NM_VPN_SERVICE_STATE_STOPPED) {
+		g_set_error (error, NM_VPN_PLUGIN_ERROR, NM_VPN_PLUGIN_ERROR_WRONG_STATE,
+		             "Could not start connection: wrong plugin state %d", state);
+		return FALSE;
+	}
+
+	connection = nm_simple_connection_new_from_dbus (settings, error);
+	if (!connection)
+		return FALSE;
+
+	if (details)
+		success = klass->connect_interactive (peer->plugin, connection, details, error);
+	else
+		success = klass->connect (peer->plugin, connection, error);
+	if (!success) {
+		set_state (peer, NM_VPN_SERVICE_STATE_STOPPED);
+		return FALSE;
+	}
+
+	/* Unless the connect was quick enough to get to STARTED already. */
+	if (get_state (peer) == state)
+		set_state (peer, NM_VPN_SERVICE_STATE_STARTING);
+
+	return TRUE;
+}
+
+static gboolean
+plugin_need_secrets (NovpnPeer *peer, GVariant *settings, const char **setting_name, GError **error)
+{
+	NMVpnServicePluginClass *klass = NM_VPN_SERVICE_PLUGIN_GET_CLASS (peer->plugin);
+	g_autoptr(NMConnection) connection = NULL;
+
+	*setting_name = "";
+
+	connection = nm_simple_connection_new_from_dbus (settings, error);
+	if (!connection)
+		return FALSE;
+
+	if (!klass->need_secrets (peer->plugin, connection, setting_name, error)) {
+		if (error && *error)
+			return FALSE;
+		*setting_name = "";
+	}
+
+	return TRUE;
+}
+
+static gboolean
+plugin_new_secrets (NovpnPeer *peer, GVariant *settings, GError **error)
+{
+	NMVpnServicePluginClass *klass = NM_VPN_SERVICE_PLUGIN_GET_CLASS (peer->plugin);
+	g_autoptr(NMConnection) connection = NULL;
+
+	if (!klass->new_secrets) {
+		g_set_error_literal (error, NM_VPN_PLUGIN_ERROR, NM_VPN_PLUGIN_ERROR_INTERACTIVE_NOT_SUPPORTED,
+		                     "Could not accept new secrets: not supported");
+		return FALSE;
+	}
+
+	connection = nm_simple_connection_new_from_dbus (settings, error);
+	if (!connection)
+		return FALSE;
+
+	return klass->new_secrets (peer->plugin, connection, error);
+}
+
+static void
+method_call (GDBusConnection *connection,
+             const gchar *sender,
+             const gchar *object_path,
+             const gchar *interface_name,
+             const gchar *method_name,
+             GVariant *parameters,
+             GDBusMethodInvocation *invocation,
+             gpointer user_data)
+{
+	NovpnPeer *peer = user_data;
+	g_autoptr(GVariant) arg = NULL;
+	GError *error = NULL;
+	const char *setting_name;
+
+	if (g_variant_n_children (parameters) > 0)
+		arg = g_variant_get_child_value (parameters, 0);
+
+	if (strcmp (method_name, "Connect") == 0) {
+		if (!plugin_connect (peer, arg, NULL, &error))
+			goto fail;
+	} else if (strcmp (method_name, "ConnectInteractive") == 0) {
+		g_autoptr(GVariant) details = g_variant_get_child_value (parameters, 1);
+
+		if (!plugin_connect (peer, arg, details, &error))
+			goto fail;
+	} else if (strcmp (method_name, "NeedSecrets") == 0) {
+		if (!plugin_need_secrets (peer, arg, &setting_name, &error))
+			goto fail;
+		g_dbus_method_invocation_return_value (invocation,
+		                                       g_variant_new ("(s)", setting_name));
+		return;
+	} else if (strcmp (method_name, "Disconnect") == 0) {
+		if (!nm_vpn_service_plugin_disconnect (peer->plugin, &error))
+			goto fail;
+	} else if (strcmp (method_name, "SetConfig") == 0) {
+		nm_vpn_service_plugin_set_config (peer->plugin, arg);
+	} else if (strcmp (method_name, "SetIp4Config") == 0) {
+		nm_vpn_service_plugin_set_ip4_config (peer->plugin, arg);
+	} else if (strcmp (method_name, "SetIp6Config") == 0) {
+		nm_vpn_service_plugin_set_ip6_config (peer->plugin, arg);
+	} else if (strcmp (method_name, "SetFailure") == 0) {
+		nm_vpn_service_plugin_failure (peer->plugin, NM_VPN_PLUGIN_FAILURE_BAD_IP_CONFIG);
+	} else if (strcmp (method_name, "NewSecrets") == 0) {
+		if (!plugin_new_secrets (peer, arg, &error))
+			goto fail;
+	} else {
+		g_return_if_reached ();
+	}
+
+	g_dbus_method_invocation_return_value (invocation, NULL);
+	return;
+
+fail:
+	g_dbus_method_invocation_take_error (invocation, error);
+}
+
+static GVariant *
+get_property (GDBusConnection *connection,
+              const gchar *sender,
+              const gchar *object_path,
+              const gchar *interface_name,
+              const gchar *property_name,
+              GError **error,
+              gpointer user_data)
+{
+	NovpnPeer *peer = user_data;
+
+	return g_variant_new_uint32 (get_state (peer));
+}
+
+static const GDBusInterfaceVTable plugin_vtable = {
+	.method_call = method_call,
+	.get_property = get_property,
+};
+
+static void
+emit (NovpnPeer *peer, const char *signal_name, GVariant *parameters)
+{
+	g_autoptr(GError) error = NULL;
+
+	if (!g_dbus_connection_emit_signal (peer->connection, NULL,
+	                                    NM_VPN_DBUS_PLUGIN_PATH,
+	                                    NM_VPN_DBUS_PLUGIN_INTERFACE,
+	                                    signal_name, parameters, &error)) {
+		g_message ("Can't emit %s: %s", signal_name, error->message);
+	}
+}
+
+static void
+state_changed (NMVpnServicePlugin *plugin, guint state, gpointer user_data)
+{
+	emit (user_data, "StateChanged", g_variant_new ("(u)", state));
+}
+
+static void
+secrets_required (NMVpnServicePlugin *plugin, const char *message, const char **hints, gpointer user_data)
+{
+	emit (user_data, "SecretsRequired", g_variant_new ("(s^as)", message, hints));
+}
+
+static void
+config (NMVpnServicePlugin *plugin, GVariant *config, gpointer user_data)
+{
+	emit (user_data, "Config", g_variant_new ("(@a{sv})", config));
+}
+
+static void
+ip4_config (NMVpnServicePlugin *plugin, GVariant *config, gpointer user_data)
+{
+	emit (user_data, "Ip4Config", g_variant_new ("(@a{sv})", config));
+}
+
+static void
+ip6_config (NMVpnServicePlugin *plugin, GVariant *config, gpointer user_data)
+{
+	emit (user_data, "Ip6Config", g_variant_new ("(@a{sv})", config));
+}
+
+static void
+login_banner (NMVpnServicePlugin *plugin, const char *banner, gpointer user_data)
+{
+	emit (user_data, "LoginBanner", g_variant_new ("(s)", banner));
+}
+
+static void
+failure (NMVpnServicePlugin *plugin, guint reason, gpointer user_data)
+{
+	emit (user_data, "Failure", g_variant_new ("(u)", reason));
+}
+
+NovpnPeer *
+novpn_peer_new (NMVpnServicePlugin *plugin,
+                GDBusConnection *connection,
+                GError **error)
+{
+	g_autoptr(GDBusNodeInfo) node_info = NULL;
+	NovpnPeer *peer;
+	int i = 0;
+
+	node_info = g_dbus_node_info_new_for_xml (plugin_introspection_xml, error);
+	if (!node_info)
+		return NULL;
+
+	peer = g_slice_new0 (NovpnPeer);
+	peer->plugin = g_object_ref (plugin);
+	peer->connection = g_object_ref (connection);
+
+	peer->registration_id = g_dbus_connection_register_object (connection,
+	                                                           NM_VPN_DBUS_PLUGIN_PATH,
+	                                                           node_info->interfaces[0],
+	                                                           &plugin_vtable,
+	                                                           peer, NULL, error);
+	if (!peer->registration_id) {
+		novpn_peer_free (peer);
+		return NULL;
+	}
+
+	peer->signal_ids[i++] = g_signal_connect (plugin, "state-changed", G_CALLBACK (state_changed), peer);
+	peer->signal_ids[i++] = g_signal_connect (plugin, "secrets-required", G_CALLBACK (secrets_required), peer);
+	peer->signal_ids[i++] = g_signal_connect (plugin, "config", G_CALLBACK (config), peer);
+	peer->signal_ids[i++] = g_signal_connect (plugin, "ip4-config", G_CALLBACK (ip4_config), peer);
+	peer->signal_ids[i++] = g_signal_connect (plugin, "ip6-config", G_CALLBACK (ip6_config), peer);
+	peer->signal_ids[i++] = g_signal_connect (plugin, "login-banner", G_CALLBACK (login_banner), peer);
+	peer->signal_ids[i++] = g_signal_connect (plugin, "failure", G_CALLBACK (failure), peer);
+	g_assert (i == G_N_ELEMENTS (peer->signal_ids));
+
+	return peer;
+}
+
+void
+novpn_peer_free (NovpnPeer *peer)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (peer->signal_ids); i++) {
+		if (peer->signal_ids[i])
+			g_signal_handler_disconnect (peer->plugin, peer->signal_ids[i]);
+	}
+
+	if (peer->registration_id)
+		g_dbus_connection_unregister_object (peer->connection, peer->registration_id);
+
+	g_object_unref (peer->connection);
+	g_object_unref (peer->plugin);
+	g_slice_free (NovpnPeer, peer);
+}
@@ -0,0 +1,34 @@
+/*
+ * nm-novpn-peer - Peer-to-peer D-Bus transport for the NetworkManager
+ * mock VPN service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_PEER_H__
+#define __NM_NOVPN_PEER_H__
+
+#include <NetworkManager.h>
+
+typedef struct _NovpnPeer NovpnPeer;
+
+NovpnPeer *novpn_peer_new (NMVpnServicePlugin *plugin,
+                           GDBusConnection *connection,
+                           GError **error);
+void novpn_peer_free (NovpnPeer *peer);
+
+#endif /* __NM_NOVPN_PEER_H__ */
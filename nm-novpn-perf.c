@@ -0,0 +1,288 @@
+/*
+ * nm-novpn-perf - Hardware performance counters around hot sections
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Counts cycles, instructions, cache misses and context switches in a
+ * few named regions and prints the totals to stderr at exit. Turned on
+ * with NOVPN_PERF=1 in the environment, or novpn_perf_enable() before
+ * the first region. Otherwise a region costs a test of a global.
+ *
+ * The counters are those of the thread that enters a region first;
+ * regions entered on other threads are ignored. Counters that can't be
+ * opened are left out: hardware ones are often missing in virtual
+ * machines, and perf_event_paranoid may only allow counting user space
+ * or nothing at all. Calls and wall clock time are counted regardless.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#include "nm-novpn-perf.h"
+
+#ifndef PERF_FLAG_FD_CLOEXEC
+#define PERF_FLAG_FD_CLOEXEC (1UL << 3)
+#endif
+
+NovpnPerfState novpn_perf_state = NOVPN_PERF_UNKNOWN;
+
+static const char *const region_names[NOVPN_PERF_N_REGIONS] = {
+	[NOVPN_PERF_CONNECT]       = "connect",
+	[NOVPN_PERF_CONFIG]        = "config",
+	[NOVPN_PERF_PROFILE_PARSE] = "profile-parse",
+	[NOVPN_PERF_HELPER_SPAWN]  = "helper-spawn",
+};
+
+static const char *const counter_names[NOVPN_PERF_N_COUNTERS] = {
+	"cycles",
+	"instructions",
+	"cache-misses",
+	"ctx-switches",
+};
+
+typedef struct {
+	guint64 calls;
+	guint64 usec;
+	guint64 counts[NOVPN_PERF_N_COUNTERS];
+} RegionTotals;
+
+static struct {
+	gboolean requested;
+	GThread *thread;
+	int leader;
+	int fds[NOVPN_PERF_N_COUNTERS];
+	/* Where each counter is in a group read, or -1 */
+	int slots[NOVPN_PERF_N_COUNTERS];
+	int n_slots;
+	RegionTotals totals[NOVPN_PERF_N_REGIONS];
+} perf;
+
+/* Needs to be called before the first region is entered. */
+void
+novpn_perf_enable (void)
+{
+	perf.requested = TRUE;
+}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+static const struct {
+	guint32 type;
+	guint64 config;
+} counter_events[NOVPN_PERF_N_COUNTERS] = {
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+	{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+	{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+};
+
+static int
+open_counter (guint i, int group_fd)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset (&attr, 0, sizeof (attr));
+	attr.size = sizeof (attr);
+	attr.type = counter_events[i].type;
+	attr.config = counter_events[i].config;
+	attr.read_format = PERF_FORMAT_GROUP
+	                   | PERF_FORMAT_TOTAL_TIME_ENABLED
+	                   | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fd = syscall (__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+		/* A perf_event_paranoid of 2 still lets us count user space. */
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = syscall (__NR_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	return fd;
+}
+#endif
+
+static void
+open_counters (void)
+{
+	g_autofree char *paranoid = NULL;
+	int first_errno = 0;
+	guint i;
+
+	perf.leader = -1;
+	for (i = 0; i < NOVPN_PERF_N_COUNTERS; i++) {
+		perf.fds[i] = -1;
+		perf.slots[i] = -1;
+	}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+	/* One group, so that a single read gets them all. */
+	for (i = 0; i < NOVPN_PERF_N_COUNTERS; i++) {
+		perf.fds[i] = open_counter (i, perf.leader);
+		if (perf.fds[i] == -1) {
+			if (!first_errno)
+				first_errno = errno;
+			g_printerr ("novpn perf: no %s: %s\n", counter_names[i], g_strerror (errno));
+			continue;
+		}
+		if (perf.leader == -1)
+			perf.leader = perf.fds[i];
+		perf.slots[i] = perf.n_slots++;
+	}
+#else
+	first_errno = ENOSYS;
+#endif
+
+	if (perf.leader != -1)
+		return;
+
+	if (g_file_get_contents ("/proc/sys/kernel/perf_event_paranoid", &paranoid, NULL, NULL)) {
+		g_printerr ("novpn perf: counting calls and time only: %s (perf_event_paranoid is %s)\n",
+		            g_strerror (first_errno), g_strstrip (paranoid));
+	} else {
+		g_printerr ("novpn perf: counting calls and time only: %s\n",
+		            g_strerror (first_errno));
+	}
+}
+
+static void
+read_counters (NovpnPerfSample *sample)
+{
+	guint64 buf[3 + NOVPN_PERF_N_COUNTERS];
+	ssize_t len;
+	guint i;
+
+	memset (sample->counts, 0, sizeof (sample->counts));
+	sample->enabled = sample->running = 0;
+
+	if (perf.leader == -1)
+		return;
+
+	/* The count, time enabled and running, then the values. */
+	len = read (perf.leader, buf, sizeof (buf));
+	if (len < (ssize_t) ((3 + perf.n_slots) * sizeof (guint64)))
+		return;
+
+	sample->enabled = buf[1];
+	sample->running = buf[2];
+	for (i = 0; i < NOVPN_PERF_N_COUNTERS; i++) {
+		if (perf.slots[i] != -1)
+			sample->counts[i] = buf[3 + perf.slots[i]];
+	}
+}
+
+static void
+print_totals (void)
+{
+	RegionTotals *totals;
+	guint64 calls = 0;
+	guint r, i;
+
+	for (r = 0; r < NOVPN_PERF_N_REGIONS; r++)
+		calls += perf.totals[r].calls;
+	if (!calls)
+		return;
+
+	g_printerr ("novpn perf, pid %d:\n%-16s %10s %12s", getpid (), "region", "calls", "usec");
+	for (i = 0; i < NOVPN_PERF_N_COUNTERS; i++)
+		g_printerr (" %14s", counter_names[i]);
+	g_printerr ("\n");
+
+	for (r = 0; r < NOVPN_PERF_N_REGIONS; r++) {
+		totals = &perf.totals[r];
+		if (!totals->calls)
+			continue;
+
+		g_printerr ("%-16s %10" G_GUINT64_FORMAT " %12" G_GUINT64_FORMAT,
+		            region_names[r], totals->calls, totals->usec);
+		for (i = 0; i < NOVPN_PERF_N_COUNTERS; i++) {
+			if (perf.slots[i] == -1)
+				g_printerr (" %14s", "-");
+			else
+				g_printerr (" %14" G_GUINT64_FORMAT, totals->counts[i]);
+		}
+		g_printerr ("\n");
+	}
+}
+
+/* Whether the regions will be counted, before the first one is entered. */
+gboolean
+novpn_perf_is_enabled (void)
+{
+	const char *env = g_getenv ("NOVPN_PERF");
+
+	return perf.requested || (env && *env && strcmp (env, "0") != 0);
+}
+
+static void
+perf_init (void)
+{
+	if (!novpn_perf_is_enabled ()) {
+		novpn_perf_state = NOVPN_PERF_OFF;
+		return;
+	}
+
+	perf.thread = g_thread_self ();
+	open_counters ();
+	atexit (print_totals);
+	novpn_perf_state = NOVPN_PERF_ON;
+}
+
+void
+novpn_perf_begin_real (NovpnPerfSample *sample, NovpnPerfRegion region)
+{
+	static gsize initialized = 0;
+
+	if (g_once_init_enter (&initialized)) {
+		perf_init ();
+		g_once_init_leave (&initialized, 1);
+	}
+
+	if (novpn_perf_state != NOVPN_PERF_ON || g_thread_self () != perf.thread)
+		return;
+
+	sample->region = region;
+	sample->start = g_get_monotonic_time ();
+	read_counters (sample);
+}
+
+void
+novpn_perf_end_real (NovpnPerfSample *sample)
+{
+	RegionTotals *totals = &perf.totals[sample->region];
+	NovpnPerfSample end;
+	double scale = 1.0;
+	guint i;
+
+	read_counters (&end);
+	totals->usec += g_get_monotonic_time () - sample->start;
+	totals->calls++;
+
+	/* Scaled up for the time the counters spent multiplexed out. */
+	if (end.running > sample->running)
+		scale = (double) (end.enabled - sample->enabled) / (end.running - sample->running);
+
+	for (i = 0; i < NOVPN_PERF_N_COUNTERS; i++)
+		totals->counts[i] += (end.counts[i] - sample->counts[i]) * scale;
+}
@@ -0,0 +1,78 @@
+/*
+ * nm-novpn-perf - Hardware performance counters around hot sections
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_PERF_H__
+#define __NM_NOVPN_PERF_H__
+
+#include <glib.h>
+
+typedef enum {
+	NOVPN_PERF_CONNECT,
+	NOVPN_PERF_CONFIG,
+	NOVPN_PERF_PROFILE_PARSE,
+	NOVPN_PERF_HELPER_SPAWN,
+	NOVPN_PERF_N_REGIONS,
+} NovpnPerfRegion;
+
+typedef enum {
+	NOVPN_PERF_UNKNOWN,
+	NOVPN_PERF_OFF,
+	NOVPN_PERF_ON,
+} NovpnPerfState;
+
+#define NOVPN_PERF_N_COUNTERS 4
+
+typedef struct {
+	int region;
+	gint64 start;
+	guint64 enabled;
+	guint64 running;
+	guint64 counts[NOVPN_PERF_N_COUNTERS];
+} NovpnPerfSample;
+
+extern NovpnPerfState novpn_perf_state;
+
+void novpn_perf_enable (void);
+gboolean novpn_perf_is_enabled (void);
+void novpn_perf_begin_real (NovpnPerfSample *sample, NovpnPerfRegion region);
+void novpn_perf_end_real (NovpnPerfSample *sample);
+
+/* Only a test and a store unless enabled. */
+static inline void
+novpn_perf_begin (NovpnPerfSample *sample, NovpnPerfRegion region)
+{
+	sample->region = -1;
+	if (G_UNLIKELY (novpn_perf_state != NOVPN_PERF_OFF))
+		novpn_perf_begin_real (sample, region);
+}
+
+static inline void
+novpn_perf_end (NovpnPerfSample *sample)
+{
+	if (G_UNLIKELY (sample->region >= 0))
+		novpn_perf_end_real (sample);
+}
+
+/* Counts the rest of the enclosing block, whichever way it's left. */
+#define NOVPN_PERF_SCOPE(region) \
+	NovpnPerfSample _novpn_perf_scope __attribute__((cleanup (novpn_perf_end))); \
+	novpn_perf_begin (&_novpn_perf_scope, (region))
+
+#endif /* __NM_NOVPN_PERF_H__ */
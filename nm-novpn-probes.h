@@ -0,0 +1,50 @@
+/*
+ * nm-novpn-probes - USDT static trace points for the NetworkManager
+ * mock VPN service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_PROBES_H__
+#define __NM_NOVPN_PROBES_H__
+
+/*
+ * All probes belong to the "novpn" provider. String arguments are
+ * plain C strings (connection UUIDs, file names) and durations are in
+ * microseconds of CLOCK_MONOTONIC. Without <sys/sdt.h> the probes
+ * compile to nothing; with it an unused probe is a single nop.
+ *
+ * List them with: bpftrace -l 'usdt:/path/to/binary:novpn:*'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define NOVPN_PROBE0(name)                      DTRACE_PROBE (novpn, name)
+#define NOVPN_PROBE1(name, a1)                  DTRACE_PROBE1 (novpn, name, a1)
+#define NOVPN_PROBE2(name, a1, a2)              DTRACE_PROBE2 (novpn, name, a1, a2)
+#define NOVPN_PROBE3(name, a1, a2, a3)          DTRACE_PROBE3 (novpn, name, a1, a2, a3)
+#else
+/* Keep the arguments referenced, so that variables only used for the
+ * probes don't trigger warnings, but never evaluated. */
+#define NOVPN_PROBE0(name)                      do { } while (0)
+#define NOVPN_PROBE1(name, a1)                  do { if (0) { (void) (a1); } } while (0)
+#define NOVPN_PROBE2(name, a1, a2)              do { if (0) { (void) (a1); (void) (a2); } } while (0)
+#define NOVPN_PROBE3(name, a1, a2, a3)          do { if (0) { (void) (a1); (void) (a2); (void) (a3); } } while (0)
+#endif
+
+#endif /* __NM_NOVPN_PROBES_H__ */
@@ -0,0 +1,271 @@
+/*
+ * nm-novpn-secret - Locked memory for secrets in the NetworkManager
+ * mock VPN authentication helpers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * The authentication helpers are short-lived and only ever hold a
+ * handful of secrets, so they all go into one small arena: locked into
+ * memory so that it's never swapped out, kept out of core dumps, and
+ * wiped as a whole when the process exits. Nothing is freed on its own.
+ * Running out of it is fatal, the same as running out of memory.
+ *
+ * Failing to lock the memory (RLIMIT_MEMLOCK) is not fatal; the secrets
+ * are still wiped.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <gio/gio.h>
+
+#include "nm-novpn-secret.h"
+
+#define ARENA_SIZE (16 * 1024)
+
+static struct {
+	guint8 *base;
+	gsize used;
+	gboolean locked;
+} arena;
+
+void
+novpn_secret_wipe (gpointer data, gsize len)
+{
+#ifdef HAVE_EXPLICIT_BZERO
+	explicit_bzero (data, len);
+#else
+	volatile guint8 *p = data;
+
+	while (len--)
+		*p++ = 0;
+#endif
+}
+
+static void
+arena_clear (void)
+{
+	novpn_secret_wipe (arena.base, arena.used);
+	if (arena.locked)
+		munlock (arena.base, ARENA_SIZE);
+	munmap (arena.base, ARENA_SIZE);
+	arena.base = NULL;
+}
+
+void
+novpn_secret_init (void)
+{
+	g_return_if_fail (!arena.base);
+
+	arena.base = mmap (NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+	                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena.base == MAP_FAILED)
+		g_error ("Can't map memory for secrets: %s", g_strerror (errno));
+
+#ifdef MADV_DONTDUMP
+	madvise (arena.base, ARENA_SIZE, MADV_DONTDUMP);
+#endif
+
+	if (mlock (arena.base, ARENA_SIZE) == 0)
+		arena.locked = TRUE;
+	else
+		g_message ("Can't lock memory for secrets: %s", g_strerror (errno));
+
+	atexit (arena_clear);
+}
+
+/* Zero filled, so that anything put in of a known length is terminated. */
+char *
+novpn_secret_alloc (gsize size)
+{
+	char *mem;
+
+	g_return_val_if_fail (arena.base, NULL);
+
+	if (size > ARENA_SIZE - arena.used)
+		g_error ("Out of memory for secrets");
+
+	mem = (char *) arena.base + arena.used;
+	arena.used += size;
+
+	return mem;
+}
+
+char *
+novpn_secret_strndup (const char *str, gsize len)
+{
+	char *copy;
+
+	if (!str)
+		return NULL;
+
+	copy = novpn_secret_alloc (len + 1);
+	memcpy (copy, str, len);
+	return copy;
+}
+
+char *
+novpn_secret_strdup (const char *str)
+{
+	if (!str)
+		return NULL;
+
+	return novpn_secret_strndup (str, strlen (str));
+}
+
+/*
+ * Reads all there is into the arena, without the buffering a GIOChannel
+ * or stdio would do. The result is terminated.
+ */
+char *
+novpn_secret_read (int fd, gsize *length, GError **error)
+{
+	gsize avail = ARENA_SIZE - arena.used;
+	char *buf = (char *) arena.base + arena.used;
+	gsize len = 0;
+	ssize_t ret;
+
+	g_return_val_if_fail (arena.base, NULL);
+
+	while (TRUE) {
+		if (len + 1 >= avail) {
+			novpn_secret_wipe (buf, len);
+			g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NO_SPACE,
+			                     "Too much input");
+			return NULL;
+		}
+
+		ret = read (fd, buf + len, avail - len - 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			novpn_secret_wipe (buf, len);
+			g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			                     g_strerror (errno));
+			return NULL;
+		}
+		if (ret == 0)
+			break;
+		len += ret;
+	}
+
+	arena.used += len + 1;
+	*length = len;
+	return buf;
+}
+
+gboolean
+novpn_secret_write (int fd, const char *data, gsize len, GError **error)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write (fd, data, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			g_set_error_literal (error, G_IO_ERROR, g_io_error_from_errno (errno),
+			                     g_strerror (errno));
+			return FALSE;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	return TRUE;
+}
+
+/* Same escaping as g_key_file_set_string() does. */
+char *
+novpn_secret_keyfile_escape (const char *value)
+{
+	char *escaped = novpn_secret_alloc (strlen (value) * 2 + 1);
+	char *p = escaped;
+
+	if (*value == ' ') {
+		*p++ = '\\';
+		*p++ = 's';
+		value++;
+	}
+
+	for (; *value; value++) {
+		switch (*value) {
+		case '\n':
+			*p++ = '\\';
+			*p++ = 'n';
+			break;
+		case '\t':
+			*p++ = '\\';
+			*p++ = 't';
+			break;
+		case '\r':
+			*p++ = '\\';
+			*p++ = 'r';
+			break;
+		case '\\':
+			*p++ = '\\';
+			*p++ = '\\';
+			break;
+		default:
+			*p++ = *value;
+		}
+	}
+
+	return escaped;
+}
+
+char *
+novpn_secret_keyfile_unescape (const char *value, gsize len)
+{
+	char *unescaped = novpn_secret_alloc (len + 1);
+	char *p = unescaped;
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		if (value[i] != '\\' || i + 1 == len) {
+			*p++ = value[i];
+			continue;
+		}
+
+		switch (value[++i]) {
+		case 's':
+			*p++ = ' ';
+			break;
+		case 'n':
+			*p++ = '\n';
+			break;
+		case 't':
+			*p++ = '\t';
+			break;
+		case 'r':
+			*p++ = '\r';
+			break;
+		case '\\':
+			*p++ = '\\';
+			break;
+		default:
+			*p++ = '\\';
+			*p++ = value[i];
+		}
+	}
+
+	return unescaped;
+}
@@ -0,0 +1,39 @@
+/*
+ * nm-novpn-secret - Locked memory for secrets in the NetworkManager
+ * mock VPN authentication helpers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_SECRET_H__
+#define __NM_NOVPN_SECRET_H__
+
+#include <glib.h>
+
+void novpn_secret_init (void);
+char *novpn_secret_alloc (gsize size);
+char *novpn_secret_strdup (const char *str);
+char *novpn_secret_strndup (const char *str, gsize len);
+void novpn_secret_wipe (gpointer data, gsize len);
+
+char *novpn_secret_read (int fd, gsize *length, GError **error);
+gboolean novpn_secret_write (int fd, const char *data, gsize len, GError **error);
+
+char *novpn_secret_keyfile_escape (const char *value);
+char *novpn_secret_keyfile_unescape (const char *value, gsize len);
+
+#endif /* __NM_NOVPN_SECRET_H__ */
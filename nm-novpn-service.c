@@ -18,13 +18,185 @@
  * (C) Copyright 2018 Lubomir Rintel
  */
 
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <locale.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#ifdef HAVE_MALLINFO2
+#include <malloc.h>
+#endif
+#include <glib-unix.h>
 #include <NetworkManager.h>
 #include <arpa/inet.h>
 
+#include "nm-novpn-clock.h"
+#include "nm-novpn-dns.h"
+#include "nm-novpn-gateway.h"
+#include "nm-novpn-peer.h"
+#include "nm-novpn-perf.h"
+#include "nm-novpn-probes.h"
+#include "nm-novpn-status.h"
+#include "nm-novpn-trace.h"
+#include "nm-novpn-tunnel.h"
+
+typedef enum {
+	CONNECT_STATE_IDLE,
+	CONNECT_STATE_CONNECTING,
+	CONNECT_STATE_CONNECTED,
+	CONNECT_STATE_DISCONNECTING,
+} ConnectState;
+
+/*
+ * Startup is timed in phases, in CLOCK_MONOTONIC microseconds like
+ * g_get_monotonic_time(). The bus is connected to and the name requested
+ * with the main loop already running, hence the order. The timestamps
+ * are reported by GetStats as offsets from the exec.
+ */
+typedef enum {
+	STARTUP_EXEC,
+	STARTUP_LIBS_LOADED,
+	STARTUP_OPTIONS_PARSED,
+	STARTUP_MAIN_LOOP,
+	STARTUP_BUS_CONNECTED,
+	STARTUP_NAME_ACQUIRED,
+	STARTUP_READY,
+	N_STARTUP_PHASES
+} StartupPhase;
+
+static const char *const startup_phase_names[N_STARTUP_PHASES] = {
+	[STARTUP_EXEC] = "exec",
+	[STARTUP_LIBS_LOADED] = "libs-loaded",
+	[STARTUP_OPTIONS_PARSED] = "options-parsed",
+	[STARTUP_MAIN_LOOP] = "main-loop",
+	[STARTUP_BUS_CONNECTED] = "bus-connected",
+	[STARTUP_NAME_ACQUIRED] = "name-acquired",
+	[STARTUP_READY] = "ready",
+};
+
+static gint64 startup_phases[N_STARTUP_PHASES];
+
+static void
+startup_phase (StartupPhase phase)
+{
+	startup_phases[phase] = g_get_monotonic_time ();
+	NOVPN_PROBE1 (startup_phase, phase);
+}
+
+/* Runs once the shared libraries are loaded and initialized, before main(). */
+static void __attribute__((constructor))
+startup_libs_loaded (void)
+{
+	startup_phase (STARTUP_LIBS_LOADED);
+}
+
+/*
+ * The kernel only keeps the process start time in clock ticks since
+ * boot, so this one is good to about 10 ms. CLOCK_BOOTTIME is what it
+ * counts from; the difference to CLOCK_MONOTONIC is time spent suspended,
+ * and that doesn't change while we start up.
+ */
+static void
+startup_exec (void)
+{
+	g_autofree char *contents = NULL;
+	struct timespec boottime;
+	unsigned long long start_ticks;
+	const char *p;
+	gint64 since_exec;
+
+	if (!g_file_get_contents ("/proc/self/stat", &contents, NULL, NULL))
+		return;
+
+	/* The command name may contain anything, skip past it. The start
+	 * time is the 22nd field, the 20th after it. */
+	p = strrchr (contents, ')');
+	if (!p || sscanf (p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d "
+	                         "%*d %*d %*d %*d %llu", &start_ticks) != 1)
+		return;
+
+	if (clock_gettime (CLOCK_BOOTTIME, &boottime) != 0)
+		return;
+
+	since_exec = (gint64) boottime.tv_sec * G_USEC_PER_SEC + boottime.tv_nsec / 1000
+	             - (gint64) start_ticks * G_USEC_PER_SEC / sysconf (_SC_CLK_TCK);
+	startup_phases[STARTUP_EXEC] = g_get_monotonic_time () - MAX (since_exec, 0);
+}
+
+#define NOVPN_STATS_INTERFACE "org.freedesktop.NetworkManager.Novpn.Stats"
+
+/* What we push in the IPv4 config. */
+#define NOVPN_ADDRESS "192.0.2.1"
+#define NOVPN_DOMAIN "example.com"
+
+/* Where the DNS stub listens without a tunnel. */
+#define NOVPN_LOOPBACK_DNS "127.0.78.1"
+
+static const char stats_introspection_xml[] =
+	"<node>"
+	"  <interface name='" NOVPN_STATS_INTERFACE "'>"
+	"    <method name='GetStats'>"
+	"      <arg type='a{sv}' name='stats' direction='out'/>"
+	"    </method>"
+	"  </interface>"
+	"</node>";
+
 struct _NMNovpnPlugin {
         NMVpnServicePlugin parent;
+
+	gint64 started;
+	GDBusConnection *stats_connection;
+	guint stats_id;
+	char *uuid;
+	gboolean debug;
+
+	/* Whatever is pending for the current connection, see cancel_pending() */
+	ConnectState connect_state;
+	guint connect_id;
+
+	GVariant *staged_config;
+	GVariant *staged_ip4_config;
+	GVariant *staged_ip6_config;
+	guint flush_id;
+	guint connect_messages;
+	gsize connect_bytes;
+
+	NovpnTraceReplay *replay;
+	NovpnTunnel *tunnel;
+	NovpnDns *dns;
+
+	/* See status_publish() */
+	NovpnStatus *status;
+	guint status_id;
+	gint64 connect_started;
+	gint64 connected;
+
+	/* See probe_gateways() */
+	NovpnGatewayProbe *gateway_probe;
+	char *gateway;
+	GVariant *gateway_rtt;
+
+	/* Failure injection, see plan_failures() */
+	GRand *rand;
+	gboolean inject_login_failure;
+	gboolean inject_ip_config_timeout;
+	guint drop_ms;
+	guint drop_id;
+
+	/* Bumped as things happen and only ever read as a snapshot,
+	 * so that whoever polls us doesn't get in the way. */
+	volatile gint connects;
+	volatile gint disconnects;
+	volatile gint need_secrets;
+	volatile gint failures;
+	volatile gint config_messages;
+	volatile gsize config_bytes;
+	volatile gint injected;
+	volatile gint cancelled;
+	volatile gint state;
 };
 
 struct _NMNovpnPluginClass {
@@ -39,24 +211,595 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (NMVpnServicePlugin, g_object_unref)
 G_DECLARE_FINAL_TYPE (NMNovpnPlugin, nm_novpn_plugin, NM, NOVPN_PLUGIN, NMVpnServicePlugin)
 G_DEFINE_TYPE (NMNovpnPlugin, nm_novpn_plugin, NM_TYPE_VPN_SERVICE_PLUGIN)
 
+static const char *
+probe_uuid (NMNovpnPlugin *self)
+{
+	return self->uuid ? self->uuid : "";
+}
+
+/*
+ * Configuration is staged and sent in one go, from a single main loop
+ * iteration, in the order NetworkManager expects: the generic config
+ * first, then the IP configs. Staging the same kind twice before a
+ * flush only sends the latest one.
+ */
+
+static void
+push_config (NMNovpnPlugin *self, GVariant *config)
+{
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (self);
+	gint64 start;
+
+	NOVPN_PROBE1 (set_config_start, probe_uuid (self));
+	start = g_get_monotonic_time ();
+	nm_vpn_service_plugin_set_config (plugin, config);
+	NOVPN_PROBE2 (set_config_done, probe_uuid (self), g_get_monotonic_time () - start);
+}
+
+static void
+push_ip4_config (NMNovpnPlugin *self, GVariant *config)
+{
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (self);
+	gint64 start;
+
+	NOVPN_PROBE1 (set_ip4_config_start, probe_uuid (self));
+	start = g_get_monotonic_time ();
+	nm_vpn_service_plugin_set_ip4_config (plugin, config);
+	NOVPN_PROBE2 (set_ip4_config_done, probe_uuid (self), g_get_monotonic_time () - start);
+}
+
+static void
+push_ip6_config (NMNovpnPlugin *self, GVariant *config)
+{
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (self);
+	gint64 start;
+
+	NOVPN_PROBE1 (set_ip6_config_start, probe_uuid (self));
+	start = g_get_monotonic_time ();
+	nm_vpn_service_plugin_set_ip6_config (plugin, config);
+	NOVPN_PROBE2 (set_ip6_config_done, probe_uuid (self), g_get_monotonic_time () - start);
+}
+
+static void
+flush_one (NMNovpnPlugin *self,
+           GVariant **staged,
+           void (*push) (NMNovpnPlugin *self, GVariant *config))
+{
+	gsize size;
+
+	if (!*staged)
+		return;
+
+	size = g_variant_get_size (*staged);
+	push (self, *staged);
+	g_clear_pointer (staged, g_variant_unref);
+
+	self->connect_messages++;
+	self->connect_bytes += size;
+	g_atomic_int_inc (&self->config_messages);
+	g_atomic_pointer_add (&self->config_bytes, size);
+}
+
+static void
+flush_config (NMNovpnPlugin *self)
+{
+	if (self->flush_id) {
+		g_source_remove (self->flush_id);
+		self->flush_id = 0;
+	}
+
+	flush_one (self, &self->staged_config, push_config);
+	flush_one (self, &self->staged_ip4_config, push_ip4_config);
+	flush_one (self, &self->staged_ip6_config, push_ip6_config);
+
+	NOVPN_PROBE3 (config_flush, probe_uuid (self), self->connect_messages, self->connect_bytes);
+	g_message ("Config pushed: %u messages, %" G_GSIZE_FORMAT " bytes since Connect",
+	           self->connect_messages, self->connect_bytes);
+}
+
+static gboolean
+flush_config_idle (gpointer user_data)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+
+	self->flush_id = 0;
+	flush_config (self);
+
+	return G_SOURCE_REMOVE;
+}
+
+/* For a caller that does flush_config() itself when done staging. */
+static void
+stage_config (NMNovpnPlugin *self, GVariant **staged, GVariant *config)
+{
+	if (*staged)
+		g_variant_unref (*staged);
+	*staged = g_variant_ref_sink (config);
+}
+
+/* Flushed once whatever else is pending gets staged too. */
+static void
+stage_config_deferred (NMNovpnPlugin *self, GVariant **staged, GVariant *config)
+{
+	stage_config (self, staged, config);
+
+	if (!self->flush_id)
+		self->flush_id = g_idle_add (flush_config_idle, self);
+}
+
+/*
+ * Failure injection for soak testing NetworkManager's reconnect logic.
+ * Driven by these VPN data items, all optional:
+ *
+ *   inject-connect-failure     probability of Connect failing right away
+ *   inject-login-failure       probability of a login failure after Connect
+ *   inject-ip-config-timeout   probability of never sending the IPv4 config
+ *   inject-drop                probability of the tunnel dropping later on
+ *   inject-drop-after          mean seconds before such a drop (default 60)
+ *
+ * Probabilities are between 0 and 1. The decisions come from a random
+ * generator seeded with --inject-seed, so a run can be repeated exactly.
+ * With --virtual-time, nothing actually waits for the drops to come.
+ */
+
+static double
+get_double_item (NMSettingVpn *setting, const char *key, double def, double min, double max)
+{
+	const char *str = nm_setting_vpn_get_data_item (setting, key);
+	double value;
+	char *end;
+
+	if (!str)
+		return def;
+
+	value = g_ascii_strtod (str, &end);
+	if (*end != '\0' || end == str) {
+		g_message ("Ignoring bad %s value: %s", key, str);
+		return def;
+	}
+
+	return CLAMP (value, min, max);
+}
+
+static gboolean
+roll (NMNovpnPlugin *self, NMSettingVpn *setting, const char *key)
+{
+	double rate = get_double_item (setting, key, 0.0, 0.0, 1.0);
+
+	if (rate == 0.0)
+		return FALSE;
+
+	if (g_rand_double (self->rand) >= rate)
+		return FALSE;
+
+	g_message ("Injecting %s", key);
+	g_atomic_int_inc (&self->injected);
+	return TRUE;
+}
+
+static void
+cancel_drop (NMNovpnPlugin *self)
+{
+	if (self->drop_id) {
+		g_source_remove (self->drop_id);
+		self->drop_id = 0;
+	}
+}
+
+static gboolean
+plan_failures (NMNovpnPlugin *self, NMConnection *connection, GError **error)
+{
+	NMSettingVpn *setting = nm_connection_get_setting_vpn (connection);
+	double drop_after;
+
+	self->inject_login_failure = FALSE;
+	self->inject_ip_config_timeout = FALSE;
+	self->drop_ms = 0;
+
+	if (!setting)
+		return TRUE;
+
+	if (roll (self, setting, "inject-connect-failure")) {
+		g_set_error_literal (error, NM_VPN_PLUGIN_ERROR, NM_VPN_PLUGIN_ERROR_LAUNCH_FAILED,
+		                     "Injected connect failure");
+		return FALSE;
+	}
+
+	self->inject_login_failure = roll (self, setting, "inject-login-failure");
+	self->inject_ip_config_timeout = roll (self, setting, "inject-ip-config-timeout");
+
+	if (roll (self, setting, "inject-drop")) {
+		/* Anywhere between half and one and a half of the mean. */
+		drop_after = get_double_item (setting, "inject-drop-after", 60.0, 0.0, G_MAXUINT / 1500);
+		self->drop_ms = drop_after * g_rand_double_range (self->rand, 500.0, 1500.0);
+	}
+
+	return TRUE;
+}
+
+/*
+ * An emulated link, if the "tun" data item is "yes". The rest is optional:
+ *
+ *   shaper-delay     one way delay in milliseconds
+ *   shaper-jitter    milliseconds of jitter either way
+ *   shaper-loss      percentage of packets lost
+ *   shaper-reorder   percentage of packets that skip the delay
+ *   shaper-rate      rate limit in kbit/s
+ *   shaper-burst     bytes that may go over the rate limit at once
+ *   shaper-limit     packets in flight before the rest is dropped
+ *
+ * Each applies to both directions. See nm-novpn-tunnel.c for what's at
+ * the other end.
+ */
+static gboolean
+start_tunnel (NMNovpnPlugin *self, NMConnection *connection, GError **error)
+{
+	NMSettingVpn *setting = nm_connection_get_setting_vpn (connection);
+	NovpnShaperParams params;
+
+	g_clear_pointer (&self->tunnel, novpn_tunnel_free);
+
+	if (!setting || g_strcmp0 (nm_setting_vpn_get_data_item (setting, "tun"), "yes") != 0)
+		return TRUE;
+
+	params.delay_us = get_double_item (setting, "shaper-delay", 0.0, 0.0, 60000.0) * 1000;
+	params.jitter_us = get_double_item (setting, "shaper-jitter", 0.0, 0.0, 60000.0) * 1000;
+	params.loss = get_double_item (setting, "shaper-loss", 0.0, 0.0, 100.0) / 100;
+	params.reorder = get_double_item (setting, "shaper-reorder", 0.0, 0.0, 100.0) / 100;
+	params.rate = get_double_item (setting, "shaper-rate", 0.0, 0.0, 1e9) * 1000;
+	params.burst = get_double_item (setting, "shaper-burst", 15000.0, 1500.0, 1e9);
+	params.limit = get_double_item (setting, "shaper-limit", 1000.0, 1.0, 1e7);
+
+	self->tunnel = novpn_tunnel_new (&params, g_rand_int (self->rand), error);
+	if (!self->tunnel)
+		return FALSE;
+
+	g_message ("Tunnel on %s", novpn_tunnel_get_name (self->tunnel));
+	return TRUE;
+}
+
+/*
+ * A DNS stub for the pushed domain, if the "dns" data item is "yes",
+ * so that looking up names in there doesn't just time out. Optionally:
+ *
+ *   dns-zone      file with the domain's records, see nm-novpn-dns.c
+ *   dns-forward   server for other names, as address[:port]; they get
+ *                 NXDOMAIN otherwise
+ *   dns-port      port to listen on (default 53)
+ *
+ * It listens on our end of the tunnel, or without one on a loopback
+ * address of its own, clear of local resolvers on 127.0.0.1 and the
+ * like. It's only pushed as the name server on port 53, as that's the
+ * only one NetworkManager would ask; another port is for asking it
+ * directly.
+ */
+static gboolean
+start_dns (NMNovpnPlugin *self, NMConnection *connection, GError **error)
+{
+	NMSettingVpn *setting = nm_connection_get_setting_vpn (connection);
+	NovpnDnsParams params;
+
+	g_clear_pointer (&self->dns, novpn_dns_free);
+
+	if (!setting || g_strcmp0 (nm_setting_vpn_get_data_item (setting, "dns"), "yes") != 0)
+		return TRUE;
+
+	params.address = self->tunnel ? NOVPN_ADDRESS : NOVPN_LOOPBACK_DNS;
+	params.port = get_double_item (setting, "dns-port", 53.0, 0.0, 65535.0);
+	params.domain = NOVPN_DOMAIN;
+	params.zone_file = nm_setting_vpn_get_data_item (setting, "dns-zone");
+	params.forward = nm_setting_vpn_get_data_item (setting, "dns-forward");
+
+	self->dns = novpn_dns_new (&params, error);
+	if (!self->dns)
+		return FALSE;
+
+	g_message ("DNS on %s:%u", params.address, novpn_dns_get_port (self->dns));
+	return TRUE;
+}
+
+static gboolean
+drop_tunnel (gpointer user_data)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+
+	self->drop_id = 0;
+
+	g_message ("Dropping the tunnel");
+	nm_vpn_service_plugin_disconnect (NM_VPN_SERVICE_PLUGIN (self), NULL);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean _connect (gpointer user_data);
+static void set_connect_state (NMNovpnPlugin *self, ConnectState state);
+
+static void
+gateway_probed (NovpnGatewayProbe *probe, gpointer user_data)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+	const NovpnGateway *best = novpn_gateway_probe_get_best (probe);
+	const NovpnGateway *gateway;
+	GVariantBuilder rtt;
+	guint i;
+
+	g_variant_builder_init (&rtt, G_VARIANT_TYPE ("a{sx}"));
+	for (i = 0; i < novpn_gateway_probe_get_count (probe); i++) {
+		gateway = novpn_gateway_probe_get (probe, i);
+		g_message ("Gateway %s: %s", gateway->name,
+		           novpn_gateway_status_to_string (gateway->status));
+		NOVPN_PROBE2 (gateway_probed, gateway->name, gateway->rtt);
+		g_variant_builder_add (&rtt, "{sx}", gateway->name, gateway->rtt);
+	}
+	self->gateway_rtt = g_variant_ref_sink (g_variant_builder_end (&rtt));
+	self->gateway = best ? g_strdup (best->name) : NULL;
+	g_clear_pointer (&self->gateway_probe, novpn_gateway_probe_free);
+
+	if (!self->gateway) {
+		g_message ("No gateway is up");
+		set_connect_state (self, CONNECT_STATE_IDLE);
+		nm_vpn_service_plugin_failure (NM_VPN_SERVICE_PLUGIN (self),
+		                               NM_VPN_PLUGIN_FAILURE_CONNECT_FAILED);
+		return;
+	}
+
+	g_message ("Using gateway %s", self->gateway);
+	self->connect_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, _connect,
+	                                    g_object_ref (self), g_object_unref);
+}
+
+/*
+ * With more than one gateway in the "gateway" data item, separated by
+ * commas or spaces, the fastest one is picked before connecting. See
+ * nm-novpn-gateway.c for how. Optionally:
+ *
+ *   gateway-probe-stagger   milliseconds between starting probes (default 250)
+ *   gateway-probe-timeout   milliseconds before giving up (default 5000)
+ *
+ * A single gateway is not probed at all.
+ */
+static gboolean
+probe_gateways (NMNovpnPlugin *self, NMConnection *connection, GError **error)
+{
+	NMSettingVpn *setting = nm_connection_get_setting_vpn (connection);
+	g_auto(GStrv) gateways = NULL;
+
+	g_clear_pointer (&self->gateway, g_free);
+	g_clear_pointer (&self->gateway_rtt, g_variant_unref);
+
+	if (!setting)
+		return TRUE;
+
+	gateways = novpn_gateway_split (nm_setting_vpn_get_data_item (setting, "gateway"));
+	if (g_strv_length (gateways) < 2)
+		return TRUE;
+
+	self->gateway_probe = novpn_gateway_probe_new (gateways,
+		get_double_item (setting, "gateway-probe-stagger", 250.0, 0.0, 60000.0),
+		get_double_item (setting, "gateway-probe-timeout", 5000.0, 1.0, 600000.0),
+		gateway_probed, self, error);
+
+	return self->gateway_probe != NULL;
+}
+
+static const char *
+connect_state_to_string (ConnectState state)
+{
+	switch (state) {
+	case CONNECT_STATE_IDLE:
+		return "idle";
+	case CONNECT_STATE_CONNECTING:
+		return "connecting";
+	case CONNECT_STATE_CONNECTED:
+		return "connected";
+	case CONNECT_STATE_DISCONNECTING:
+		return "disconnecting";
+	}
+	g_return_val_if_reached (NULL);
+}
+
+/*
+ * Brings the status page up to date. That's a few stores to memory and
+ * no syscalls, so it's done whenever the state changes. The counters
+ * of the tunnel and DNS threads sit behind their locks, so those are
+ * only picked up by status_refresh().
+ */
+static void
+status_publish (NMNovpnPlugin *self)
+{
+	NovpnStatusData *data;
+	struct in_addr addr = { 0, };
+
+	if (!self->status)
+		return;
+
+	if (self->connect_state == CONNECT_STATE_CONNECTED)
+		inet_pton (AF_INET, NOVPN_ADDRESS, &addr);
+
+	data = novpn_status_begin (self->status);
+	g_strlcpy (data->uuid, probe_uuid (self), sizeof (data->uuid));
+	g_strlcpy (data->gateway, self->gateway ? self->gateway : "", sizeof (data->gateway));
+	g_strlcpy (data->phase, connect_state_to_string (self->connect_state), sizeof (data->phase));
+	data->state = g_atomic_int_get (&self->state);
+	data->address = addr.s_addr;
+	data->connect_started = self->connect_started;
+	data->connected = self->connected;
+	data->connects = g_atomic_int_get (&self->connects);
+	data->disconnects = g_atomic_int_get (&self->disconnects);
+	data->need_secrets = g_atomic_int_get (&self->need_secrets);
+	data->failures = g_atomic_int_get (&self->failures);
+	data->cancelled = g_atomic_int_get (&self->cancelled);
+	data->config_messages = g_atomic_int_get (&self->config_messages);
+	data->config_bytes = (gsize) g_atomic_pointer_get (&self->config_bytes);
+	novpn_status_end (self->status);
+}
+
+static gboolean
+status_refresh (gpointer user_data)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+	NovpnStatusData *data;
+	NovpnShaperStats egress = { 0, }, ingress = { 0, };
+	NovpnDnsStats dns = { 0, };
+
+	if (self->tunnel)
+		novpn_tunnel_get_stats (self->tunnel, &egress, &ingress);
+	if (self->dns)
+		novpn_dns_get_stats (self->dns, &dns);
+
+	data = novpn_status_begin (self->status);
+	data->tunnel_delivered = egress.delivered + ingress.delivered;
+	data->tunnel_lost = egress.lost + ingress.lost;
+	data->dns_queries = dns.queries;
+	data->dns_cache_hits = dns.cache_hits;
+	novpn_status_end (self->status);
+
+	/* Also the counters that don't warrant an update of their own. */
+	status_publish (self);
+
+	return G_SOURCE_CONTINUE;
+}
+
+static void
+set_connect_state (NMNovpnPlugin *self, ConnectState state)
+{
+	if (self->connect_state == state)
+		return;
+
+	g_message ("Connection %s -> %s", connect_state_to_string (self->connect_state),
+	           connect_state_to_string (state));
+	self->connect_state = state;
+
+	if (state == CONNECT_STATE_CONNECTING) {
+		self->connect_started = g_get_monotonic_time ();
+		self->connected = 0;
+	} else if (state == CONNECT_STATE_CONNECTED) {
+		self->connected = g_get_monotonic_time ();
+	}
+	status_publish (self);
+}
+
+/*
+ * Drops whatever was scheduled for the current connection: the gateway
+ * probes, the deferred connect, configuration that's not been sent yet and a planned drop.
+ * Each of those is a single source, so this is cheap no matter how fast
+ * the Connects and Disconnects come in. A connect or configuration that
+ * didn't make it out counts as a cancelled operation; a planned drop
+ * doesn't.
+ */
+static void
+cancel_pending (NMNovpnPlugin *self)
+{
+	gboolean cancelled = FALSE;
+
+	if (self->gateway_probe) {
+		g_clear_pointer (&self->gateway_probe, novpn_gateway_probe_free);
+		cancelled = TRUE;
+	}
+
+	if (self->connect_id) {
+		g_source_remove (self->connect_id);
+		self->connect_id = 0;
+		cancelled = TRUE;
+	}
+
+	if (self->flush_id) {
+		g_source_remove (self->flush_id);
+		self->flush_id = 0;
+		cancelled = TRUE;
+	}
+	g_clear_pointer (&self->staged_config, g_variant_unref);
+	g_clear_pointer (&self->staged_ip4_config, g_variant_unref);
+	g_clear_pointer (&self->staged_ip6_config, g_variant_unref);
+
+	cancel_drop (self);
+
+	if (cancelled) {
+		g_message ("Cancelled pending work for %s", probe_uuid (self));
+		NOVPN_PROBE2 (connect_cancelled, probe_uuid (self), self->connect_state);
+		g_atomic_int_inc (&self->cancelled);
+		status_publish (self);
+	}
+}
+
 static gboolean
 _connect (gpointer user_data)
 {
-	NMVpnServicePlugin *plugin = user_data;
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+	GVariantBuilder builder;
+	GString *banner;
+	GVariantIter iter;
+	const char *name;
+	gint64 rtt;
 	struct in_addr addr;
+	guint32 dns;
+	NOVPN_PERF_SCOPE (NOVPN_PERF_CONFIG);
+
+	self->connect_id = 0;
+	g_return_val_if_fail (self->connect_state == CONNECT_STATE_CONNECTING, G_SOURCE_REMOVE);
+
+	if (self->inject_login_failure) {
+		nm_vpn_service_plugin_failure (NM_VPN_SERVICE_PLUGIN (self),
+		                               NM_VPN_PLUGIN_FAILURE_LOGIN_FAILED);
+		return G_SOURCE_REMOVE;
+	}
 
 	g_message ("Sending Config");
 
-	nm_vpn_service_plugin_set_config (NM_VPN_SERVICE_PLUGIN (plugin),
-		g_variant_new_parsed ("[{'banner', <%s>}, {'has-ip4', <%b>}, {'has-ip6', <%b>}]",
-		                      "Behold, Mock Net Connected!", TRUE, FALSE));
+	banner = g_string_new ("Behold, Mock Net Connected!");
+	if (self->gateway) {
+		g_string_append_printf (banner, "\nvia %s", self->gateway);
+		g_variant_iter_init (&iter, self->gateway_rtt);
+		while (g_variant_iter_next (&iter, "{&sx}", &name, &rtt)) {
+			if (rtt >= 0)
+				g_string_append_printf (banner, "\n  %s: %.1f ms", name, rtt / 1000.0);
+			else
+				g_string_append_printf (banner, "\n  %s: no answer", name);
+		}
+	}
 
-	inet_pton (AF_INET, "192.0.2.1", &addr);
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&builder, "{sv}", "banner",
+	                       g_variant_new_take_string (g_string_free (banner, FALSE)));
+	g_variant_builder_add (&builder, "{sv}", "has-ip4", g_variant_new_boolean (TRUE));
+	g_variant_builder_add (&builder, "{sv}", "has-ip6", g_variant_new_boolean (FALSE));
+	if (self->tunnel) {
+		g_variant_builder_add (&builder, "{sv}", "tundev",
+		                       g_variant_new_string (novpn_tunnel_get_name (self->tunnel)));
+		/* Leaves room for the encapsulation of a real VPN. */
+		g_variant_builder_add (&builder, "{sv}", "mtu", g_variant_new_uint32 (1400));
+	}
+	stage_config (self, &self->staged_config, g_variant_builder_end (&builder));
 
-	nm_vpn_service_plugin_set_ip4_config (NM_VPN_SERVICE_PLUGIN (plugin),
-		g_variant_new_parsed ("[{'address', <%u>}, {'prefix', <%u>},"
-		                      "{'never-default', <%b>}, {'domain', <%s>}]",
-		                      addr.s_addr, 32, TRUE, "example.com"));
+	inet_pton (AF_INET, NOVPN_ADDRESS, &addr);
+
+	/* Leaving out the IPv4 config makes NetworkManager wait for it
+	 * until it times out. */
+	if (!self->inject_ip_config_timeout) {
+		g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+		g_variant_builder_add (&builder, "{sv}", "address",
+		                       g_variant_new_uint32 (addr.s_addr));
+		g_variant_builder_add (&builder, "{sv}", "prefix",
+		                       g_variant_new_uint32 (self->tunnel ? 24 : 32));
+		g_variant_builder_add (&builder, "{sv}", "never-default",
+		                       g_variant_new_boolean (TRUE));
+		g_variant_builder_add (&builder, "{sv}", "domain",
+		                       g_variant_new_string (NOVPN_DOMAIN));
+		if (self->dns && novpn_dns_get_port (self->dns) == 53) {
+			dns = novpn_dns_get_address (self->dns);
+			g_variant_builder_add (&builder, "{sv}", "dns",
+			                       g_variant_new_fixed_array (G_VARIANT_TYPE_UINT32,
+			                                                  &dns, 1, sizeof (dns)));
+		}
+		stage_config (self, &self->staged_ip4_config, g_variant_builder_end (&builder));
+	}
+
+	/* We're in an idle callback already; no point in waiting for another. */
+	flush_config (self);
+	set_connect_state (self, CONNECT_STATE_CONNECTED);
+
+	if (self->drop_ms)
+		self->drop_id = novpn_clock_timeout_add (self->drop_ms, drop_tunnel, self);
 
 	return G_SOURCE_REMOVE;
 }
@@ -66,10 +809,41 @@ real_connect (NMVpnServicePlugin *plugin,
               NMConnection *connection,
               GError **error)
 {
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (plugin);
+	NOVPN_PERF_SCOPE (NOVPN_PERF_CONNECT);
+
 	g_message ("Connect");
-	nm_connection_dump (connection);
+	g_atomic_int_inc (&self->connects);
+	g_free (self->uuid);
+	self->uuid = g_strdup (nm_connection_get_uuid (connection));
+	self->connect_messages = 0;
+	self->connect_bytes = 0;
+	NOVPN_PROBE1 (connect, probe_uuid (self));
+	if (self->debug)
+		nm_connection_dump (connection);
+
+	if (self->replay) {
+		novpn_trace_replay_call (self->replay, "Connect");
+		return TRUE;
+	}
 
-	g_idle_add (_connect, plugin);
+	/* A Connect that's still pending is superseded by this one. */
+	cancel_pending (self);
+	if (   !plan_failures (self, connection, error)
+	    || !start_tunnel (self, connection, error)
+	    || !start_dns (self, connection, error)
+	    || !probe_gateways (self, connection, error)) {
+		set_connect_state (self, CONNECT_STATE_IDLE);
+		return FALSE;
+	}
+
+	set_connect_state (self, CONNECT_STATE_CONNECTING);
+
+	/* Otherwise gateway_probed() takes it from here. */
+	if (!self->gateway_probe) {
+		self->connect_id = g_idle_add_full (G_PRIORITY_DEFAULT_IDLE, _connect,
+		                                    g_object_ref (self), g_object_unref);
+	}
 
 	return TRUE;
 }
@@ -84,8 +858,13 @@ real_need_secrets (NMVpnServicePlugin *plugin,
 	NMSettingSecretFlags flags;
 
 	g_message ("Need Secrets");
+	g_atomic_int_inc (&NM_NOVPN_PLUGIN (plugin)->need_secrets);
+	NOVPN_PROBE1 (need_secrets, nm_connection_get_uuid (connection));
+	if (NM_NOVPN_PLUGIN (plugin)->replay)
+		novpn_trace_replay_call (NM_NOVPN_PLUGIN (plugin)->replay, "NeedSecrets");
 
-	nm_connection_dump (connection);
+	if (NM_NOVPN_PLUGIN (plugin)->debug)
+		nm_connection_dump (connection);
 
 	*setting_name = NM_SETTING_VPN_SETTING_NAME;
 
@@ -105,57 +884,572 @@ static gboolean
 real_disconnect (NMVpnServicePlugin *plugin,
                  GError **error)
 {
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (plugin);
+
 	g_message ("Disconnect");
+	g_atomic_int_inc (&self->disconnects);
+	NOVPN_PROBE1 (disconnect, probe_uuid (self));
+	if (self->replay)
+		novpn_trace_replay_call (self->replay, "Disconnect");
+
+	/* Nothing scheduled for the connection may outlive it. The parent
+	 * class moves on to STOPPED once we return, see plugin_state_changed(). */
+	cancel_pending (self);
+	g_clear_pointer (&self->dns, novpn_dns_free);
+	g_clear_pointer (&self->tunnel, novpn_tunnel_free);
+	set_connect_state (self, CONNECT_STATE_DISCONNECTING);
 	return TRUE;
 }
 
+/*
+ * Replays a signal from a recorded session. Configuration and failures go
+ * through the same paths as if we came up with them ourselves, so that
+ * the parent class keeps track of the state. It also emits StateChanged
+ * on its own; recorded ones are ignored.
+ */
+static void
+replay_signal (GDBusMessage *message, gpointer user_data)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+	NMVpnServicePlugin *plugin = NM_VPN_SERVICE_PLUGIN (self);
+	const char *member = g_dbus_message_get_member (message);
+	GVariant *body = g_dbus_message_get_body (message);
+	g_autoptr(GVariant) arg = NULL;
+	g_autofree const char **hints = NULL;
+	const char *secrets_message;
+
+	g_message ("Replay: %s", member);
+
+	if (!body || g_variant_n_children (body) == 0)
+		return;
+	arg = g_variant_get_child_value (body, 0);
+
+	if (strcmp (member, "Config") == 0) {
+		stage_config_deferred (self, &self->staged_config, arg);
+	} else if (strcmp (member, "Ip4Config") == 0) {
+		stage_config_deferred (self, &self->staged_ip4_config, arg);
+	} else if (strcmp (member, "Ip6Config") == 0) {
+		stage_config_deferred (self, &self->staged_ip6_config, arg);
+	} else if (strcmp (member, "Failure") == 0) {
+		nm_vpn_service_plugin_failure (plugin, g_variant_get_uint32 (arg));
+	} else if (strcmp (member, "SecretsRequired") == 0) {
+		g_variant_get (body, "(&s^a&s)", &secrets_message, &hints);
+		nm_vpn_service_plugin_secrets_required (plugin, secrets_message, hints);
+	}
+}
+
 static void
 plugin_state_changed (NMVpnServicePlugin *plugin,
 		      NMVpnServiceState state,
 		      gpointer user_data)
 {
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (plugin);
+
 	g_message ("State Changed: %d", state);
+	NOVPN_PROBE3 (state_change, probe_uuid (self), g_atomic_int_get (&self->state), state);
+	g_atomic_int_set (&self->state, state);
+
+	if (state == NM_VPN_SERVICE_STATE_STOPPED)
+		set_connect_state (self, CONNECT_STATE_IDLE);
+	status_publish (self);
+}
+
+static void
+plugin_failure (NMVpnServicePlugin *plugin,
+                NMVpnPluginFailure reason,
+                gpointer user_data)
+{
+	g_message ("Failure: %d", reason);
+	g_atomic_int_inc (&NM_NOVPN_PLUGIN (plugin)->failures);
+	status_publish (NM_NOVPN_PLUGIN (plugin));
+}
+
+static void
+stats_method_call (GDBusConnection *connection,
+                   const gchar *sender,
+                   const gchar *object_path,
+                   const gchar *interface_name,
+                   const gchar *method_name,
+                   GVariant *parameters,
+                   GDBusMethodInvocation *invocation,
+                   gpointer user_data)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (user_data);
+	GVariantBuilder builder;
+	GVariantBuilder startup;
+	int i;
+
+	g_variant_builder_init (&startup, G_VARIANT_TYPE ("a{st}"));
+	for (i = 0; i < N_STARTUP_PHASES; i++) {
+		if (!startup_phases[i] || !startup_phases[STARTUP_EXEC])
+			continue;
+		g_variant_builder_add (&startup, "{st}", startup_phase_names[i],
+		                       (guint64) (startup_phases[i] - startup_phases[STARTUP_EXEC]));
+	}
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+	g_variant_builder_add (&builder, "{sv}", "connects",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->connects)));
+	g_variant_builder_add (&builder, "{sv}", "disconnects",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->disconnects)));
+	g_variant_builder_add (&builder, "{sv}", "need-secrets",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->need_secrets)));
+	g_variant_builder_add (&builder, "{sv}", "failures",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->failures)));
+	g_variant_builder_add (&builder, "{sv}", "config-messages",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->config_messages)));
+	g_variant_builder_add (&builder, "{sv}", "config-bytes",
+	                       g_variant_new_uint64 ((gsize) g_atomic_pointer_get (&self->config_bytes)));
+	g_variant_builder_add (&builder, "{sv}", "injected-failures",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->injected)));
+	g_variant_builder_add (&builder, "{sv}", "cancelled",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->cancelled)));
+	g_variant_builder_add (&builder, "{sv}", "state",
+	                       g_variant_new_uint32 (g_atomic_int_get (&self->state)));
+	g_variant_builder_add (&builder, "{sv}", "uptime",
+	                       g_variant_new_uint64 (novpn_clock_get_time () - self->started));
+	if (novpn_clock_is_virtual ()) {
+		gint64 elapsed, real_elapsed;
+		guint warps;
+
+		/* The uptime is in virtual time, this is how long it took. */
+		novpn_clock_get_elapsed (&elapsed, &real_elapsed, &warps);
+		g_variant_builder_add (&builder, "{sv}", "real-uptime",
+		                       g_variant_new_uint64 (real_elapsed));
+		g_variant_builder_add (&builder, "{sv}", "time-warps",
+		                       g_variant_new_uint32 (warps));
+	}
+	g_variant_builder_add (&builder, "{sv}", "startup",
+	                       g_variant_builder_end (&startup));
+	if (self->tunnel) {
+		NovpnShaperStats egress, ingress;
+
+		novpn_tunnel_get_stats (self->tunnel, &egress, &ingress);
+		g_variant_builder_add (&builder, "{sv}", "tunnel-delivered",
+		                       g_variant_new_uint64 (egress.delivered + ingress.delivered));
+		g_variant_builder_add (&builder, "{sv}", "tunnel-lost",
+		                       g_variant_new_uint64 (egress.lost + ingress.lost));
+		g_variant_builder_add (&builder, "{sv}", "tunnel-overlimit",
+		                       g_variant_new_uint64 (egress.overlimit + ingress.overlimit));
+		g_variant_builder_add (&builder, "{sv}", "tunnel-reordered",
+		                       g_variant_new_uint64 (egress.reordered + ingress.reordered));
+	}
+	if (self->dns) {
+		NovpnDnsStats dns;
+
+		novpn_dns_get_stats (self->dns, &dns);
+		g_variant_builder_add (&builder, "{sv}", "dns-queries",
+		                       g_variant_new_uint64 (dns.queries));
+		g_variant_builder_add (&builder, "{sv}", "dns-cache-hits",
+		                       g_variant_new_uint64 (dns.cache_hits));
+		g_variant_builder_add (&builder, "{sv}", "dns-forwarded",
+		                       g_variant_new_uint64 (dns.forwarded));
+		g_variant_builder_add (&builder, "{sv}", "dns-nxdomain",
+		                       g_variant_new_uint64 (dns.nxdomain));
+	}
+	if (self->gateway) {
+		g_variant_builder_add (&builder, "{sv}", "gateway",
+		                       g_variant_new_string (self->gateway));
+	}
+	if (self->gateway_rtt)
+		g_variant_builder_add (&builder, "{sv}", "gateway-rtt", self->gateway_rtt);
+#ifdef HAVE_MALLINFO2
+	{
+		/* Walks the malloc arenas. Cheap enough for polling, but it's
+		 * not free, hence only done here. */
+		struct mallinfo2 info = mallinfo2 ();
+
+		g_variant_builder_add (&builder, "{sv}", "heap-in-use",
+		                       g_variant_new_uint64 (info.uordblks + info.hblkhd));
+		g_variant_builder_add (&builder, "{sv}", "heap-free",
+		                       g_variant_new_uint64 (info.fordblks));
+	}
+#endif
+
+	g_dbus_method_invocation_return_value (invocation,
+	                                       g_variant_new ("(a{sv})", &builder));
+}
+
+static const GDBusInterfaceVTable stats_vtable = {
+	.method_call = stats_method_call,
+};
+
+static gboolean
+stats_register (NMNovpnPlugin *self, GDBusConnection *connection, GError **error)
+{
+	g_autoptr(GDBusNodeInfo) node_info = NULL;
+
+	if (!connection) {
+		g_set_error_literal (error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED,
+		                     "Not connected to D-Bus");
+		return FALSE;
+	}
+
+	node_info = g_dbus_node_info_new_for_xml (stats_introspection_xml, error);
+	if (!node_info)
+		return FALSE;
+
+	self->stats_id = g_dbus_connection_register_object (connection,
+	                                                    NM_VPN_DBUS_PLUGIN_PATH,
+	                                                    node_info->interfaces[0],
+	                                                    &stats_vtable,
+	                                                    self, NULL, error);
+	if (!self->stats_id)
+		return FALSE;
+
+	self->stats_connection = g_object_ref (connection);
+	return TRUE;
 }
 
 static void
 nm_novpn_plugin_init (NMNovpnPlugin *self)
 {
+	self->started = novpn_clock_get_time ();
+	self->state = NM_VPN_SERVICE_STATE_INIT;
+	self->rand = g_rand_new ();
+}
+
+static void
+dispose (GObject *object)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (object);
+
+	if (self->stats_id) {
+		g_dbus_connection_unregister_object (self->stats_connection, self->stats_id);
+		self->stats_id = 0;
+	}
+	g_clear_object (&self->stats_connection);
+
+	cancel_pending (self);
+	if (self->status_id) {
+		g_source_remove (self->status_id);
+		self->status_id = 0;
+	}
+	g_clear_pointer (&self->status, novpn_status_free);
+	g_clear_pointer (&self->dns, novpn_dns_free);
+	g_clear_pointer (&self->tunnel, novpn_tunnel_free);
+	g_clear_pointer (&self->replay, novpn_trace_replay_free);
+
+	G_OBJECT_CLASS (nm_novpn_plugin_parent_class)->dispose (object);
+}
+
+static void
+finalize (GObject *object)
+{
+	NMNovpnPlugin *self = NM_NOVPN_PLUGIN (object);
+
+	g_free (self->uuid);
+	g_free (self->gateway);
+	g_clear_pointer (&self->gateway_rtt, g_variant_unref);
+	g_rand_free (self->rand);
+
+	G_OBJECT_CLASS (nm_novpn_plugin_parent_class)->finalize (object);
 }
 
 static void
 nm_novpn_plugin_class_init (NMNovpnPluginClass *novpn_class)
 {
+	GObjectClass *object_class = G_OBJECT_CLASS (novpn_class);
 	NMVpnServicePluginClass *parent_class = NM_VPN_SERVICE_PLUGIN_CLASS (novpn_class);
 
+	object_class->dispose = dispose;
+	object_class->finalize = finalize;
 	parent_class->connect = real_connect;
 	parent_class->need_secrets = real_need_secrets;
 	parent_class->disconnect = real_disconnect;
 }
 
-NMNovpnPlugin *
+static NMNovpnPlugin *
 nm_novpn_plugin_new (const char *bus_name, gboolean debug)
 {
 	NMNovpnPlugin *self;
-	GError *error = NULL;
 
-	self = (NMNovpnPlugin *) g_initable_new (NM_TYPE_NOVPN_PLUGIN, NULL, &error,
-	                                           NM_VPN_SERVICE_PLUGIN_DBUS_SERVICE_NAME, bus_name,
-	                                           NM_VPN_SERVICE_PLUGIN_DBUS_WATCH_PEER, !debug,
-	                                           NULL);
-	if (!self) {
-		g_message ("Failed to initialize a plugin instance: %s", error->message);
-		g_error_free (error);
-	}
+	self = g_object_new (NM_TYPE_NOVPN_PLUGIN,
+	                     NM_VPN_SERVICE_PLUGIN_DBUS_SERVICE_NAME, bus_name,
+	                     NM_VPN_SERVICE_PLUGIN_DBUS_WATCH_PEER, !debug,
+	                     NULL);
+	self->debug = debug;
 
 	return self;
 }
 
+typedef struct {
+	GMainLoop *main_loop;
+	NMNovpnPlugin *plugin;
+	const char *record;
+	NovpnTraceRecorder *recorder;
+	int ready_fd;
+	int status;
+
+	/* In the peer-to-peer mode, see peer_attach() */
+	const char *peer_address;
+	int peer_fd;
+	GDBusServer *server;
+	NovpnPeer *peer;
+} Startup;
+
+static void
+startup_failed (Startup *startup, const char *what, GError *error)
+{
+	g_printerr ("%s: %s\n", what, error->message);
+	startup->status = EXIT_FAILURE;
+	g_main_loop_quit (startup->main_loop);
+}
+
+/*
+ * Tells whoever passed us --ready-fd that we're on the bus and taking
+ * calls, so that they don't need to poll for the name. Same as s6 and
+ * friends expect: a line of text, then the descriptor is closed.
+ */
+static void
+notify_ready (Startup *startup)
+{
+	static const char ready[] = "READY=1\n";
+
+	if (startup->ready_fd < 0)
+		return;
+
+	if (write (startup->ready_fd, ready, strlen (ready)) < 0)
+		g_message ("Can't notify readiness: %s", g_strerror (errno));
+	close (startup->ready_fd);
+	startup->ready_fd = -1;
+}
+
+static void
+startup_ready (Startup *startup)
+{
+	startup_phase (STARTUP_READY);
+	notify_ready (startup);
+	g_message ("Ready in %" G_GINT64_FORMAT " us since exec",
+	           startup_phases[STARTUP_EXEC] ? startup_phases[STARTUP_READY] - startup_phases[STARTUP_EXEC] : 0);
+}
+
+static gboolean
+start_recording (Startup *startup, GDBusConnection *connection, GError **error)
+{
+	if (!startup->record || startup->recorder)
+		return TRUE;
+
+	startup->recorder = novpn_trace_recorder_new (startup->record, connection, error);
+	return startup->recorder != NULL;
+}
+
+/*
+ * The parent class only does GInitable. That's done here, on the main
+ * thread, rather than through the default GAsyncInitable implementation:
+ * that would run it in a worker thread, which emits state-changed and
+ * would make it a second writer of the status page. With the bus
+ * connected already, what's left to wait for is the name.
+ */
+static void
+plugin_init (Startup *startup)
+{
+	g_autoptr(GError) error = NULL;
+
+	if (!g_initable_init (G_INITABLE (startup->plugin), NULL, &error)) {
+		startup_failed (startup, "Failed to initialize a plugin instance", error);
+		return;
+	}
+	startup_phase (STARTUP_NAME_ACQUIRED);
+
+	if (!stats_register (startup->plugin,
+	                     nm_vpn_service_plugin_get_connection (NM_VPN_SERVICE_PLUGIN (startup->plugin)),
+	                     &error)) {
+		g_message ("Failed to export statistics: %s", error->message);
+		g_clear_error (&error);
+	}
+
+	startup_ready (startup);
+}
+
+/*
+ * The plugin asks for the system bus when it's initialized and gets the
+ * one shared connection, so connecting here first doesn't cost anything
+ * and lets us time it separately from getting the name.
+ */
+static void
+bus_get_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	Startup *startup = user_data;
+	g_autoptr(GDBusConnection) connection = NULL;
+	g_autoptr(GError) error = NULL;
+
+	connection = g_bus_get_finish (result, &error);
+	if (!connection) {
+		startup_failed (startup, "Can't connect to the system bus", error);
+		return;
+	}
+	startup_phase (STARTUP_BUS_CONNECTED);
+
+	/* Before the name is ours, so that the recording misses nothing. */
+	if (!start_recording (startup, connection, &error)) {
+		startup_failed (startup, "Can't record the session", error);
+		return;
+	}
+
+	plugin_init (startup);
+}
+
+/*
+ * The peer-to-peer mode serves a single peer, directly, without a
+ * message bus: either over a socket we're handed (--peer-fd) or the
+ * first one to connect to the address we listen on (--peer). There's no
+ * name to acquire and the parent class is never initialized, see
+ * nm-novpn-peer.c. Once the peer is gone, so are we.
+ */
+static void
+peer_closed (GDBusConnection *connection,
+             gboolean remote_peer_vanished,
+             GError *error,
+             gpointer user_data)
+{
+	Startup *startup = user_data;
+
+	g_message ("The peer went away");
+	g_main_loop_quit (startup->main_loop);
+}
+
+static gboolean
+peer_attach (Startup *startup, GDBusConnection *connection, GError **error)
+{
+	g_autoptr(GError) local = NULL;
+
+	if (!start_recording (startup, connection, error))
+		return FALSE;
+
+	startup->peer = novpn_peer_new (NM_VPN_SERVICE_PLUGIN (startup->plugin), connection, error);
+	if (!startup->peer)
+		return FALSE;
+
+	if (!stats_register (startup->plugin, connection, &local))
+		g_message ("Failed to export statistics: %s", local->message);
+
+	g_signal_connect (connection, "closed", G_CALLBACK (peer_closed), startup);
+	return TRUE;
+}
+
+static void
+peer_connection_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+	Startup *startup = user_data;
+	g_autoptr(GDBusConnection) connection = NULL;
+	g_autoptr(GError) error = NULL;
+
+	connection = g_dbus_connection_new_finish (result, &error);
+	if (!connection) {
+		startup_failed (startup, "Can't talk to the peer", error);
+		return;
+	}
+	startup_phase (STARTUP_BUS_CONNECTED);
+
+	if (!peer_attach (startup, connection, &error)) {
+		startup_failed (startup, "Can't serve the peer", error);
+		return;
+	}
+
+	startup_ready (startup);
+}
+
+static gboolean
+peer_new_connection (GDBusServer *server, GDBusConnection *connection, gpointer user_data)
+{
+	Startup *startup = user_data;
+	g_autoptr(GError) error = NULL;
+
+	if (startup->peer) {
+		g_message ("Refusing another peer");
+		return FALSE;
+	}
+
+	if (!peer_attach (startup, connection, &error)) {
+		startup_failed (startup, "Can't serve the peer", error);
+		return FALSE;
+	}
+
+	g_message ("Serving a peer");
+	return TRUE;
+}
+
+/* Only a peer running as our user gets to drive the plugin. There are
+ * no credentials over TCP, so that's refused too. */
+static gboolean
+peer_authorize (GDBusAuthObserver *observer,
+                GIOStream *stream,
+                GCredentials *credentials,
+                gpointer user_data)
+{
+	if (!credentials || g_credentials_get_unix_user (credentials, NULL) != getuid ()) {
+		g_message ("Refused a peer that's not running as us");
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+peer_start (gpointer user_data)
+{
+	Startup *startup = user_data;
+	g_autoptr(GSocket) socket = NULL;
+	g_autoptr(GSocketConnection) stream = NULL;
+	g_autoptr(GDBusAuthObserver) observer = g_dbus_auth_observer_new ();
+	g_autofree char *guid = g_dbus_generate_guid ();
+	g_autoptr(GError) error = NULL;
+
+	g_signal_connect (observer, "authorize-authenticated-peer", G_CALLBACK (peer_authorize), NULL);
+
+	if (startup->peer_fd >= 0) {
+		socket = g_socket_new_from_fd (startup->peer_fd, &error);
+		if (!socket) {
+			startup_failed (startup, "Can't use the peer socket", error);
+			return G_SOURCE_REMOVE;
+		}
+		startup->peer_fd = -1;
+
+		stream = g_socket_connection_factory_create_connection (socket);
+		g_dbus_connection_new (G_IO_STREAM (stream), guid,
+		                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER,
+		                       observer, NULL, peer_connection_done, startup);
+		return G_SOURCE_REMOVE;
+	}
+
+	startup->server = g_dbus_server_new_sync (startup->peer_address,
+	                                          G_DBUS_SERVER_FLAGS_NONE,
+	                                          guid, observer, NULL, &error);
+	if (!startup->server) {
+		startup_failed (startup, "Can't listen for a peer", error);
+		return G_SOURCE_REMOVE;
+	}
+	g_signal_connect (startup->server, "new-connection", G_CALLBACK (peer_new_connection), startup);
+	g_dbus_server_start (startup->server);
+	startup_phase (STARTUP_BUS_CONNECTED);
+
+	g_message ("Listening on %s", g_dbus_server_get_client_address (startup->server));
+	startup_ready (startup);
+
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean
+main_loop_running (gpointer user_data)
+{
+	startup_phase (STARTUP_MAIN_LOOP);
+	return G_SOURCE_REMOVE;
+}
+
 static void
 quit_mainloop (NMNovpnPlugin *self, gpointer user_data)
 {
 	g_main_loop_quit ((GMainLoop *) user_data);
 }
 
+static gboolean
+quit_on_signal (gpointer user_data)
+{
+	g_main_loop_quit ((GMainLoop *) user_data);
+	return G_SOURCE_REMOVE;
+}
+
 int
 main (int argc, char *argv[])
 {
@@ -165,15 +1459,38 @@ main (int argc, char *argv[])
 	g_autofree char *bus_name = g_strdup ("org.freedesktop.NetworkManager.Novpn");;
 	gboolean persist = FALSE;
 	gboolean debug = FALSE;
+	g_autofree char *record = NULL;
+	g_autofree char *replay = NULL;
+	double replay_speed = 1.0;
+	gint64 inject_seed = -1;
+	gint ready_fd = -1;
+	gboolean virtual_time = FALSE;
+	gboolean perf = FALSE;
+	gboolean status = FALSE;
+	g_autofree char *peer_address = NULL;
+	gint peer_fd = -1;
+	Startup startup = { 0, };
 	g_autoptr(GError) error = NULL;
 
 	GOptionEntry options[] = {
 		{ "bus-name", 0, 0, G_OPTION_ARG_STRING, &bus_name, "D-Bus name to use for this instance", NULL },
 		{ "persist", 0, 0, G_OPTION_ARG_NONE, &persist, "Don’t quit when VPN connection terminates", NULL },
 		{ "debug", 0, 0, G_OPTION_ARG_NONE, &debug, "Enable verbose debug logging (may expose passwords)", NULL },
+		{ "record", 0, 0, G_OPTION_ARG_FILENAME, &record, "Record the D-Bus session to a file (includes passwords)", "FILE" },
+		{ "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay, "Answer calls the way a recorded session did", "FILE" },
+		{ "replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &replay_speed, "Speed up (or slow down) the replay by this factor", "FACTOR" },
+		{ "inject-seed", 0, 0, G_OPTION_ARG_INT64, &inject_seed, "Seed for the failure injection decisions", "SEED" },
+		{ "ready-fd", 0, 0, G_OPTION_ARG_INT, &ready_fd, "Write a line to this descriptor once ready", "FD" },
+		{ "peer", 0, 0, G_OPTION_ARG_STRING, &peer_address, "Serve a peer connecting to this D-Bus address instead of using the bus", "ADDRESS" },
+		{ "peer-fd", 0, 0, G_OPTION_ARG_INT, &peer_fd, "Serve a peer on this connected socket instead of using the bus", "FD" },
+		{ "virtual-time", 0, 0, G_OPTION_ARG_NONE, &virtual_time, "Skip ahead to the next timer whenever idle", NULL },
+		{ "perf", 0, 0, G_OPTION_ARG_NONE, &perf, "Print performance counter totals on exit, same as NOVPN_PERF=1", NULL },
+		{ "status", 0, 0, G_OPTION_ARG_NONE, &status, "Keep a status page in " NOVPN_STATUS_DIR " for novpn-top", NULL },
 		{NULL}
 	};
 
+	startup_exec ();
+
 	/* locale will be set according to environment LC_* variables */
 	setlocale (LC_ALL, "");
 
@@ -190,9 +1507,55 @@ main (int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
-	self = nm_novpn_plugin_new (bus_name, debug);
-	if (!self)
+	if (replay_speed <= 0) {
+		g_printerr ("The replay speed needs to be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	/* GRand takes 32 bits; anything more would be silently cut off. */
+	if (inject_seed < -1 || inject_seed > G_MAXUINT32) {
+		g_printerr ("The failure injection seed needs to be between 0 and %u\n", G_MAXUINT32);
 		return EXIT_FAILURE;
+	}
+
+	if (peer_address && peer_fd >= 0) {
+		g_printerr ("Only one of --peer and --peer-fd can be used\n");
+		return EXIT_FAILURE;
+	}
+	startup_phase (STARTUP_OPTIONS_PARSED);
+
+	if (virtual_time)
+		novpn_clock_set_virtual ();
+	if (perf)
+		novpn_perf_enable ();
+
+	self = nm_novpn_plugin_new (bus_name, debug);
+
+	/* Always seed explicitly, so that any run can be repeated. */
+	if (inject_seed < 0)
+		inject_seed = g_random_int ();
+	g_message ("Failure injection seed: %" G_GINT64_FORMAT, inject_seed);
+	g_rand_set_seed (self->rand, (guint32) inject_seed);
+
+	/* For novpn-top. Nothing else depends on it. */
+	if (status) {
+		self->status = novpn_status_new (bus_name, &error);
+		if (self->status) {
+			status_publish (self);
+			self->status_id = g_timeout_add_seconds (1, status_refresh, self);
+		} else {
+			g_warning ("No status page: %s", error->message);
+			g_clear_error (&error);
+		}
+	}
+
+	if (replay) {
+		self->replay = novpn_trace_replay_new (replay, replay_speed, replay_signal, self, &error);
+		if (!self->replay) {
+			g_printerr ("Can't replay the session: %s\n", error->message);
+			return EXIT_FAILURE;
+		}
+	}
 
 	main_loop = g_main_loop_new (NULL, FALSE);
 
@@ -200,8 +1563,60 @@ main (int argc, char *argv[])
 		g_signal_connect (self, "quit", G_CALLBACK (quit_mainloop), main_loop);
 
 	g_signal_connect (G_OBJECT (self), "state-changed", G_CALLBACK (plugin_state_changed), NULL);
+	g_signal_connect (G_OBJECT (self), "failure", G_CALLBACK (plugin_failure), NULL);
+
+	/* Benchmarks stop us with a signal. Leave through the front door,
+	 * so that the totals get printed and the status page removed. */
+	if (novpn_perf_is_enabled () || self->status) {
+		g_unix_signal_add (SIGTERM, quit_on_signal, main_loop);
+		g_unix_signal_add (SIGINT, quit_on_signal, main_loop);
+	}
+
+	/* Everything else happens with the main loop running. */
+	startup.main_loop = main_loop;
+	startup.plugin = self;
+	startup.record = record;
+	startup.ready_fd = ready_fd;
+	startup.status = EXIT_SUCCESS;
+	startup.peer_address = peer_address;
+	startup.peer_fd = peer_fd;
+
+	g_idle_add_full (G_PRIORITY_HIGH, main_loop_running, NULL, NULL);
+	if (peer_address || peer_fd >= 0)
+		g_idle_add (peer_start, &startup);
+	else
+		g_bus_get (G_BUS_TYPE_SYSTEM, NULL, bus_get_done, &startup);
 
 	g_main_loop_run (main_loop);
 
-	return EXIT_SUCCESS;
+	if (novpn_clock_is_virtual ()) {
+		gint64 elapsed, real_elapsed;
+		guint warps;
+
+		novpn_clock_get_elapsed (&elapsed, &real_elapsed, &warps);
+		g_message ("Virtual time: %.3f s in %.3f s real, %.1fx, %u warps",
+		           elapsed / (double) G_USEC_PER_SEC, real_elapsed / (double) G_USEC_PER_SEC,
+		           elapsed / (double) MAX (real_elapsed, 1), warps);
+	}
+
+	/* Gone now, even if something still holds a reference to us. */
+	if (self->status_id) {
+		g_source_remove (self->status_id);
+		self->status_id = 0;
+	}
+	g_clear_pointer (&self->status, novpn_status_free);
+
+	if (startup.recorder)
+		novpn_trace_recorder_close (startup.recorder);
+	if (startup.ready_fd >= 0)
+		close (startup.ready_fd);
+	if (startup.peer_fd >= 0)
+		close (startup.peer_fd);
+	g_clear_pointer (&startup.peer, novpn_peer_free);
+	if (startup.server) {
+		g_dbus_server_stop (startup.server);
+		g_clear_object (&startup.server);
+	}
+
+	return startup.status;
 }
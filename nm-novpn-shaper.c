@@ -0,0 +1,355 @@
+/*
+ * nm-novpn-shaper - Link emulation for the NetworkManager mock VPN
+ * service tunnel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * A packet scheduler in the spirit of netem. Each packet that isn't lost
+ * gets a departure time when it's queued: the rate limit first, then the
+ * delay and jitter on top. It then waits in a timer wheel slot until that
+ * time comes, so queueing and delivering a packet is constant time no
+ * matter how many are in flight.
+ *
+ * The rate limit is a token bucket, kept as the time at which it would
+ * be full again (GCRA), in nanoseconds so that it holds up with small
+ * packets at multi-gigabit rates.
+ *
+ * The wheel has WHEEL_SLOTS slots of 2^TICK_SHIFT microseconds; packets
+ * further out than a turn of the wheel just stay in their slot for more
+ * turns. A bitmap of the slots in use makes finding the next departure
+ * cheap, so the caller can sleep until then.
+ *
+ * Not thread-safe; a shaper belongs to whoever drives it.
+ */
+
+#include <string.h>
+
+#include "nm-novpn-shaper.h"
+
+#define TICK_SHIFT 5
+#define WHEEL_BITS 12
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_WORDS (WHEEL_SLOTS / 64)
+
+/* Packets kept around for reuse, at most. */
+#define FREE_MAX 256
+
+typedef struct _Packet Packet;
+
+struct _Packet {
+	Packet *next;
+	gint64 due;
+	gsize len;
+	guint8 data[NOVPN_SHAPER_PACKET_MAX];
+};
+
+typedef struct {
+	Packet *head;
+	Packet *tail;
+} Slot;
+
+struct _NovpnShaper {
+	NovpnShaperParams params;
+	GRand *rand;
+	NovpnShaperFunc func;
+	gpointer user_data;
+
+	Slot slots[WHEEL_SLOTS];
+	guint64 occupied[WHEEL_WORDS];
+	gint64 tick;
+	guint queued;
+
+	gint64 tat_ns;
+	gint64 burst_ns;
+
+	Packet *free;
+	guint n_free;
+
+	NovpnShaperStats stats;
+};
+
+NovpnShaper *
+novpn_shaper_new (const NovpnShaperParams *params,
+                  guint32 seed,
+                  NovpnShaperFunc func,
+                  gpointer user_data)
+{
+	NovpnShaper *shaper;
+
+	shaper = g_new0 (NovpnShaper, 1);
+	shaper->params = *params;
+	shaper->rand = g_rand_new_with_seed (seed);
+	shaper->func = func;
+	shaper->user_data = user_data;
+	shaper->tick = -1;
+
+	if (params->rate)
+		shaper->burst_ns = (gint64) params->burst * 8 * G_GINT64_CONSTANT (1000000000) / params->rate;
+
+	return shaper;
+}
+
+static Packet *
+packet_new (NovpnShaper *shaper)
+{
+	Packet *packet = shaper->free;
+
+	if (!packet)
+		return g_new (Packet, 1);
+
+	shaper->free = packet->next;
+	shaper->n_free--;
+	return packet;
+}
+
+static void
+packet_free (NovpnShaper *shaper, Packet *packet)
+{
+	if (shaper->n_free >= FREE_MAX) {
+		g_free (packet);
+		return;
+	}
+
+	packet->next = shaper->free;
+	shaper->free = packet;
+	shaper->n_free++;
+}
+
+static void
+slot_append (NovpnShaper *shaper, guint index, Packet *packet)
+{
+	Slot *slot = &shaper->slots[index];
+
+	packet->next = NULL;
+	if (slot->tail)
+		slot->tail->next = packet;
+	else
+		slot->head = packet;
+	slot->tail = packet;
+
+	shaper->occupied[index / 64] |= G_GUINT64_CONSTANT (1) << (index % 64);
+}
+
+/* Returns when the packet may leave as far as the rate limit goes. */
+static gint64
+rate_limit (NovpnShaper *shaper, gsize len, gint64 now)
+{
+	gint64 now_ns = now * 1000;
+	gint64 depart_ns;
+
+	if (!shaper->params.rate)
+		return now;
+
+	depart_ns = MAX (now_ns, shaper->tat_ns - shaper->burst_ns);
+	shaper->tat_ns = MAX (shaper->tat_ns, depart_ns)
+	                 + (gint64) len * 8 * G_GINT64_CONSTANT (1000000000) / shaper->params.rate;
+
+	return depart_ns / 1000;
+}
+
+/*
+ * Queues a copy of the packet, or drops it. Returns FALSE if the packet
+ * was dropped, either as lost or because too many are in flight.
+ */
+gboolean
+novpn_shaper_enqueue (NovpnShaper *shaper,
+                      const guint8 *data,
+                      gsize len,
+                      gint64 now)
+{
+	const NovpnShaperParams *params = &shaper->params;
+	Packet *packet;
+	gint64 due;
+	gint64 due_tick;
+
+	if (shaper->tick < 0)
+		shaper->tick = now >> TICK_SHIFT;
+
+	if (params->loss > 0 && g_rand_double (shaper->rand) < params->loss) {
+		shaper->stats.lost++;
+		return FALSE;
+	}
+
+	if (len > NOVPN_SHAPER_PACKET_MAX || (params->limit && shaper->queued >= params->limit)) {
+		shaper->stats.overlimit++;
+		return FALSE;
+	}
+
+	due = rate_limit (shaper, len, now);
+
+	if (params->reorder > 0 && g_rand_double (shaper->rand) < params->reorder) {
+		/* Overtakes whatever is being delayed. */
+		shaper->stats.reordered++;
+	} else {
+		due += params->delay_us;
+		if (params->jitter_us)
+			due += g_rand_int_range (shaper->rand, - (gint32) params->jitter_us, params->jitter_us + 1);
+		due = MAX (due, now);
+	}
+
+	/* Can't go into a slot that's been dealt with already. */
+	due_tick = due >> TICK_SHIFT;
+	if (due_tick < shaper->tick) {
+		due_tick = shaper->tick;
+		due = due_tick << TICK_SHIFT;
+	}
+
+	packet = packet_new (shaper);
+	packet->due = due;
+	packet->len = len;
+	memcpy (packet->data, data, len);
+
+	slot_append (shaper, due_tick & WHEEL_MASK, packet);
+	shaper->queued++;
+	shaper->stats.enqueued++;
+
+	return TRUE;
+}
+
+/* Delivers the packets in the slot that are due by the tick. */
+static void
+run_slot (NovpnShaper *shaper, guint index, gint64 tick)
+{
+	Slot *slot = &shaper->slots[index];
+	Packet *packet = slot->head;
+	Packet *next;
+
+	slot->head = NULL;
+	slot->tail = NULL;
+	shaper->occupied[index / 64] &= ~(G_GUINT64_CONSTANT (1) << (index % 64));
+
+	for (; packet; packet = next) {
+		next = packet->next;
+
+		if ((packet->due >> TICK_SHIFT) > tick) {
+			/* Due on a later turn of the wheel. */
+			slot_append (shaper, index, packet);
+			continue;
+		}
+
+		shaper->queued--;
+		shaper->stats.delivered++;
+		shaper->func (packet->data, packet->len, shaper->user_data);
+		packet_free (shaper, packet);
+	}
+}
+
+static gint
+next_occupied (NovpnShaper *shaper, guint from)
+{
+	guint64 bits;
+	guint word;
+	guint n;
+
+	/* One more than the number of words, to see the start of the
+	 * first one again after wrapping around. */
+	for (n = 0; n <= WHEEL_WORDS; n++) {
+		word = ((from / 64) + n) % WHEEL_WORDS;
+		bits = shaper->occupied[word];
+		if (n == 0)
+			bits &= ~G_GUINT64_CONSTANT (0) << (from % 64);
+		if (bits)
+			return word * 64 + __builtin_ctzll (bits);
+	}
+
+	return -1;
+}
+
+/*
+ * Delivers everything that's due, through the callback, which must not
+ * queue into the same shaper. Returns the time of the next departure, or
+ * -1 if nothing is queued. The departure may turn out to be a turn of the
+ * wheel too early for packets that are far out; just call again then.
+ */
+gint64
+novpn_shaper_run (NovpnShaper *shaper, gint64 now)
+{
+	gint64 target = now >> TICK_SHIFT;
+	gint64 tick;
+	gint index;
+
+	if (!shaper->queued) {
+		shaper->tick = target;
+		return -1;
+	}
+
+	if (target - shaper->tick >= WHEEL_SLOTS) {
+		/* Been away for more than a turn; every slot is due. */
+		for (index = 0; index < WHEEL_SLOTS; index++) {
+			if (shaper->slots[index].head)
+				run_slot (shaper, index, target);
+		}
+		shaper->tick = target + 1;
+	} else {
+		while (shaper->tick <= target) {
+			index = next_occupied (shaper, shaper->tick & WHEEL_MASK);
+			if (index < 0)
+				break;
+
+			/* Skip the empty slots, but not past the target: the
+			 * packets queued from now on may be due before the
+			 * next occupied slot. */
+			tick = shaper->tick + ((index - shaper->tick) & WHEEL_MASK);
+			if (tick > target)
+				break;
+
+			run_slot (shaper, index, tick);
+			shaper->tick = tick + 1;
+		}
+		shaper->tick = target + 1;
+	}
+
+	if (!shaper->queued)
+		return -1;
+
+	index = next_occupied (shaper, shaper->tick & WHEEL_MASK);
+	g_return_val_if_fail (index >= 0, -1);
+
+	return (shaper->tick + ((index - shaper->tick) & WHEEL_MASK)) << TICK_SHIFT;
+}
+
+void
+novpn_shaper_get_stats (NovpnShaper *shaper, NovpnShaperStats *stats)
+{
+	*stats = shaper->stats;
+}
+
+void
+novpn_shaper_free (NovpnShaper *shaper)
+{
+	Packet *packet;
+	Packet *next;
+	guint i;
+
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		for (packet = shaper->slots[i].head; packet; packet = next) {
+			next = packet->next;
+			g_free (packet);
+		}
+	}
+
+	for (packet = shaper->free; packet; packet = next) {
+		next = packet->next;
+		g_free (packet);
+	}
+
+	g_rand_free (shaper->rand);
+	g_free (shaper);
+}
@@ -0,0 +1,63 @@
+/*
+ * nm-novpn-shaper - Link emulation for the NetworkManager mock VPN
+ * service tunnel
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_SHAPER_H__
+#define __NM_NOVPN_SHAPER_H__
+
+#include <glib.h>
+
+#define NOVPN_SHAPER_PACKET_MAX 2048
+
+typedef struct _NovpnShaper NovpnShaper;
+
+typedef struct {
+	guint delay_us;         /* one way */
+	guint jitter_us;        /* uniformly distributed, +/- */
+	double loss;            /* probability, 0 to 1 */
+	double reorder;         /* probability of skipping the delay */
+	guint64 rate;           /* bits per second, 0 for unlimited */
+	guint burst;            /* bytes */
+	guint limit;            /* packets in flight */
+} NovpnShaperParams;
+
+typedef struct {
+	guint64 enqueued;
+	guint64 delivered;
+	guint64 lost;
+	guint64 overlimit;
+	guint64 reordered;
+} NovpnShaperStats;
+
+typedef void (*NovpnShaperFunc) (const guint8 *data, gsize len, gpointer user_data);
+
+NovpnShaper *novpn_shaper_new (const NovpnShaperParams *params,
+                               guint32 seed,
+                               NovpnShaperFunc func,
+                               gpointer user_data);
+gboolean novpn_shaper_enqueue (NovpnShaper *shaper,
+                               const guint8 *data,
+                               gsize len,
+                               gint64 now);
+gint64 novpn_shaper_run (NovpnShaper *shaper, gint64 now);
+void novpn_shaper_get_stats (NovpnShaper *shaper, NovpnShaperStats *stats);
+void novpn_shaper_free (NovpnShaper *shaper);
+
+#endif /* __NM_NOVPN_SHAPER_H__ */
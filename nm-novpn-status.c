@@ -0,0 +1,216 @@
+/*
+ * nm-novpn-status - Live status page of the NetworkManager mock VPN
+ * service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * A service started with --status keeps its state in a page of shared
+ * memory, a file in /dev/shm that anyone can map and read without asking
+ * the service.
+ *
+ * The page is guarded by a sequence lock. There's a single writer, the
+ * service's main thread, which makes the sequence number odd, updates
+ * the data in place and makes the number even again. It never waits for
+ * anyone. A reader copies the data out and retries if the number was
+ * odd or changed meanwhile, so it never sees half of an update; it
+ * gives up after a while in case the writer died in the middle of one.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <gio/gio.h>
+
+#include "nm-novpn-status.h"
+
+/* Many more than an update takes. */
+#define READ_TRIES 10000
+
+struct _NovpnStatus {
+	char *path;
+	NovpnStatusPage *page;
+};
+
+NovpnStatus *
+novpn_status_new (const char *bus_name, GError **error)
+{
+	NovpnStatus *status;
+	NovpnStatusPage *page;
+	char *path;
+	int fd = -1;
+
+	path = g_strdup_printf (NOVPN_STATUS_DIR "/" NOVPN_STATUS_PREFIX "%d", getpid ());
+
+	/* A leftover from a process that had our pid is fair game. Anything
+	 * else anyone put there in its place, such as a symlink, is not
+	 * followed: the page is always a new file of our own. */
+	if (unlink (path) == -1 && errno != ENOENT) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't remove %s: %s", path, g_strerror (errno));
+		g_free (path);
+		return NULL;
+	}
+	fd = open (path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd == -1 || ftruncate (fd, sizeof (*page)) == -1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't create %s: %s", path, g_strerror (errno));
+		goto fail;
+	}
+
+	page = mmap (NULL, sizeof (*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't map %s: %s", path, g_strerror (errno));
+		goto fail;
+	}
+	close (fd);
+
+	page->version = NOVPN_STATUS_VERSION;
+	page->pid = getpid ();
+	g_strlcpy (page->data.bus_name, bus_name, sizeof (page->data.bus_name));
+	page->data.started = g_get_monotonic_time ();
+	page->data.updated = page->data.started;
+
+	/* Readers skip the page until it's filled in. */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	page->magic = NOVPN_STATUS_MAGIC;
+
+	status = g_new0 (NovpnStatus, 1);
+	status->path = path;
+	status->page = page;
+	return status;
+
+fail:
+	if (fd != -1) {
+		close (fd);
+		unlink (path);
+	}
+	g_free (path);
+	return NULL;
+}
+
+/* The data can be changed until novpn_status_end(). */
+NovpnStatusData *
+novpn_status_begin (NovpnStatus *status)
+{
+	g_atomic_int_inc (&status->page->seq);
+	/* The odd number goes out before any of the data does. */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+
+	return &status->page->data;
+}
+
+void
+novpn_status_end (NovpnStatus *status)
+{
+	status->page->data.updated = g_get_monotonic_time ();
+	g_atomic_int_inc (&status->page->seq);
+}
+
+void
+novpn_status_free (NovpnStatus *status)
+{
+	unlink (status->path);
+	munmap (status->page, sizeof (*status->page));
+	g_free (status->path);
+	g_free (status);
+}
+
+const NovpnStatusPage *
+novpn_status_map (const char *path, GError **error)
+{
+	const NovpnStatusPage *page;
+	struct stat st;
+	int fd;
+
+	fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1 || fstat (fd, &st) == -1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't open %s: %s", path, g_strerror (errno));
+		goto fail;
+	}
+
+	/* Could be a page that's just being created. */
+	if (st.st_size < (off_t) sizeof (*page)) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s is not a status page", path);
+		goto fail;
+	}
+
+	page = mmap (NULL, sizeof (*page), PROT_READ, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't map %s: %s", path, g_strerror (errno));
+		goto fail;
+	}
+	close (fd);
+
+	if (   g_atomic_int_get ((const volatile gint *) &page->magic) != NOVPN_STATUS_MAGIC
+	    || page->version != NOVPN_STATUS_VERSION) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s is not a status page of this version", path);
+		novpn_status_unmap (page);
+		return NULL;
+	}
+
+	return page;
+
+fail:
+	if (fd != -1)
+		close (fd);
+	return NULL;
+}
+
+/* A consistent copy of the data, or FALSE if the writer seems stuck. */
+gboolean
+novpn_status_read (const NovpnStatusPage *page, NovpnStatusData *data)
+{
+	gint seq;
+	guint i;
+
+	for (i = 0; i < READ_TRIES; i++) {
+		seq = g_atomic_int_get (&page->seq);
+		if (seq & 1)
+			continue;
+
+		memcpy (data, &page->data, sizeof (*data));
+
+		/* The copy is done before the number is checked again. */
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (g_atomic_int_get (&page->seq) != seq)
+			continue;
+
+		data->bus_name[sizeof (data->bus_name) - 1] = '\0';
+		data->uuid[sizeof (data->uuid) - 1] = '\0';
+		data->gateway[sizeof (data->gateway) - 1] = '\0';
+		data->phase[sizeof (data->phase) - 1] = '\0';
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+void
+novpn_status_unmap (const NovpnStatusPage *page)
+{
+	munmap ((gpointer) page, sizeof (*page));
+}
@@ -0,0 +1,83 @@
+/*
+ * nm-novpn-status - Live status page of the NetworkManager mock VPN
+ * service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_STATUS_H__
+#define __NM_NOVPN_STATUS_H__
+
+#include <glib.h>
+
+/* Followed by the service's pid. */
+#define NOVPN_STATUS_DIR "/dev/shm"
+#define NOVPN_STATUS_PREFIX "novpn-status-"
+
+#define NOVPN_STATUS_MAGIC 0x54535653  /* "SVST" */
+#define NOVPN_STATUS_VERSION 1
+
+/* The times are of g_get_monotonic_time(), which is the same clock in
+ * every process, and 0 if it didn't happen yet. */
+typedef struct {
+	char bus_name[64];
+	char uuid[40];
+	char gateway[64];
+	char phase[16];
+	guint32 state;
+	/* IPv4, in network byte order, 0 while not connected */
+	guint32 address;
+
+	gint64 started;
+	gint64 connect_started;
+	gint64 connected;
+	gint64 updated;
+
+	guint64 connects;
+	guint64 disconnects;
+	guint64 need_secrets;
+	guint64 failures;
+	guint64 cancelled;
+	guint64 config_messages;
+	guint64 config_bytes;
+	guint64 tunnel_delivered;
+	guint64 tunnel_lost;
+	guint64 dns_queries;
+	guint64 dns_cache_hits;
+} NovpnStatusData;
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	gint32 pid;
+	/* Odd while the data is being updated. */
+	volatile gint seq;
+	NovpnStatusData data;
+} NovpnStatusPage;
+
+typedef struct _NovpnStatus NovpnStatus;
+
+NovpnStatus *novpn_status_new (const char *bus_name, GError **error);
+NovpnStatusData *novpn_status_begin (NovpnStatus *status);
+void novpn_status_end (NovpnStatus *status);
+void novpn_status_free (NovpnStatus *status);
+
+const NovpnStatusPage *novpn_status_map (const char *path, GError **error);
+gboolean novpn_status_read (const NovpnStatusPage *page, NovpnStatusData *data);
+void novpn_status_unmap (const NovpnStatusPage *page);
+
+#endif /* __NM_NOVPN_STATUS_H__ */
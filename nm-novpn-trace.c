@@ -0,0 +1,371 @@
+/*
+ * nm-novpn-trace - Recording and replaying of the NetworkManager mock
+ * VPN service D-Bus sessions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * The trace file starts with an 8 byte magic and a 32-bit version,
+ * followed by records, all little endian:
+ *
+ *   u64  microseconds since the recording started
+ *   u8   direction (0 = incoming method call, 1 = outgoing signal)
+ *   u32  length of the message
+ *   ...  the message in D-Bus wire format
+ *
+ * Only the VPN plugin interface is recorded. Note that Connect carries
+ * the connection secrets.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <NetworkManager.h>
+
+#include "nm-novpn-clock.h"
+#include "nm-novpn-trace.h"
+
+#define TRACE_MAGIC "NMNOVPNT"
+#define TRACE_VERSION 1
+
+enum {
+	DIRECTION_IN = 0,
+	DIRECTION_OUT = 1,
+};
+
+struct _NovpnTraceRecorder {
+	GDBusConnection *connection;
+	guint filter_id;
+	gint64 started;
+
+	/* The filter runs in the GDBus worker thread. */
+	GMutex lock;
+	FILE *file;
+};
+
+typedef struct {
+	gint64 timestamp;
+	guint8 direction;
+	GDBusMessage *message;
+} TraceRecord;
+
+struct _NovpnTraceReplay {
+	GArray *records;
+	guint cursor;
+	double speed;
+	NovpnTraceReplayFunc func;
+	gpointer user_data;
+	GArray *pending;
+};
+
+typedef struct {
+	NovpnTraceReplay *replay;
+	guint index;
+	guint source_id;
+} PendingRecord;
+
+static gboolean
+is_plugin_message (GDBusMessage *message, gboolean incoming)
+{
+	if (g_strcmp0 (g_dbus_message_get_interface (message), NM_VPN_DBUS_PLUGIN_INTERFACE) != 0)
+		return FALSE;
+
+	if (incoming)
+		return g_dbus_message_get_message_type (message) == G_DBUS_MESSAGE_TYPE_METHOD_CALL;
+	else
+		return g_dbus_message_get_message_type (message) == G_DBUS_MESSAGE_TYPE_SIGNAL;
+}
+
+static GDBusMessage *
+record_filter (GDBusConnection *connection,
+               GDBusMessage *message,
+               gboolean incoming,
+               gpointer user_data)
+{
+	NovpnTraceRecorder *recorder = user_data;
+	g_autofree guchar *blob = NULL;
+	gsize blob_len;
+	guint64 timestamp;
+	guint32 length;
+	guint8 direction;
+
+	if (!is_plugin_message (message, incoming))
+		return message;
+
+	blob = g_dbus_message_to_blob (message, &blob_len, G_DBUS_CAPABILITY_FLAGS_NONE, NULL);
+	if (!blob)
+		return message;
+
+	timestamp = GUINT64_TO_LE (g_get_monotonic_time () - recorder->started);
+	direction = incoming ? DIRECTION_IN : DIRECTION_OUT;
+	length = GUINT32_TO_LE (blob_len);
+
+	g_mutex_lock (&recorder->lock);
+	if (!recorder->file) {
+		/* Closed already. */
+	} else if (   fwrite (&timestamp, sizeof (timestamp), 1, recorder->file) != 1
+	           || fwrite (&direction, sizeof (direction), 1, recorder->file) != 1
+	           || fwrite (&length, sizeof (length), 1, recorder->file) != 1
+	           || fwrite (blob, blob_len, 1, recorder->file) != 1) {
+		g_warning ("Failed to write trace record: %s", g_strerror (errno));
+	}
+	g_mutex_unlock (&recorder->lock);
+
+	return message;
+}
+
+NovpnTraceRecorder *
+novpn_trace_recorder_new (const char *filename,
+                          GDBusConnection *connection,
+                          GError **error)
+{
+	NovpnTraceRecorder *recorder;
+	guint32 version = GUINT32_TO_LE (TRACE_VERSION);
+	FILE *file;
+	int fd;
+
+	/* Only for our eyes, it has the secrets. An existing file keeps its
+	 * mode on O_TRUNC, hence the fchmod(). */
+	fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd == -1 || fchmod (fd, 0600) == -1 || !(file = fdopen (fd, "wb"))) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "%s: %s", filename, g_strerror (errno));
+		if (fd != -1)
+			close (fd);
+		return NULL;
+	}
+
+	if (   fwrite (TRACE_MAGIC, strlen (TRACE_MAGIC), 1, file) != 1
+	    || fwrite (&version, sizeof (version), 1, file) != 1) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "%s: %s", filename, g_strerror (errno));
+		fclose (file);
+		return NULL;
+	}
+
+	recorder = g_slice_new0 (NovpnTraceRecorder);
+	g_mutex_init (&recorder->lock);
+	recorder->file = file;
+	recorder->started = g_get_monotonic_time ();
+	recorder->connection = g_object_ref (connection);
+	recorder->filter_id = g_dbus_connection_add_filter (connection, record_filter, recorder, NULL);
+
+	return recorder;
+}
+
+/*
+ * The filter may still be running in the worker thread for a moment
+ * after it's removed, so this only closes the file. The little that's
+ * left of the recorder is not freed; there's one per process at most.
+ */
+void
+novpn_trace_recorder_close (NovpnTraceRecorder *recorder)
+{
+	g_dbus_connection_remove_filter (recorder->connection, recorder->filter_id);
+	g_clear_object (&recorder->connection);
+
+	g_mutex_lock (&recorder->lock);
+	fclose (recorder->file);
+	recorder->file = NULL;
+	g_mutex_unlock (&recorder->lock);
+}
+
+static void
+clear_record (gpointer data)
+{
+	TraceRecord *record = data;
+
+	g_clear_object (&record->message);
+}
+
+static gboolean
+load_records (GArray *records,
+              const char *filename,
+              GError **error)
+{
+	g_autofree gchar *contents = NULL;
+	gsize len;
+	gsize pos;
+	guint32 version;
+	guint64 timestamp;
+	guint32 length;
+	TraceRecord record;
+
+	if (!g_file_get_contents (filename, &contents, &len, error))
+		return FALSE;
+
+	pos = strlen (TRACE_MAGIC);
+	if (len < pos + sizeof (version) || memcmp (contents, TRACE_MAGIC, pos) != 0) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+		             "%s: Not a trace file", filename);
+		return FALSE;
+	}
+
+	memcpy (&version, contents + pos, sizeof (version));
+	pos += sizeof (version);
+	if (GUINT32_FROM_LE (version) != TRACE_VERSION) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+		             "%s: Unsupported trace version %u", filename, GUINT32_FROM_LE (version));
+		return FALSE;
+	}
+
+	while (pos < len) {
+		if (len - pos < sizeof (timestamp) + 1 + sizeof (length))
+			break;
+
+		memcpy (&timestamp, contents + pos, sizeof (timestamp));
+		pos += sizeof (timestamp);
+		record.timestamp = GUINT64_FROM_LE (timestamp);
+		record.direction = contents[pos++];
+		memcpy (&length, contents + pos, sizeof (length));
+		pos += sizeof (length);
+		length = GUINT32_FROM_LE (length);
+
+		if (len - pos < length)
+			break;
+
+		record.message = g_dbus_message_new_from_blob ((guchar *) contents + pos, length,
+		                                               G_DBUS_CAPABILITY_FLAGS_NONE, error);
+		if (!record.message)
+			return FALSE;
+		pos += length;
+
+		g_array_append_val (records, record);
+	}
+
+	if (pos != len) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+		             "%s: Truncated trace record", filename);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+NovpnTraceReplay *
+novpn_trace_replay_new (const char *filename,
+                        double speed,
+                        NovpnTraceReplayFunc func,
+                        gpointer user_data,
+                        GError **error)
+{
+	NovpnTraceReplay *replay;
+
+	g_return_val_if_fail (speed > 0, NULL);
+
+	replay = g_slice_new0 (NovpnTraceReplay);
+	replay->records = g_array_new (FALSE, FALSE, sizeof (TraceRecord));
+	g_array_set_clear_func (replay->records, clear_record);
+	replay->pending = g_array_new (FALSE, FALSE, sizeof (PendingRecord *));
+	replay->speed = speed;
+	replay->func = func;
+	replay->user_data = user_data;
+
+	if (!load_records (replay->records, filename, error)) {
+		novpn_trace_replay_free (replay);
+		return NULL;
+	}
+
+	return replay;
+}
+
+static gboolean
+replay_record (gpointer user_data)
+{
+	PendingRecord *pending = user_data;
+	NovpnTraceReplay *replay = pending->replay;
+	TraceRecord *record = &g_array_index (replay->records, TraceRecord, pending->index);
+	guint i;
+
+	for (i = 0; i < replay->pending->len; i++) {
+		if (g_array_index (replay->pending, PendingRecord *, i) == pending) {
+			g_array_remove_index_fast (replay->pending, i);
+			break;
+		}
+	}
+
+	replay->func (record->message, replay->user_data);
+	g_slice_free (PendingRecord, pending);
+
+	return G_SOURCE_REMOVE;
+}
+
+/*
+ * A method call matching the next recorded call for the member has just
+ * arrived. Schedule whatever we sent in response to it at the recorded
+ * offsets from the call, scaled by the replay speed. Recorded calls that
+ * didn't happen live are skipped.
+ */
+void
+novpn_trace_replay_call (NovpnTraceReplay *replay, const char *member)
+{
+	TraceRecord *record;
+	PendingRecord *pending;
+	gint64 anchor;
+	guint64 delay;
+	guint i;
+
+	for (i = replay->cursor; i < replay->records->len; i++) {
+		record = &g_array_index (replay->records, TraceRecord, i);
+		if (   record->direction == DIRECTION_IN
+		    && g_strcmp0 (g_dbus_message_get_member (record->message), member) == 0)
+			break;
+	}
+
+	if (i == replay->records->len) {
+		g_message ("Replay: %s is not in the rest of the trace", member);
+		return;
+	}
+
+	anchor = record->timestamp;
+	for (i++; i < replay->records->len; i++) {
+		record = &g_array_index (replay->records, TraceRecord, i);
+		if (record->direction == DIRECTION_IN)
+			break;
+
+		delay = (record->timestamp - anchor) / replay->speed / 1000;
+
+		pending = g_slice_new (PendingRecord);
+		pending->replay = replay;
+		pending->index = i;
+		pending->source_id = novpn_clock_timeout_add (delay, replay_record, pending);
+		g_array_append_val (replay->pending, pending);
+	}
+
+	replay->cursor = i;
+}
+
+void
+novpn_trace_replay_free (NovpnTraceReplay *replay)
+{
+	PendingRecord *pending;
+	guint i;
+
+	for (i = 0; i < replay->pending->len; i++) {
+		pending = g_array_index (replay->pending, PendingRecord *, i);
+		g_source_remove (pending->source_id);
+		g_slice_free (PendingRecord, pending);
+	}
+
+	g_array_unref (replay->pending);
+	g_array_unref (replay->records);
+	g_slice_free (NovpnTraceReplay, replay);
+}
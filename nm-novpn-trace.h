@@ -0,0 +1,45 @@
+/*
+ * nm-novpn-trace - Recording and replaying of the NetworkManager mock
+ * VPN service D-Bus sessions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#ifndef __NM_NOVPN_TRACE_H__
+#define __NM_NOVPN_TRACE_H__
+
+#include <gio/gio.h>
+
+typedef struct _NovpnTraceRecorder NovpnTraceRecorder;
+typedef struct _NovpnTraceReplay NovpnTraceReplay;
+
+NovpnTraceRecorder *novpn_trace_recorder_new (const char *filename,
+                                              GDBusConnection *connection,
+                                              GError **error);
+void novpn_trace_recorder_close (NovpnTraceRecorder *recorder);
+
+typedef void (*NovpnTraceReplayFunc) (GDBusMessage *message, gpointer user_data);
+
+NovpnTraceReplay *novpn_trace_replay_new (const char *filename,
+                                          double speed,
+                                          NovpnTraceReplayFunc func,
+                                          gpointer user_data,
+                                          GError **error);
+void novpn_trace_replay_call (NovpnTraceReplay *replay, const char *member);
+void novpn_trace_replay_free (NovpnTraceReplay *replay);
+
+#endif /* __NM_NOVPN_TRACE_H__ */
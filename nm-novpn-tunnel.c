@@ -0,0 +1,287 @@
+/*
+ * nm-novpn-tunnel - Emulated data path for the NetworkManager mock VPN
+ * service
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * A TUN device with a pretend remote end. Whatever is routed into it
+ * goes through a shaper on the way out, the remote end answers pings,
+ * and the answers go through another shaper on the way back. The delay
+ * is one way, so the round trip is twice that.
+ *
+ * Creating the device takes CAP_NET_ADMIN, which an unprivileged user
+ * has in a user and network namespace of their own (unshare -Urn).
+ *
+ * Packets are moved by a thread of its own, which sleeps until either
+ * the device has something or the next packet is due.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/if_tun.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+
+#include "nm-novpn-tunnel.h"
+
+/* Packets read from the device before letting the shapers run. */
+#define BATCH 64
+
+#define ICMP_ECHO_REPLY 0
+#define ICMP_ECHO_REQUEST 8
+
+struct _NovpnTunnel {
+	int fd;
+	int wakeup[2];
+	char name[IFNAMSIZ];
+	GThread *thread;
+
+	/* Owned by the thread. */
+	NovpnShaper *egress;
+	NovpnShaper *ingress;
+	gint64 now;
+
+	GMutex lock;
+	NovpnShaperStats egress_stats;
+	NovpnShaperStats ingress_stats;
+};
+
+static guint16
+inet_checksum (const guint8 *data, gsize len)
+{
+	guint32 sum = 0;
+	gsize i;
+
+	for (i = 0; i + 1 < len; i += 2)
+		sum += (data[i] << 8) | data[i + 1];
+	if (len & 1)
+		sum += data[len - 1] << 8;
+
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return ~sum;
+}
+
+/*
+ * The remote end. Only answers ICMP echo requests over IPv4; the rest is
+ * dropped on the floor, which is what a remote without anything on the
+ * port would mostly amount to anyway.
+ */
+static void
+remote_receive (const guint8 *data, gsize len, gpointer user_data)
+{
+	NovpnTunnel *tunnel = user_data;
+	guint8 reply[NOVPN_SHAPER_PACKET_MAX];
+	guint8 addr[4];
+	guint16 checksum;
+	gsize hlen;
+
+	if (len < 20 || (data[0] >> 4) != 4)
+		return;
+
+	hlen = (data[0] & 0x0f) * 4;
+	if (   hlen < 20 || len < hlen + 8
+	    || data[9] != IPPROTO_ICMP || data[hlen] != ICMP_ECHO_REQUEST)
+		return;
+
+	memcpy (reply, data, len);
+
+	/* Swapping the addresses keeps the header checksum right. */
+	memcpy (addr, reply + 12, 4);
+	memcpy (reply + 12, reply + 16, 4);
+	memcpy (reply + 16, addr, 4);
+
+	reply[hlen] = ICMP_ECHO_REPLY;
+	reply[hlen + 2] = 0;
+	reply[hlen + 3] = 0;
+	checksum = inet_checksum (reply + hlen, len - hlen);
+	reply[hlen + 2] = checksum >> 8;
+	reply[hlen + 3] = checksum & 0xff;
+
+	novpn_shaper_enqueue (tunnel->ingress, reply, len, tunnel->now);
+}
+
+static void
+local_receive (const guint8 *data, gsize len, gpointer user_data)
+{
+	NovpnTunnel *tunnel = user_data;
+
+	/* If the device's queue is full, that's a loss like any other. */
+	if (write (tunnel->fd, data, len) < 0 && errno != EAGAIN)
+		g_warning ("Can't write to %s: %s", tunnel->name, g_strerror (errno));
+}
+
+static gint64
+next_due (gint64 a, gint64 b)
+{
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+	return MIN (a, b);
+}
+
+static gpointer
+tunnel_thread (gpointer user_data)
+{
+	NovpnTunnel *tunnel = user_data;
+	struct pollfd fds[2] = {
+		{ .fd = tunnel->fd, .events = POLLIN },
+		{ .fd = tunnel->wakeup[0], .events = POLLIN },
+	};
+	guint8 buf[NOVPN_SHAPER_PACKET_MAX];
+	struct timespec timeout;
+	gint64 due = -1;
+	gint64 wait;
+	ssize_t len;
+	int i;
+
+	while (TRUE) {
+		if (due >= 0) {
+			wait = MAX (due - g_get_monotonic_time (), 0);
+			timeout.tv_sec = wait / G_USEC_PER_SEC;
+			timeout.tv_nsec = (wait % G_USEC_PER_SEC) * 1000;
+		}
+
+		if (ppoll (fds, G_N_ELEMENTS (fds), due >= 0 ? &timeout : NULL, NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			g_warning ("Tunnel poll failed: %s", g_strerror (errno));
+			break;
+		}
+
+		if (fds[1].revents)
+			break;
+
+		tunnel->now = g_get_monotonic_time ();
+
+		if (fds[0].revents & POLLIN) {
+			for (i = 0; i < BATCH; i++) {
+				len = read (tunnel->fd, buf, sizeof (buf));
+				if (len <= 0)
+					break;
+				novpn_shaper_enqueue (tunnel->egress, buf, len, tunnel->now);
+			}
+		}
+
+		due = next_due (novpn_shaper_run (tunnel->egress, tunnel->now),
+		                novpn_shaper_run (tunnel->ingress, tunnel->now));
+
+		g_mutex_lock (&tunnel->lock);
+		novpn_shaper_get_stats (tunnel->egress, &tunnel->egress_stats);
+		novpn_shaper_get_stats (tunnel->ingress, &tunnel->ingress_stats);
+		g_mutex_unlock (&tunnel->lock);
+	}
+
+	return NULL;
+}
+
+NovpnTunnel *
+novpn_tunnel_new (const NovpnShaperParams *params,
+                  guint32 seed,
+                  GError **error)
+{
+	NovpnTunnel *tunnel;
+	struct ifreq ifr = { 0, };
+	int fd;
+
+	fd = open ("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "/dev/net/tun: %s", g_strerror (errno));
+		return NULL;
+	}
+
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	g_strlcpy (ifr.ifr_name, "novpn%d", sizeof (ifr.ifr_name));
+	if (ioctl (fd, TUNSETIFF, &ifr) < 0) {
+		g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+		             "Can't create a TUN device: %s", g_strerror (errno));
+		close (fd);
+		return NULL;
+	}
+
+	tunnel = g_new0 (NovpnTunnel, 1);
+	tunnel->fd = fd;
+	g_strlcpy (tunnel->name, ifr.ifr_name, sizeof (tunnel->name));
+	g_mutex_init (&tunnel->lock);
+
+	if (!g_unix_open_pipe (tunnel->wakeup, FD_CLOEXEC, error)) {
+		close (fd);
+		g_free (tunnel);
+		return NULL;
+	}
+
+	/* Both ways alike, but not the same random decisions. */
+	tunnel->egress = novpn_shaper_new (params, seed, remote_receive, tunnel);
+	tunnel->ingress = novpn_shaper_new (params, seed ^ 0x5a5a5a5a, local_receive, tunnel);
+
+	tunnel->thread = g_thread_try_new ("novpn-tunnel", tunnel_thread, tunnel, error);
+	if (!tunnel->thread) {
+		novpn_tunnel_free (tunnel);
+		return NULL;
+	}
+
+	return tunnel;
+}
+
+const char *
+novpn_tunnel_get_name (NovpnTunnel *tunnel)
+{
+	return tunnel->name;
+}
+
+void
+novpn_tunnel_get_stats (NovpnTunnel *tunnel,
+                        NovpnShaperStats *egress,
+                        NovpnShaperStats *ingress)
+{
+	g_mutex_lock (&tunnel->lock);
+	*egress = tunnel->egress_stats;
+	*ingress = tunnel->ingress_stats;
+	g_mutex_unlock (&tunnel->lock);
+}
+
+/* Removes the device too; it goes away with the last descriptor. */
+void
+novpn_tunnel_free (NovpnTunnel *tunnel)
+{
+	if (tunnel->thread) {
+		if (write (tunnel->wakeup[1], "", 1) < 0)
+			g_warning ("Can't stop the tunnel thread: %s", g_strerror (errno));
+		g_thread_join (tunnel->thread);
+	}
+
+	close (tunnel->wakeup[0]);
+	close (tunnel->wakeup[1]);
+	close (tunnel->fd);
+	novpn_shaper_free (tunnel->egress);
+	novpn_shaper_free (tunnel->ingress);
+	g_mutex_clear (&tunnel->lock);
+	g_free (tunnel);
+}
@@ -0,0 +1,85 @@
+/*
+ * novpn-index - Builds and queries the index of a directory of exported
+ * NetworkManager mock VPN profiles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "nm-novpn-index.h"
+
+static const char *key_names[NOVPN_INDEX_N_KEYS] = {
+	[NOVPN_INDEX_ID] = "id",
+	[NOVPN_INDEX_UUID] = "uuid",
+	[NOVPN_INDEX_GATEWAY] = "gateway",
+};
+
+static void
+usage (const char *argv0)
+{
+	g_printerr ("Usage: %s build <directory>\n", argv0);
+	g_printerr ("       %s lookup <directory> id|uuid|gateway <value>\n", argv0);
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GError) error = NULL;
+	g_auto(GStrv) paths = NULL;
+	NovpnIndex *index;
+	int key;
+	int i;
+
+	if (argc == 3 && strcmp (argv[1], "build") == 0) {
+		if (!novpn_index_build (argv[2], &error)) {
+			g_printerr ("Error: %s\n", error->message);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (argc != 5 || strcmp (argv[1], "lookup") != 0) {
+		usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (key = 0; key < NOVPN_INDEX_N_KEYS; key++) {
+		if (strcmp (argv[3], key_names[key]) == 0)
+			break;
+	}
+	if (key == NOVPN_INDEX_N_KEYS) {
+		usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	index = novpn_index_open (argv[2], &error);
+	if (!index) {
+		g_printerr ("Error: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	paths = novpn_index_lookup (index, key, argv[4]);
+	for (i = 0; paths[i]; i++)
+		g_print ("%s\n", paths[i]);
+
+	novpn_index_free (index);
+
+	return paths[0] ? EXIT_SUCCESS : EXIT_FAILURE;
+}
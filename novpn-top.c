@@ -0,0 +1,254 @@
+/*
+ * novpn-top - Live view of the running mock VPN services
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ *
+ * (C) Copyright 2018 Lubomir Rintel
+ */
+
+/*
+ * Maps the status pages of all the services started with --status and
+ * reads them straight from memory, see nm-novpn-status.c. The pages come
+ * and go with the services; the directory is only looked at again every
+ * few seconds.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include <NetworkManager.h>
+
+#include "nm-novpn-status.h"
+
+#define RESCAN_US (2 * G_USEC_PER_SEC)
+
+typedef struct {
+	const NovpnStatusPage *page;
+	NovpnStatusData data;
+	gboolean valid;
+	gboolean seen;
+} Instance;
+
+static const char *state_names[] = {
+	[NM_VPN_SERVICE_STATE_UNKNOWN]  = "unknown",
+	[NM_VPN_SERVICE_STATE_INIT]     = "init",
+	[NM_VPN_SERVICE_STATE_SHUTDOWN] = "shutdown",
+	[NM_VPN_SERVICE_STATE_STARTING] = "starting",
+	[NM_VPN_SERVICE_STATE_STARTED]  = "started",
+	[NM_VPN_SERVICE_STATE_STOPPING] = "stopping",
+	[NM_VPN_SERVICE_STATE_STOPPED]  = "stopped",
+};
+
+static void
+instance_free (gpointer data)
+{
+	Instance *instance = data;
+
+	novpn_status_unmap (instance->page);
+	g_free (instance);
+}
+
+/* Maps the new pages and lets go of those of services that are gone. */
+static void
+rescan (GHashTable *instances)
+{
+	g_autoptr(GError) error = NULL;
+	GHashTableIter iter;
+	Instance *instance;
+	const char *name;
+	GDir *dir;
+
+	g_hash_table_iter_init (&iter, instances);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &instance))
+		instance->seen = FALSE;
+
+	dir = g_dir_open (NOVPN_STATUS_DIR, 0, &error);
+	if (!dir) {
+		g_printerr ("Error: %s\n", error->message);
+		return;
+	}
+
+	while ((name = g_dir_read_name (dir))) {
+		g_autofree char *path = NULL;
+		const NovpnStatusPage *page;
+
+		if (!g_str_has_prefix (name, NOVPN_STATUS_PREFIX))
+			continue;
+
+		instance = g_hash_table_lookup (instances, name);
+		if (instance) {
+			instance->seen = TRUE;
+			continue;
+		}
+
+		/* Not filled in yet, or of some other version; skipped. */
+		path = g_build_filename (NOVPN_STATUS_DIR, name, NULL);
+		page = novpn_status_map (path, NULL);
+		if (!page)
+			continue;
+
+		instance = g_new0 (Instance, 1);
+		instance->page = page;
+		instance->seen = TRUE;
+		g_hash_table_insert (instances, g_strdup (name), instance);
+	}
+	g_dir_close (dir);
+
+	/* A service that was killed leaves its page behind. */
+	g_hash_table_iter_init (&iter, instances);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &instance)) {
+		if (   !instance->seen
+		    || (kill (instance->page->pid, 0) == -1 && errno == ESRCH))
+			g_hash_table_iter_remove (&iter);
+	}
+}
+
+static int
+compare_pid (gconstpointer a, gconstpointer b)
+{
+	const Instance *instance_a = *(const Instance **) a;
+	const Instance *instance_b = *(const Instance **) b;
+
+	return instance_a->page->pid - instance_b->page->pid;
+}
+
+static void
+format_duration (char *buf, gsize len, gint64 usec)
+{
+	gint64 sec = usec / G_USEC_PER_SEC;
+
+	if (sec < 60)
+		g_snprintf (buf, len, "%.1fs", usec / (double) G_USEC_PER_SEC);
+	else if (sec < 3600)
+		g_snprintf (buf, len, "%dm%02ds", (int) (sec / 60), (int) (sec % 60));
+	else
+		g_snprintf (buf, len, "%dh%02dm", (int) (sec / 3600), (int) (sec / 60 % 60));
+}
+
+static void
+show (GHashTable *instances, gboolean clear)
+{
+	g_autoptr(GPtrArray) sorted = g_ptr_array_new ();
+	GHashTableIter iter;
+	Instance *instance;
+	NovpnStatusData *data;
+	gint64 now = g_get_monotonic_time ();
+	guint connected = 0;
+	guint64 connects = 0;
+	guint i;
+
+	g_hash_table_iter_init (&iter, instances);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &instance)) {
+		/* If the writer's stuck, the last good copy is shown. */
+		if (novpn_status_read (instance->page, &instance->data))
+			instance->valid = TRUE;
+		if (instance->valid)
+			g_ptr_array_add (sorted, instance);
+	}
+	g_ptr_array_sort (sorted, compare_pid);
+
+	if (clear)
+		g_print ("\033[H\033[2J");
+
+	g_print ("%7s %-28s %-9s %-13s %-15s %9s %8s %7s %7s %6s %6s %7s %10s %10s\n",
+	         "PID", "BUS NAME", "STATE", "PHASE", "ADDRESS", "CONNECT", "UP",
+	         "CONNS", "DISCS", "FAILS", "CANC", "CONFIG", "TUNNEL", "DNS");
+
+	for (i = 0; i < sorted->len; i++) {
+		char address[INET_ADDRSTRLEN] = "-";
+		char connect[16] = "-";
+		char up[16] = "-";
+		const char *state = "?";
+
+		instance = sorted->pdata[i];
+		data = &instance->data;
+
+		if (data->state < G_N_ELEMENTS (state_names) && state_names[data->state])
+			state = state_names[data->state];
+		if (data->address)
+			inet_ntop (AF_INET, &data->address, address, sizeof (address));
+		if (data->connected) {
+			g_snprintf (connect, sizeof (connect), "%.1fms",
+			            (data->connected - data->connect_started) / 1000.0);
+			format_duration (up, sizeof (up), now - data->connected);
+		}
+
+		g_print ("%7d %-28.28s %-9s %-13s %-15s %9s %8s %7" G_GUINT64_FORMAT
+		         " %7" G_GUINT64_FORMAT " %6" G_GUINT64_FORMAT " %6" G_GUINT64_FORMAT
+		         " %7" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT " %10" G_GUINT64_FORMAT "\n",
+		         instance->page->pid, data->bus_name, state, data->phase, address,
+		         connect, up, data->connects, data->disconnects, data->failures,
+		         data->cancelled, data->config_messages, data->tunnel_delivered,
+		         data->dns_queries);
+
+		if (data->connected)
+			connected++;
+		connects += data->connects;
+	}
+
+	g_print ("%u services, %u connected, %" G_GUINT64_FORMAT " connects\n",
+	         sorted->len, connected, connects);
+}
+
+int
+main (int argc, char *argv[])
+{
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	g_autoptr(GError) error = NULL;
+	g_autoptr(GHashTable) instances = NULL;
+	gint interval = 1000;
+	gboolean once = FALSE;
+	gboolean clear;
+	gint64 scanned = 0;
+
+	GOptionEntry options[] = {
+		{ "interval", 'i', 0, G_OPTION_ARG_INT, &interval, "Milliseconds between updates", "MS" },
+		{ "once", 0, 0, G_OPTION_ARG_NONE, &once, "Show the services once and exit", NULL },
+		{NULL}
+	};
+
+	opt_ctx = g_option_context_new (NULL);
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
+	if (interval < 1) {
+		g_printerr ("Usage: %s [--interval MS] [--once]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	instances = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, instance_free);
+	clear = !once && isatty (STDOUT_FILENO);
+
+	while (TRUE) {
+		if (g_get_monotonic_time () - scanned >= RESCAN_US) {
+			rescan (instances);
+			scanned = g_get_monotonic_time ();
+		}
+
+		show (instances, clear);
+		if (once)
+			break;
+		g_usleep (interval * 1000);
+	}
+
+	return EXIT_SUCCESS;
+}
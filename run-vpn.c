@@ -20,13 +20,30 @@
 
 #include <NetworkManager.h>
 #include <gtk/gtk.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 #if !NM_CHECK_VERSION(1,13,0)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (NMConnection, g_object_unref)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (NMVpnEditorPlugin, g_object_unref)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (NMVpnEditor, g_object_unref)
 #endif
 
+/* How long a destroyed editor gets to finish what it's still doing in
+ * the background (loading a certificate) before it counts as leaked. */
+#define FINALIZE_TIMEOUT_MS 2000
+
+#if GTK_CHECK_VERSION(3,90,0)
+static gboolean
+window_close_request (GtkWindow *window,
+                      gpointer user_data)
+{
+	GMainLoop *main_loop = user_data;
+	g_main_loop_quit (main_loop);
+	return TRUE;
+}
+#else
 static gboolean
 window_deleted (GtkWidget *widget,
                 GdkEvent *event,
@@ -36,6 +53,243 @@ window_deleted (GtkWidget *widget,
 	g_main_loop_quit (main_loop);
 	return TRUE;
 }
+#endif
+
+static glong
+get_rss_kib (void)
+{
+	g_autofree char *statm = NULL;
+	glong size, resident;
+
+	if (!g_file_get_contents ("/proc/self/statm", &statm, NULL, NULL))
+		return -1;
+	if (sscanf (statm, "%ld %ld", &size, &resident) != 2)
+		return -1;
+
+	return resident * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/* Connection editors create an editor for each VPN they list. See what
+ * that costs. The first instance pays for loading the module and class
+ * initialization and is reported separately. */
+static gboolean
+instantiate (NMVpnEditorPlugin *plugin,
+             NMConnection *connection,
+             int count,
+             GError **error)
+{
+	g_autoptr(GPtrArray) editors = g_ptr_array_new_with_free_func (g_object_unref);
+	NMVpnEditor *editor;
+	gint64 start;
+	glong rss;
+	int i;
+
+	start = g_get_monotonic_time ();
+	editor = nm_vpn_editor_plugin_get_editor (plugin, connection, error);
+	if (!editor)
+		return FALSE;
+	g_print ("first editor: %" G_GINT64_FORMAT " us\n", g_get_monotonic_time () - start);
+	g_ptr_array_add (editors, editor);
+
+	rss = get_rss_kib ();
+	start = g_get_monotonic_time ();
+	for (i = 0; i < count; i++) {
+		editor = nm_vpn_editor_plugin_get_editor (plugin, connection, error);
+		if (!editor)
+			return FALSE;
+		g_ptr_array_add (editors, editor);
+	}
+	g_print ("%d editors: %.1f us, %.1f KiB RSS each\n", count,
+	         (double) (g_get_monotonic_time () - start) / count,
+	         (double) (get_rss_kib () - rss) / count);
+
+	return TRUE;
+}
+
+static NMConnection *
+batch_connection (const char *service_type, int i)
+{
+	NMConnection *connection = nm_simple_connection_new ();
+	g_autofree char *uuid = nm_utils_uuid_generate ();
+	g_autofree char *id = g_strdup_printf ("batch %d", i);
+	g_autofree char *gateway = g_strdup_printf ("gw%d.example.com", i % 100);
+	g_autofree char *username = g_strdup_printf ("user%d", i);
+	g_autofree char *password = g_strdup_printf ("secret%d", i);
+	NMSetting *setting;
+
+	setting = nm_setting_connection_new ();
+	g_object_set (setting,
+	              NM_SETTING_CONNECTION_ID, id,
+	              NM_SETTING_CONNECTION_UUID, uuid,
+	              NM_SETTING_CONNECTION_TYPE, NM_SETTING_VPN_SETTING_NAME,
+	              NULL);
+	nm_connection_add_setting (connection, setting);
+
+	setting = nm_setting_vpn_new ();
+	g_object_set (setting, NM_SETTING_VPN_SERVICE_TYPE, service_type, NULL);
+	nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "gateway", gateway);
+	nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "username", username);
+	nm_setting_vpn_add_secret (NM_SETTING_VPN (setting), "password", password);
+
+	/* Every now and then, the lazily built certificate chooser too. */
+	if (i % 10 == 0) {
+		g_autofree char *ca_cert = g_strdup_printf ("file:///nonexistent/ca-%d.pem", i);
+
+		nm_setting_vpn_add_data_item (NM_SETTING_VPN (setting), "ca-cert", ca_cert);
+	}
+	nm_connection_add_setting (connection, setting);
+
+	return connection;
+}
+
+static gboolean
+check_item (NMSettingVpn *expected, NMSettingVpn *actual, const char *key, gboolean secret, GError **error)
+{
+	const char *want;
+	const char *got;
+
+	if (secret) {
+		want = nm_setting_vpn_get_secret (expected, key);
+		got = nm_setting_vpn_get_secret (actual, key);
+	} else {
+		want = nm_setting_vpn_get_data_item (expected, key);
+		got = nm_setting_vpn_get_data_item (actual, key);
+	}
+
+	if (g_strcmp0 (want, got) == 0)
+		return TRUE;
+
+	g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+	             "%s came back as \"%s\", not \"%s\"",
+	             key, got ? got : "", want ? want : "");
+	return FALSE;
+}
+
+static gboolean
+finalize_timed_out (gpointer user_data)
+{
+	gboolean *timed_out = user_data;
+
+	*timed_out = TRUE;
+	return G_SOURCE_REMOVE;
+}
+
+static int
+compare_gint64 (gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a;
+	gint64 y = *(const gint64 *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * What editing a connection costs, without anyone to click through it:
+ * for each of a bunch of different connections, an editor is created,
+ * which fills in the fields, then the fields are read back into an
+ * empty connection, checked, and the editor destroyed. The widgets are
+ * never shown, but GTK still needs a display, so run this under
+ * xvfb-run or with GDK_BACKEND=broadway.
+ *
+ * An editor that's not finalized once destroyed is reported as leaked.
+ */
+static gboolean
+batch (NMVpnEditorPlugin *plugin,
+       const char *service_type,
+       int count,
+       GError **error)
+{
+	g_autofree gint64 *latencies = g_new (gint64, count);
+	NMVpnEditor *editor;
+#if !GTK_CHECK_VERSION(3,90,0)
+	GtkWidget *widget;
+#endif
+	gboolean timed_out;
+	guint timeout_id;
+	gint64 start;
+	gint64 total = 0;
+	glong rss = 0;
+	guint leaked = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		g_autoptr(NMConnection) connection = batch_connection (service_type, i);
+		g_autoptr(NMConnection) readback = nm_simple_connection_new ();
+		gboolean ok;
+
+		nm_connection_add_setting (readback,
+			g_object_new (NM_TYPE_SETTING_VPN,
+			              "service-type", service_type,
+			              NULL));
+
+		start = g_get_monotonic_time ();
+		editor = nm_vpn_editor_plugin_get_editor (plugin, connection, error);
+		if (!editor)
+			return FALSE;
+		g_object_add_weak_pointer (G_OBJECT (editor), (gpointer *) &editor);
+
+		ok = nm_vpn_editor_update_connection (editor, readback, error);
+
+#if GTK_CHECK_VERSION(3,90,0)
+		/* Never parented, so our reference is the only one. */
+		g_object_unref (editor);
+#else
+		widget = GTK_WIDGET (nm_vpn_editor_get_widget (editor));
+		gtk_widget_destroy (widget);
+		g_object_unref (editor);
+#endif
+		latencies[i] = g_get_monotonic_time () - start;
+		total += latencies[i];
+
+		if (!ok)
+			return FALSE;
+		if (   !check_item (nm_connection_get_setting_vpn (connection),
+		                    nm_connection_get_setting_vpn (readback), "gateway", FALSE, error)
+		    || !check_item (nm_connection_get_setting_vpn (connection),
+		                    nm_connection_get_setting_vpn (readback), "username", FALSE, error)
+		    || !check_item (nm_connection_get_setting_vpn (connection),
+		                    nm_connection_get_setting_vpn (readback), "password", TRUE, error)
+		    || !check_item (nm_connection_get_setting_vpn (connection),
+		                    nm_connection_get_setting_vpn (readback), "ca-cert", FALSE, error)) {
+			return FALSE;
+		}
+
+		/* Let whatever the editor left behind run its course. */
+		timed_out = FALSE;
+		timeout_id = g_timeout_add (FINALIZE_TIMEOUT_MS, finalize_timed_out, &timed_out);
+		while (editor && !timed_out)
+			g_main_context_iteration (NULL, TRUE);
+		if (!timed_out)
+			g_source_remove (timeout_id);
+		while (g_main_context_pending (NULL))
+			g_main_context_iteration (NULL, FALSE);
+
+		if (editor) {
+			g_object_remove_weak_pointer (G_OBJECT (editor), (gpointer *) &editor);
+			leaked++;
+		}
+
+		/* The first one pays for loading the module and the classes. */
+		if (i == 0)
+			rss = get_rss_kib ();
+	}
+
+	qsort (latencies, count, sizeof (gint64), compare_gint64);
+	g_print ("%d editors: %.1f us mean, %" G_GINT64_FORMAT " us min, %" G_GINT64_FORMAT " us median, "
+	         "%" G_GINT64_FORMAT " us p99, %" G_GINT64_FORMAT " us max\n",
+	         count, (double) total / count, latencies[0], latencies[count / 2],
+	         latencies[count * 99 / 100], latencies[count - 1]);
+	g_print ("leaked editors: %u, RSS growth after the first: %ld KiB\n",
+	         leaked, get_rss_kib () - rss);
+
+	if (leaked) {
+		g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+		             "%u of %d editors were never finalized", leaked, count);
+		return FALSE;
+	}
+
+	return TRUE;
+}
 
 int
 main (int argc, char *argv[])
@@ -48,6 +302,15 @@ main (int argc, char *argv[])
 	GtkWidget *widget;
 	g_autoptr(GError) error = NULL;
 	g_autoptr(NMConnection) connection = NULL;
+	g_autoptr(GOptionContext) opt_ctx = NULL;
+	gint instances = 0;
+	gint batch_count = 0;
+
+	GOptionEntry options[] = {
+		{ "instantiate", 0, 0, G_OPTION_ARG_INT, &instances, "Create N editors and report the cost of each", "N" },
+		{ "batch", 0, 0, G_OPTION_ARG_INT, &batch_count, "Edit N generated connections without a window and report the latency and leaks", "N" },
+		{NULL}
+	};
 
 #if GTK_CHECK_VERSION(3,90,0)
 	gtk_init ();
@@ -55,8 +318,15 @@ main (int argc, char *argv[])
 	gtk_init (&argc, &argv);
 #endif
 
+	opt_ctx = g_option_context_new ("libnm-vpn-plugin-<name>.so");
+	g_option_context_add_main_entries (opt_ctx, options, NULL);
+	if (!g_option_context_parse (opt_ctx, &argc, &argv, &error)) {
+		g_printerr ("Error parsing the command line options: %s\n", error->message);
+		return EXIT_FAILURE;
+	}
+
 	if (argc != 2) {
-		g_printerr ("Usage: %s libnm-vpn-plugin-<name>.so\n", argv[0]);
+		g_printerr ("Usage: %s [--instantiate N|--batch N] libnm-vpn-plugin-<name>.so\n", argv[0]);
 		return EXIT_FAILURE;
 	}
 
@@ -75,6 +345,22 @@ main (int argc, char *argv[])
 		              "service-type", service_type,
 		              NULL));
 
+	if (instances > 0) {
+		if (!instantiate (plugin, connection, instances, &error)) {
+			g_printerr ("Error: %s\n", error->message);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (batch_count > 0) {
+		if (!batch (plugin, service_type, batch_count, &error)) {
+			g_printerr ("Error: %s\n", error->message);
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+
 	editor = nm_vpn_editor_plugin_get_editor (plugin, connection, &error);
 	if (!editor) {
 		g_printerr ("Error: %s\n", error->message);
@@ -82,13 +368,20 @@ main (int argc, char *argv[])
 	}
 
 	main_loop = g_main_loop_new (NULL, FALSE);
+	widget = GTK_WIDGET (nm_vpn_editor_get_widget (editor));
+#if GTK_CHECK_VERSION(3,90,0)
+	window = gtk_window_new ();
+	g_signal_connect (G_OBJECT (window), "close-request", G_CALLBACK (window_close_request), main_loop);
+	gtk_window_set_child (GTK_WINDOW (window), widget);
+	gtk_window_present (GTK_WINDOW (window));
+#else
 	window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
 	gtk_widget_show (window);
 	g_signal_connect (G_OBJECT (window), "delete-event", G_CALLBACK (window_deleted), main_loop);
 
-	widget = GTK_WIDGET (nm_vpn_editor_get_widget (editor));
 	gtk_widget_show (widget);
 	gtk_container_add (GTK_CONTAINER (window), widget);
+#endif
 	g_main_loop_run (main_loop);
 
 	if (!nm_vpn_editor_update_connection (editor, connection, &error)) {
@@ -96,7 +389,11 @@ main (int argc, char *argv[])
 		return EXIT_FAILURE;
 	}
 
+#if GTK_CHECK_VERSION(3,90,0)
+	gtk_window_destroy (GTK_WINDOW (window));
+#else
 	gtk_widget_destroy (widget);
+#endif
 	nm_connection_dump (connection);
 
 	return EXIT_SUCCESS;